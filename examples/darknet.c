@@ -4,7 +4,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-extern void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen, int close_quantization);
+extern void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen, int close_quantization, int width, int height, int tiled, float overlap);
 extern void run_detector(int argc, char **argv);
 extern void run_segmenter(int argc, char **argv);
 
@@ -185,6 +185,41 @@ void denormalize_net(char *cfgfile, char *weightfile, char *outfile)
     save_weights(net, outfile);
 }
 
+void int4_net(char *cfgfile, char *weightfile, char *outfile)
+{
+    gpu_index = -1;
+    network *net = parse_network_cfg(cfgfile, 0);
+    int *int4 = calloc(net->n, sizeof(int));
+    int i;
+    // the source weights are plain uint8, read them before switching layers to the packed format
+    for(i = 0; i < net->n; ++i){
+        int4[i] = net->layers[i].int4_flag;
+        net->layers[i].int4_flag = 0;
+    }
+    load_weights(net, weightfile);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == CONVOLUTIONAL && int4[i]){
+            quantize_convolutional_weights_int4(l);
+            net->layers[i].int4_flag = 1;
+            printf("layer %3d: %d weights packed to int4\n", i, l.nweights);
+        }
+    }
+    save_weights(net, outfile);
+    free(int4);
+}
+
+void tune_net(char *cfgfile, char *weightfile, char *cachefile)
+{
+    gpu_index = -1;
+    network *net = parse_network_cfg(cfgfile, 0);
+    if(!cachefile) cachefile = net->tune_cache ? net->tune_cache : "darknet.tune";
+    // skip the load-time pass, every layer is re-timed below
+    net->tune_cache = 0;
+    if(weightfile && weightfile[0]) load_weights(net, weightfile);
+    tune_network(net, cachefile, 2);
+}
+
 void mkimg(char *cfgfile, char *weightfile, int h, int w, int num, char *prefix)
 {
     network *net = load_network(cfgfile, weightfile, 0);
@@ -247,7 +282,45 @@ int main(int argc, char **argv)
         char *outfile = find_char_arg(argc, argv, "-out", 0);
         int fullscreen = find_arg(argc, argv, "-fullscreen");
         int quantize = find_int_arg(argc, argv, "-quantization", 0);
-        test_detector("cfg/coco.data", argv[2], argv[3], filename, thresh, .5, outfile, fullscreen, quantize);
+        test_detector("cfg/coco.data", argv[2], argv[3], filename, thresh, .5, outfile, fullscreen, quantize, 0, 0, 0, 0);
+    } else if (0 == strcmp(argv[1], "tune")){
+        if(argc < 3){
+            fprintf(stderr, "usage: %s %s [cfg] [weights] [-cache file]\n", argv[0], argv[1]);
+            return 0;
+        }
+        char *cache = find_char_arg(argc, argv, "-cache", 0);
+        tune_net(argv[2], (argc > 3 && argv[3]) ? argv[3] : 0, cache);
+    } else if (0 == strcmp(argv[1], "int4")){
+        if(argc < 5){
+            fprintf(stderr, "usage: %s %s [cfg] [weights] [outweights]\n", argv[0], argv[1]);
+            return 0;
+        }
+        int4_net(argv[2], argv[3], argv[4]);
+    } else if (0 == strcmp(argv[1], "prune")){
+        if(argc < 7){
+            fprintf(stderr, "usage: %s %s [cfg] [weights] [ratio] [outcfg] [outweights] [-metric bn|l1]\n", argv[0], argv[1]);
+            return 0;
+        }
+        char *metric = find_char_arg(argc, argv, "-metric", "bn");
+        prune_channels(argv[2], argv[3], atof(argv[4]), metric, argv[5], argv[6]);
+    } else if (0 == strcmp(argv[1], "compile")){
+        char *prefix = find_char_arg(argc, argv, "-prefix", "model");
+        if(argc < 5 || !argv[4]){
+            fprintf(stderr, "usage: %s %s [cfg] [weights] [out.c] [-prefix name]\n", argv[0], argv[1]);
+            return 0;
+        }
+        compile_network(argv[2], argv[3], argv[4], prefix);
+    } else if (0 == strcmp(argv[1], "gemm")){
+        if(test_cpu_gemm()) return 1;
+    } else if (0 == strcmp(argv[1], "qat")){
+        if(argc < 3){
+            fprintf(stderr, "usage: %s %s [cfg] [weights]\n", argv[0], argv[1]);
+            return 0;
+        }
+        network *net = load_network(argv[2], (argc > 3) ? argv[3] : 0, 0);
+        int failed = test_qat_routes(net);
+        free_network(net);
+        if(failed) return 1;
     } else {
         printf("Not an option: %s\n", argv[1]);
     }
@@ -10,6 +10,8 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     list *options = read_data_cfg(datacfg);
     char *train_images = option_find_str(options, "train", "data/train.list");
     char *backup_directory = option_find_str(options, "backup", "/backup/");
+    int prefetch = option_find_int(options, "prefetch", 3);
+    char *shards = option_find_str(options, "shards", 0);
 
     srand(time(0));
     char *base = basecfg(cfgfile);
@@ -33,7 +35,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 
     int imgs = net->batch * net->subdivisions * ngpus;
     printf("Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
-    data train, buffer;
+    data train;
 
     layer l = net->layers[net->n - 1];
 
@@ -52,12 +54,16 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     args.classes = classes;
     args.jitter = jitter;
     args.num_boxes = l.max_boxes;
-    args.d = &buffer;
     args.type = DETECTION_DATA;
     //args.type = INSTANCE_DATA;
     args.threads = 64;
+    if(shards){
+        args.shards = open_shards(shards);
+        args.m = shard_set_size(args.shards);
+    }
 
-    pthread_t load_thread = load_data(args);
+    data_pool *pool = make_data_pool(args, prefetch);
+    checkpoint_writer *checkpoints = make_checkpoint_writer();
     double time;
     int count = 0;
     //while(i*imgs < N*120){
@@ -68,13 +74,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             if (get_current_batch(net)+200 > net->max_batches) dim = 608;
             //int dim = (rand() % 4 + 16) * 32;
             printf("%d\n", dim);
-            args.w = dim;
-            args.h = dim;
-
-            pthread_join(load_thread, 0);
-            train = buffer;
-            free_data(train);
-            load_thread = load_data(args);
+            resize_data_pool(pool, dim, dim);
 
             #pragma omp parallel for
             for(i = 0; i < ngpus; ++i){
@@ -83,9 +83,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             net = nets[0];
         }
         time=what_time_is_it_now();
-        pthread_join(load_thread, 0);
-        train = buffer;
-        load_thread = load_data(args);
+        train = get_pool_data(pool);
 
         /*
            int k;
@@ -111,7 +109,9 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
            }
          */
 
-        printf("Loaded: %lf seconds\n", what_time_is_it_now()-time);
+        double stall, images_per_second;
+        data_pool_stats(pool, &stall, &images_per_second);
+        printf("Loaded: %lf seconds, %.1f images/s loader\n", stall, images_per_second);
 
         time=what_time_is_it_now();
         float loss = 0;
@@ -135,7 +135,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #endif
             char buff[256];
             sprintf(buff, "%s/%s.backup", backup_directory, base);
-            save_weights(net, buff);
+            save_weights_async(checkpoints, net, buff);
         }
         if(i%10000==0 || (i < 1000 && i%100 == 0)){
 #ifdef GPU
@@ -143,16 +143,19 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #endif
             char buff[256];
             sprintf(buff, "%s/%s_%d.weights", backup_directory, base, i);
-            save_weights(net, buff);
+            save_weights_async(checkpoints, net, buff);
         }
-        free_data(train);
+        release_pool_data(pool, train);
     }
+    free_data_pool(pool);
+    close_shards(args.shards);
 #ifdef GPU
     if(ngpus != 1) sync_nets(nets, ngpus, 0);
 #endif
     char buff[256];
     sprintf(buff, "%s/%s_final.weights", backup_directory, base);
-    save_weights(net, buff);
+    save_weights_async(checkpoints, net, buff);
+    free_checkpoint_writer(checkpoints);
 }
 
 
@@ -757,125 +760,7 @@ void validate_detector_recall(char *datacfg, char *cfgfile, char *weightfile, fl
     }
 }
 
-void validate_detector_f1(char *datacfg, char *cfgfile, char *weightfile, float thresh, float hier_thresh, int close_quantization)
-{
-
-/*     printf("Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
-    srand(time(0)); */
-
-    list *plist = get_paths("/workspace/ygao/benchmark/NOK/2007_test.txt");
-    char **paths = (char **)list_to_array(plist);
-    network *net;
-    float prec[100] = {0};
-    float recl[100] = {0};
-    float ff11[100] = {0};
-    char name[100] = {0};
-    sprintf(name, "test_quant/test_quant.txt");
-    FILE *fp = fopen(name, "a+");
-    for(int index = 50; index < 51; ++index){
-        // sprintf(weightfile, "backup/yolov3-tiny-mask_quant_per_channel_%d0000.weights", index);
-        sprintf(weightfile, "backup/yolov3-tiny-mask_quant_channelwise.backup");
-        net = load_network_cfg(cfgfile, weightfile, close_quantization);
-        net = load_network_weights(cfgfile, weightfile, 0, net);
-        set_batch_network(net, 1);
-        #ifdef QUANTIZATION
-        #ifndef GPU
-            printf("\nQuantinization ...\n");
-            // quantization_weights_and_activations(net);
-            quantization_weights_preprocess(net);
-            printf("Quantinization Complete...\n\n"); 
-        #endif
-        #endif 
-        for(float thre = 0.1; thre < 0.7; thre=thre+0.1){
-            int j, k;
-
-            int m = plist->size;
-            int i=0;
-
-            // thresh = .5;
-            float iou_thresh = .1;
-            float nms = .1;
-
-            int TP_FN = 0;
-            int TP_FP=0;
-            int TP = 0;
-            int proposals = 0;
-            float avg_iou = 0;
-            image im, sized;
-            for(i = 0; i < m; ++i){
-                printf("image: %d, thresh: %f, weights: %d\n", i, thre, index);
-                char *path = paths[i];
-                im = load_image_color(path,0,0);
-                sized = letterbox_image(im, net->w, net->h);
-                float *X = sized.data;
-                #ifdef QUANTIZATION
-                #ifndef GPU
-                quantization_activations_preprocess(net, X);
-                #endif
-                #endif
-                network_predict(net, X);
-                int nboxes = 0;
-                detection *dets = get_network_boxes(net, im.w, im.h, thre, hier_thresh, 0, 1, &nboxes);
-                printf("%d\n", nboxes);
-                if (nms) do_nms_obj(dets, nboxes, 1, nms);                
-
-                char labelpath[4096];
-                find_replace(path, "images", "labels", labelpath);
-                find_replace(labelpath, "JPEGImages", "labels", labelpath);
-                find_replace(labelpath, ".jpg", ".txt", labelpath);
-                find_replace(labelpath, ".JPEG", ".txt", labelpath);
-
-                int num_labels = 0;
-                box_label *truth = read_boxes(labelpath, &num_labels);
-                for(k = 0; k < nboxes; ++k){
-                    if(dets[k].objectness > thre){
-                        ++proposals;
-                    }
-                }
-                printf("number of boxes:%d\n",nboxes);
-                for(k = 0; k < nboxes; ++k){
-                    TP_FP++;
-                }
-                for (j = 0; j < num_labels; ++j) {
-                    ++TP_FN;
-                    box t = {truth[j].x, truth[j].y, truth[j].w, truth[j].h};
-                    // printf("%f:\n",truth[j].x);
-                    float best_iou = 0;
-                    for(k = 0; k < nboxes; ++k){
-                        float iou = box_iou(dets[k].bbox, t);
-                        if(dets[k].objectness > thre && iou > best_iou){
-                            best_iou = iou;
-                        }
-                    }
-                    avg_iou += best_iou;
-                    if(best_iou > iou_thresh){
-                        ++TP;
-                    }
-                }
-                printf("%5d %5d %5d\tRPs/Img: %.2f\tIOU: %.2f%%\tRecall:%.2f%%\n", i, TP, TP_FN, (float)proposals/(i+1), avg_iou*100/TP_FN, 100.*TP/TP_FN);
-                printf("%5d %5d %5d\tRPs/Img: %.2f\tIOU: %.2f%%\tPrecision:%.2f%%\n", i, TP, TP_FP, (float)proposals/(i+1), avg_iou*100/TP_FN, 100.*TP/TP_FP);
-                printf("%5d %5d %5d\tRPs/Img: %.2f\tIOU: %.2f%%\tF1:%.2f%%\n\n", i, TP, (TP_FN+TP_FP)/2, (float)proposals/(i+1), avg_iou*100/TP_FN, 100.*2*TP/(TP_FP+TP_FN));
-                // free(id);
-                free_image(im);
-                free_image(sized);
-                free_detections(dets, nboxes);
-                free_net(net);
-                // free(net);
-                prec[index] = 100.*TP/TP_FP;
-                recl[index] = 100.*TP/TP_FN;
-                ff11[index] = 100.*2*TP/(TP_FP+TP_FN);
-                
-            }
-            fprintf(fp, "index = %d, thresh = %f, recall = %f, precison = %f, f1 score = %f\n", index, thre, recl[index], prec[index], ff11[index]);
-            printf("--------5\n");
-        }
-        
-        free(net);
-    }
-    fclose(fp);
-}
-
-void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen, int close_quantization)
+void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen, int close_quantization, int width, int height, int tiled, float overlap)
 {
     list *options = read_data_cfg(datacfg);
     char *name_list = option_find_str(options, "names", "data/voc.names");
@@ -884,6 +769,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     image **alphabet = load_alphabet();
     network *net = load_network(cfgfile, weightfile, close_quantization);
     set_batch_network(net, 1);
+    if(width && height) set_network_resolution(net, width, height);
     srand(2222222);
     double time;
     char buff[256];
@@ -911,23 +797,32 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
 
 
         float *X = sized.data;
-        net->input = X;
+        // network_detect_tiled reallocates net->input when it changes the batch
+        if(tiled) copy_cpu(net->inputs, X, 1, net->input, 1);
+        else net->input = X;
 #ifdef QUANTIZATION
 #ifndef GPU
     // printf("\nQuantinization ...\n");
+    // with -tiled the whole frame calibrates the input scale and the tiles are quantized with it
     quantization_weights_and_activations(net);
     // printf("Quantinization Complete...\n\n"); 
 #endif
 #endif
         time=what_time_is_it_now();
-        network_predict(net, X);
-        printf("%s: Predicted in %f seconds.\n", input, what_time_is_it_now()-time);
         int nboxes = 0;
-        detection *dets = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes);
+        detection *dets = 0;
+        if(tiled){
+            dets = network_detect_tiled(net, im, overlap, thresh, hier_thresh, nms, &nboxes);
+            printf("%s: Predicted %d tiles in %f seconds.\n", input, net->batch, what_time_is_it_now()-time);
+        }else{
+            network_predict(net, X);
+            printf("%s: Predicted in %f seconds.\n", input, what_time_is_it_now()-time);
+            dets = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes);
+        }
         printf("%d\n", nboxes);
         printf("-----------------------\n");
         //if (nms) do_nms_obj(boxes, probs, l.w*l.h*l.n, l.classes, nms);
-        if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+        if (nms && !tiled) do_nms_sort(dets, nboxes, l.classes, nms);
         draw_detections(im, dets, nboxes, thresh, names, alphabet, l.classes);
         free_detections(dets, nboxes);
         if(outfile){
@@ -949,6 +844,32 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     }
 }
 
+/*
+ * Self-check for -tiled: runs test_detect_tiled on filename, or on a random image
+ * three network widths by two heights, and exits non-zero if the boxes differ.
+ */
+void test_detector_tiled(char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, float overlap)
+{
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, 1);
+#ifdef QUANTIZATION
+#ifndef GPU
+    // load_image_tile quantizes pixels with a fixed 1/255 input scale
+    quantization_weights_and_activations_fixed(net);
+#endif
+#endif
+    srand(2222222);
+    image im = filename ? load_image_color(filename, 0, 0) : make_random_image(3*net->w, 2*net->h, 3);
+    if(im.w <= net->w && im.h <= net->h){
+        fprintf(stderr, "%s: %dx%d is not larger than the %dx%d network\n", filename, im.w, im.h, net->w, net->h);
+        exit(-1);
+    }
+    int bad = test_detect_tiled(net, im, overlap, thresh, hier_thresh);
+    free_image(im);
+    free_network(net);
+    if(bad) error("tiled boxes differ from untiled ones");
+}
+
 void run_detector(int argc, char **argv)
 {
     float thresh = find_float_arg(argc, argv, "-thresh", .5);
@@ -984,15 +905,41 @@ void run_detector(int argc, char **argv)
     int clear = find_arg(argc, argv, "-clear");
     int fullscreen = find_arg(argc, argv, "-fullscreen");
     int close_quantization = find_arg(argc, argv, "-close_quantization");
+    int width = find_int_arg(argc, argv, "-width", 0);
+    int height = find_int_arg(argc, argv, "-height", 0);
+    int tiled = find_arg(argc, argv, "-tiled");
+    float overlap = find_float_arg(argc, argv, "-overlap", .2);
+    int slots = find_int_arg(argc, argv, "-slots", 4);
+    int max_w = find_int_arg(argc, argv, "-max_w", 1920);
+    int max_h = find_int_arg(argc, argv, "-max_h", 1080);
+    int max_batch = find_int_arg(argc, argv, "-max_batch", 1);
+    int max_wait = find_int_arg(argc, argv, "-max_wait", 2000);
+    char *method = find_char_arg(argc, argv, "-method", "percentile");
+    float percentile = find_float_arg(argc, argv, "-percentile", 99.99);
+    int images = find_int_arg(argc, argv, "-images", 500);
+    int size = find_int_arg(argc, argv, "-size", 608);
+    int per_shard = find_int_arg(argc, argv, "-per_shard", 4096);
+    char *threshs = find_char_arg(argc, argv, "-threshs", "0.1,0.2,0.3,0.4,0.5,0.6");
+    char *nms = find_char_arg(argc, argv, "-nms", ".1");
+    float iou = find_float_arg(argc, argv, "-iou", .1);
+    int threads = find_int_arg(argc, argv, "-threads", 1);
+    char *ious = find_char_arg(argc, argv, "-ious", "0.5");
+    int from_results = find_arg(argc, argv, "-from_results");
     char *datacfg = argv[3];
     char *cfg = argv[4];
     char *weights = (argc > 5) ? argv[5] : 0;
     char *filename = (argc > 6) ? argv[6]: 0;
-    if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen, close_quantization);
+    if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen, close_quantization, width, height, tiled, overlap);
+    else if(0==strcmp(argv[2], "test_tiled")) test_detector_tiled(cfg, weights, filename, thresh, hier_thresh, overlap);
+    else if(0==strcmp(argv[2], "serve")) serve_detector(cfg, weights, filename ? filename : "/tmp/darknet.sock", thresh, hier_thresh, slots, max_w, max_h, max_batch, max_wait);
+    else if(0==strcmp(argv[2], "reload")) serve_reload(filename ? filename : "/tmp/darknet.sock", weights);
     else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear);
     else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "valid2")) validate_detector_flip(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "myvalid")) my_validate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(datacfg, cfg, weights, thresh, hier_thresh);
-    else if(0==strcmp(argv[2], "f1")) validate_detector_f1(datacfg, cfg, weights, thresh, hier_thresh, close_quantization);
+    else if(0==strcmp(argv[2], "pack")) pack_detector(datacfg, outfile, size, per_shard);
+    else if(0==strcmp(argv[2], "calibrate")) calibrate_detector(datacfg, cfg, weights, filename, method, percentile, images);
+    else if(0==strcmp(argv[2], "f1")) evaluate_detector_f1(datacfg, cfg, weights, threshs, nms, hier_thresh, iou, close_quantization, outfile, threads);
+    else if(0==strcmp(argv[2], "map")) evaluate_detector_map(datacfg, cfg, weights, ious, from_results, outfile, close_quantization, threads);
 }
@@ -158,6 +158,8 @@ struct layer{
     void (*forward)   (struct layer, struct network);
     void (*backward)  (struct layer, struct network);
     void (*update)    (struct layer, update_args);
+    // float forward with fake quantization, used instead of an inference-only forward while training on CPU
+    void (*forward_qat)   (struct layer, struct network);
     void (*forward_gpu)   (struct layer, struct network);
     void (*backward_gpu)  (struct layer, struct network);
     void (*update_gpu)    (struct layer, update_args, struct network);
@@ -197,6 +199,10 @@ struct layer{
 
     int layer_quant_flag;
     int quant_stop_flag;
+    int int4_flag;
+    int winograd;
+    int tune_tile;
+    int tune_split;
     int fisrt_time_train_fag;
 
     float *M;
@@ -214,6 +220,14 @@ struct layer{
 
     uint8_t * input_uint8;
     uint8_t * weights_uint8;
+    uint8_t * weights_int4;
+    int16_t * weights_winograd;
+
+    uint64_t * weights_bit;
+    float * weights_bit_scales;
+    uint64_t * input_bit;
+    uint64_t * input_bit_mask;
+    int * input_bit_valid;
     float* weights_norm;
     int32_t * biases_int32;
     int32_t * output_int32;
@@ -628,6 +642,17 @@ typedef struct network{
     float clip;
 
     int close_quantization;
+    char *tune_cache;
+    int autotune;
+    int depth_first;
+    int depth_first_rows;
+    int memory_plan;
+    int drop_float_weights;
+    uint8_t *memory_pool;
+    size_t memory_pool_size;
+    struct resolution_plan *resolution_plans;
+    int graph_threads;
+    struct layer_graph *graph;
 
 #ifdef GPU
     float *input_gpu;
@@ -687,6 +712,8 @@ typedef enum {
     CLASSIFICATION_DATA, DETECTION_DATA, CAPTCHA_DATA, REGION_DATA, IMAGE_DATA, COMPARE_DATA, WRITING_DATA, SWAG_DATA, TAG_DATA, OLD_CLASSIFICATION_DATA, STUDY_DATA, DET_DATA, SUPER_DATA, LETTERBOX_DATA, REGRESSION_DATA, SEGMENTATION_DATA, INSTANCE_DATA, ISEG_DATA
 } data_type;
 
+typedef struct shard_set shard_set;
+
 typedef struct load_args{
     int threads;
     char **paths;
@@ -718,6 +745,7 @@ typedef struct load_args{
     image *resized;
     data_type type;
     tree *hierarchy;
+    shard_set *shards;
 } load_args;
 
 typedef struct{
@@ -762,6 +790,17 @@ typedef struct network_state {
 } network_state;
 
 pthread_t load_data(load_args args);
+typedef struct data_pool data_pool;
+data_pool *make_data_pool(load_args args, int depth);
+data get_pool_data(data_pool *p);
+void release_pool_data(data_pool *p, data d);
+void resize_data_pool(data_pool *p, int w, int h);
+void data_pool_stats(data_pool *p, double *stall, double *images_per_second);
+void free_data_pool(data_pool *p);
+
+shard_set *open_shards(char *filename);
+int shard_set_size(shard_set *s);
+void close_shards(shard_set *s);
 list *read_data_cfg(char *filename);
 list *read_cfg(char *filename);
 unsigned char *read_file(char *filename);
@@ -831,6 +870,7 @@ image make_random_image(int w, int h, int c);
 
 void denormalize_connected_layer(layer l);
 void denormalize_convolutional_layer(layer l);
+void quantize_convolutional_weights_int4(layer l);
 void statistics_connected_layer(layer l);
 void rescale_weights(layer l, float scale, float trans);
 void rgbgr_weights(layer l);
@@ -847,7 +887,15 @@ network *parse_network_cfg(char *filename, int close_quantization);
 void save_weights(network *net, char *filename);
 void load_weights(network *net, char *filename);
 void save_weights_upto(network *net, char *filename, int cutoff);
+typedef struct checkpoint_writer checkpoint_writer;
+checkpoint_writer *make_checkpoint_writer();
+void save_weights_async(checkpoint_writer *w, network *net, char *filename);
+void free_checkpoint_writer(checkpoint_writer *w);
 void load_weights_upto(network *net, char *filename, int start, int cutoff);
+void tune_network(network *net, char *filename, int measure);
+void prune_channels(char *cfgfile, char *weightfile, float ratio, char *metric, char *outcfg, char *outweights);
+void compile_network(char *cfgfile, char *weightfile, char *outfile, char *prefix);
+int test_cpu_gemm();
 
 void zero_objectness(layer l);
 void get_region_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, float tree_thresh, int relative, detection *dets);
@@ -868,6 +916,8 @@ image resize_max(image im, int max);
 image threshold_image(image im, float thresh);
 image mask_to_rgb(image mask);
 int resize_network(network *net, int w, int h);
+int set_network_resolution(network *net, int w, int h);
+void resize_network_batch(network *net, int b);
 void free_matrix(matrix m);
 void test_resize(char *filename);
 int show_image(image p, const char *name, int ms);
@@ -903,6 +953,7 @@ image **load_alphabet();
 image get_network_image(network *net);
 float *network_predict(network *net, float *input);
 void quantization_weights_and_activations(network *net); 
+void quantization_weights_and_activations_fixed(network *net);
 void quantization_weights_preprocess(network *net);
 void quantization_activations_preprocess(network *net, float *input);
 void free_net(network *net); 
@@ -912,6 +963,16 @@ int network_height(network *net);
 float *network_predict_image(network *net, image im);
 void network_detect(network *net, image im, float thresh, float hier_thresh, float nms, detection *dets);
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num);
+detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num);
+detection *network_detect_tiled(network *net, image im, float overlap, float thresh, float hier, float nms, int *num);
+int test_detect_tiled(network *net, image im, float overlap, float thresh, float hier);
+int test_qat_routes(network *net);
+void serve_detector(char *cfgfile, char *weightfile, char *path, float thresh, float hier, int slots, int max_w, int max_h, int max_batch, int max_wait_us);
+int serve_reload(char *path, char *weightfile);
+void calibrate_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile, char *method, float percentile, int images);
+void pack_detector(char *datacfg, char *outprefix, int size, int per_shard);
+void evaluate_detector_f1(char *datacfg, char *cfgfile, char *weightfile, char *thresholds, char *nms_values, float hier_thresh, float iou_thresh, int close_quantization, char *outfile, int threads);
+void evaluate_detector_map(char *datacfg, char *cfgfile, char *weightfile, char *iou_values, int from_results, char *outfile, int close_quantization, int threads);
 void free_detections(detection *dets, int n);
 
 void reset_network_state(network *net, int b);
@@ -966,6 +1027,7 @@ float mean_array(float *a, int n);
 float sum_array(float *a, int n);
 void normalize_array(float *a, int n);
 int *read_intlist(char *s, int *n, int d);
+float *read_floatlist(char *s, int *n, float d);
 size_t rand_size_t();
 float rand_normal();
 float rand_uniform(float min, float max);
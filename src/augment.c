@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "augment.h"
+#include "utils.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define AUGMENT_X86
+#endif
+
+/*
+ * Training augmentation on 8-bit interleaved rgb, e.g. shard records. Placement,
+ * resize and flip are one bilinear pass from the bytes into the planar float
+ * canvas the network reads, and the hsv jitter is a single pass over the canvas.
+ * Both give the same values as place_image, flip_image and the old three pass
+ * rgb_to_hsv, scale, hsv_to_rgb sequence.
+ */
+
+typedef void (*place_row_fn)(unsigned char *r0, unsigned char *r1, float wy0, float wy1,
+        int *xofs, float *wx0, float *wx1, int n, float *out, int plane, int flip);
+typedef void (*distort_fn)(float *r, float *g, float *b, int n, float hue, float sat, float val);
+
+// out-of-range neighbours read as 0, as in get_pixel_extend
+static void place_row_c(unsigned char *r0, unsigned char *r1, float wy0, float wy1,
+        int *xofs, float *wx0, float *wx1, int n, float *out, int plane, int flip, int iw)
+{
+    int i, c;
+    for(i = 0; i < n; ++i){
+        int o = xofs[i];
+        int right = o/3 + 1 < iw;
+        for(c = 0; c < 3; ++c){
+            float a = r0[o + c];
+            float b = r1[o + c];
+            float d0 = right ? r0[o + 3 + c] : 0;
+            float d1 = right ? r1[o + 3 + c] : 0;
+            float val = wy0*wx0[i]*a + wy1*wx0[i]*b + wy0*wx1[i]*d0 + wy1*wx1[i]*d1;
+            out[c*plane + (flip ? -i : i)] = val/255.f;
+        }
+    }
+}
+
+// scalar fallback for the fast span when avx2 is not available
+static void place_row_scalar(unsigned char *r0, unsigned char *r1, float wy0, float wy1,
+        int *xofs, float *wx0, float *wx1, int n, float *out, int plane, int flip)
+{
+    place_row_c(r0, r1, wy0, wy1, xofs, wx0, wx1, n, out, plane, flip, 1 << 30);
+}
+
+static void distort_pixels_c(float *r, float *g, float *b, int n, float hue, float sat, float val)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        float max = three_way_max(r[i], g[i], b[i]);
+        float min = three_way_min(r[i], g[i], b[i]);
+        float delta = max - min;
+        float h = 0, s = 0, v = max*val;
+        if(max != 0 && delta != 0){
+            s = delta/max*sat;
+            if(r[i] == max){
+                h = (g[i] - b[i]) / delta;
+            } else if (g[i] == max) {
+                h = 2 + (b[i] - r[i]) / delta;
+            } else {
+                h = 4 + (r[i] - g[i]) / delta;
+            }
+            if (h < 0) h += 6;
+            h = h/6.f + hue;
+            if (h > 1) h -= 1;
+            if (h < 0) h += 1;
+        }
+        float rr, gg, bb;
+        if(s == 0){
+            rr = gg = bb = v;
+        }else{
+            h = 6*h;
+            int index = floorf(h);
+            float f = h - index;
+            float p = v*(1-s);
+            float q = v*(1-s*f);
+            float t = v*(1-s*(1-f));
+            if(index == 0){
+                rr = v; gg = t; bb = p;
+            } else if(index == 1){
+                rr = q; gg = v; bb = p;
+            } else if(index == 2){
+                rr = p; gg = v; bb = t;
+            } else if(index == 3){
+                rr = p; gg = q; bb = v;
+            } else if(index == 4){
+                rr = t; gg = p; bb = v;
+            } else {
+                rr = v; gg = p; bb = q;
+            }
+        }
+        r[i] = constrain(0, 1, rr);
+        g[i] = constrain(0, 1, gg);
+        b[i] = constrain(0, 1, bb);
+    }
+}
+
+#ifdef AUGMENT_X86
+// 8 columns per step: each tap is a 32-bit gather at a byte offset masked down to its low byte
+__attribute__((target("avx2,fma")))
+static void place_row_avx2(unsigned char *r0, unsigned char *r1, float wy0, float wy1,
+        int *xofs, float *wx0, float *wx1, int n, float *out, int plane, int flip)
+{
+    int i, c;
+    __m256i mask = _mm256_set1_epi32(0xff);
+    __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256 vy0 = _mm256_set1_ps(wy0);
+    __m256 vy1 = _mm256_set1_ps(wy1);
+    __m256 scale = _mm256_set1_ps(255.f);
+    for(i = 0; i + 8 <= n; i += 8){
+        __m256i o = _mm256_loadu_si256((__m256i *)(xofs + i));
+        __m256 x0 = _mm256_loadu_ps(wx0 + i);
+        __m256 x1 = _mm256_loadu_ps(wx1 + i);
+        __m256 w00 = _mm256_mul_ps(vy0, x0);
+        __m256 w10 = _mm256_mul_ps(vy1, x0);
+        __m256 w01 = _mm256_mul_ps(vy0, x1);
+        __m256 w11 = _mm256_mul_ps(vy1, x1);
+        for(c = 0; c < 3; ++c){
+            __m256 a  = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_i32gather_epi32((int *)(r0 + c), o, 1), mask));
+            __m256 b  = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_i32gather_epi32((int *)(r1 + c), o, 1), mask));
+            __m256 d0 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_i32gather_epi32((int *)(r0 + 3 + c), o, 1), mask));
+            __m256 d1 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_i32gather_epi32((int *)(r1 + 3 + c), o, 1), mask));
+            __m256 val = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(w00, a), _mm256_mul_ps(w10, b)),
+                        _mm256_mul_ps(w01, d0)), _mm256_mul_ps(w11, d1));
+            val = _mm256_div_ps(val, scale);
+            if(flip){
+                _mm256_storeu_ps(out + c*plane - i - 7, _mm256_permutevar8x32_ps(val, reverse));
+            }else{
+                _mm256_storeu_ps(out + c*plane + i, val);
+            }
+        }
+    }
+    place_row_c(r0, r1, wy0, wy1, xofs + i, wx0 + i, wx1 + i, n - i, out + (flip ? -i : i), plane, flip, 1 << 30);
+}
+
+// branch free rgb -> hsv -> scaled -> rgb, the if chains become blends on compare masks
+__attribute__((target("avx2,fma")))
+static void distort_pixels_avx2(float *r, float *g, float *b, int n, float hue, float sat, float val)
+{
+    int i;
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1);
+    __m256 two = _mm256_set1_ps(2);
+    __m256 four = _mm256_set1_ps(4);
+    __m256 six = _mm256_set1_ps(6);
+    __m256 vhue = _mm256_set1_ps(hue);
+    __m256 vsat = _mm256_set1_ps(sat);
+    __m256 vval = _mm256_set1_ps(val);
+    for(i = 0; i + 8 <= n; i += 8){
+        __m256 vr = _mm256_loadu_ps(r + i);
+        __m256 vg = _mm256_loadu_ps(g + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        __m256 max = _mm256_max_ps(vr, _mm256_max_ps(vg, vb));
+        __m256 min = _mm256_min_ps(vr, _mm256_min_ps(vg, vb));
+        __m256 delta = _mm256_sub_ps(max, min);
+        __m256 gray = _mm256_or_ps(_mm256_cmp_ps(max, zero, _CMP_EQ_OQ), _mm256_cmp_ps(delta, zero, _CMP_EQ_OQ));
+        __m256 safe_max = _mm256_blendv_ps(max, one, gray);
+        __m256 safe_delta = _mm256_blendv_ps(delta, one, gray);
+
+        __m256 s = _mm256_blendv_ps(_mm256_mul_ps(_mm256_div_ps(delta, safe_max), vsat), zero, gray);
+        __m256 v = _mm256_mul_ps(max, vval);
+        __m256 hr = _mm256_div_ps(_mm256_sub_ps(vg, vb), safe_delta);
+        __m256 hg = _mm256_add_ps(two, _mm256_div_ps(_mm256_sub_ps(vb, vr), safe_delta));
+        __m256 hb = _mm256_add_ps(four, _mm256_div_ps(_mm256_sub_ps(vr, vg), safe_delta));
+        __m256 h = _mm256_blendv_ps(hb, hg, _mm256_cmp_ps(vg, max, _CMP_EQ_OQ));
+        h = _mm256_blendv_ps(h, hr, _mm256_cmp_ps(vr, max, _CMP_EQ_OQ));
+        h = _mm256_add_ps(h, _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_LT_OQ), six));
+        h = _mm256_add_ps(_mm256_div_ps(h, six), vhue);
+        h = _mm256_sub_ps(h, _mm256_and_ps(_mm256_cmp_ps(h, one, _CMP_GT_OQ), one));
+        h = _mm256_add_ps(h, _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_LT_OQ), one));
+
+        h = _mm256_mul_ps(six, h);
+        __m256 index = _mm256_floor_ps(h);
+        __m256 f = _mm256_sub_ps(h, index);
+        __m256 p = _mm256_mul_ps(v, _mm256_sub_ps(one, s));
+        __m256 q = _mm256_mul_ps(v, _mm256_sub_ps(one, _mm256_mul_ps(s, f)));
+        __m256 t = _mm256_mul_ps(v, _mm256_sub_ps(one, _mm256_mul_ps(s, _mm256_sub_ps(one, f))));
+
+        // index 5 and the h == 1 edge case (index 6) share the fallthrough
+        __m256 rr = v, gg = p, bb = q, m;
+        m = _mm256_cmp_ps(index, four, _CMP_EQ_OQ);
+        rr = _mm256_blendv_ps(rr, t, m); gg = _mm256_blendv_ps(gg, p, m); bb = _mm256_blendv_ps(bb, v, m);
+        m = _mm256_cmp_ps(index, _mm256_set1_ps(3), _CMP_EQ_OQ);
+        rr = _mm256_blendv_ps(rr, p, m); gg = _mm256_blendv_ps(gg, q, m); bb = _mm256_blendv_ps(bb, v, m);
+        m = _mm256_cmp_ps(index, two, _CMP_EQ_OQ);
+        rr = _mm256_blendv_ps(rr, p, m); gg = _mm256_blendv_ps(gg, v, m); bb = _mm256_blendv_ps(bb, t, m);
+        m = _mm256_cmp_ps(index, one, _CMP_EQ_OQ);
+        rr = _mm256_blendv_ps(rr, q, m); gg = _mm256_blendv_ps(gg, v, m); bb = _mm256_blendv_ps(bb, p, m);
+        m = _mm256_cmp_ps(index, zero, _CMP_EQ_OQ);
+        rr = _mm256_blendv_ps(rr, v, m); gg = _mm256_blendv_ps(gg, t, m); bb = _mm256_blendv_ps(bb, p, m);
+        m = _mm256_cmp_ps(s, zero, _CMP_EQ_OQ);
+        rr = _mm256_blendv_ps(rr, v, m); gg = _mm256_blendv_ps(gg, v, m); bb = _mm256_blendv_ps(bb, v, m);
+
+        _mm256_storeu_ps(r + i, _mm256_min_ps(_mm256_max_ps(rr, zero), one));
+        _mm256_storeu_ps(g + i, _mm256_min_ps(_mm256_max_ps(gg, zero), one));
+        _mm256_storeu_ps(b + i, _mm256_min_ps(_mm256_max_ps(bb, zero), one));
+    }
+    distort_pixels_c(r + i, g + i, b + i, n - i, hue, sat, val);
+}
+#endif
+
+static int use_avx2()
+{
+    static int cached = -1;
+    if(cached >= 0) return cached;
+    int ok = 0;
+#ifdef AUGMENT_X86
+    __builtin_cpu_init();
+    ok = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    cached = ok;
+    return cached;
+}
+
+static place_row_fn select_place_row()
+{
+#ifdef AUGMENT_X86
+    if(use_avx2()) return place_row_avx2;
+#endif
+    return place_row_scalar;
+}
+
+static distort_fn select_distort()
+{
+#ifdef AUGMENT_X86
+    if(use_avx2()) return distort_pixels_avx2;
+#endif
+    return distort_pixels_c;
+}
+
+/*
+ * place_image for 8-bit interleaved rgb, mirrored about the canvas centre when
+ * flip is set (flip_image afterwards). Columns whose right neighbour and the
+ * 3 bytes past it stay inside the row go through the gather kernel, the rest
+ * and rows past the bottom edge take the checked path against a zero row.
+ */
+void place_image_uint8(unsigned char *data, int iw, int ih, int w, int h, int dx, int dy, int flip, image canvas)
+{
+    int x, y;
+    int x0 = dx < 0 ? -dx : 0;
+    int x1 = (w < canvas.w - dx) ? w : canvas.w - dx;
+    int y0 = dy < 0 ? -dy : 0;
+    int y1 = (h < canvas.h - dy) ? h : canvas.h - dy;
+    if(x1 <= x0 || y1 <= y0) return;
+
+    int n = x1 - x0;
+    int plane = canvas.w*canvas.h;
+    int *xofs = calloc(n, sizeof(int));
+    float *wx0 = calloc(n, sizeof(float));
+    float *wx1 = calloc(n, sizeof(float));
+    unsigned char *zeros = calloc(iw*3 + 4, 1);
+    int fast = 0;
+    for(x = x0; x < x1; ++x){
+        float rx = ((float)x / w) * iw;
+        int ix = (int) floorf(rx);
+        if(ix > iw - 1) ix = iw - 1;
+        float fx = rx - ix;
+        xofs[x - x0] = ix*3;
+        wx0[x - x0] = 1 - fx;
+        wx1[x - x0] = fx;
+        if(ix + 1 <= iw - 2) fast = x - x0 + 1;
+    }
+    place_row_fn row = select_place_row();
+
+    for(y = y0; y < y1; ++y){
+        float ry = ((float)y / h) * ih;
+        int iy = (int) floorf(ry);
+        float fy = ry - iy;
+        unsigned char *r0 = iy < ih ? data + iy*iw*3 : zeros;
+        unsigned char *r1 = iy + 1 < ih ? data + (iy + 1)*iw*3 : zeros;
+        int ox = flip ? canvas.w - 1 - (x0 + dx) : x0 + dx;
+        float *out = canvas.data + (y + dy)*canvas.w + ox;
+        row(r0, r1, 1 - fy, fy, xofs, wx0, wx1, fast, out, plane, flip);
+        place_row_c(r0, r1, 1 - fy, fy, xofs + fast, wx0 + fast, wx1 + fast, n - fast,
+                out + (flip ? -fast : fast), plane, flip, iw);
+    }
+    free(xofs);
+    free(wx0);
+    free(wx1);
+    free(zeros);
+}
+
+// distort_image in one pass, hue shift and saturation / exposure scales on rgb in [0,1]
+void distort_image_rgb(image im, float hue, float sat, float val)
+{
+    int n = im.w*im.h;
+    select_distort()(im.data, im.data + n, im.data + 2*n, n, hue, sat, val);
+}
@@ -0,0 +1,8 @@
+#ifndef AUGMENT_H
+#define AUGMENT_H
+#include "image.h"
+
+void place_image_uint8(unsigned char *data, int iw, int ih, int w, int h, int dx, int dy, int flip, image canvas);
+void distort_image_rgb(image im, float hue, float sat, float val);
+
+#endif
@@ -1,4 +1,6 @@
 #include "blas.h"
+#include "shortcut_layer.h"
+#include "convolutional_layer.h"
 #include "omp.h"
 #include <stdint.h>
 
@@ -105,6 +107,150 @@ void fake_quant_with_min_max_channel(int size_channel, float *input, uint8_t *in
     }
 }
 
+// min and max of x together with 0, written so the compiler vectorizes both reductions
+static void min_max_cpu(int n, float *x, float *min_value, float *max_value)
+{
+    int i;
+    float lo = 0, hi = 0;
+    for(i = 0; i < n; ++i){
+        lo = x[i] < lo ? x[i] : lo;
+        hi = x[i] > hi ? x[i] : hi;
+    }
+    *min_value = lo;
+    *max_value = hi;
+}
+
+/*
+ * Folds a batch min/max into the tracked range (EMA for inputs and activations, weights
+ * use their own min/max) and nudges it so zero is exact, same as
+ * fake_quant_with_min_max_channel. Returns 0 for an all-zero range.
+ */
+static int update_quant_range(float lo, float hi, float *min_value, float *max_value, int func_type, float decay,
+                              float *scale, uint8_t *zero_point, float *nudged_min, float *nudged_max)
+{
+    const float quant_min = QUANT_NEGATIVE_LIMIT;
+    const float quant_max = QUANT_POSITIVE_LIMIT;
+    if(func_type != WEIGHT_QUANT){
+        if(*min_value != 0 || *max_value != 0){
+            *min_value = *min_value - (*min_value - lo) * (1 - decay);
+            *max_value = *max_value - (*max_value - hi) * (1 - decay);
+        }else{
+            *min_value = lo;
+            *max_value = hi;
+        }
+        lo = *min_value;
+        hi = *max_value;
+    }
+    if(lo == 0 && hi == 0){
+        *scale = 1;
+        *zero_point = 0;
+        return 0;
+    }
+    float s = (hi - lo) / (quant_max - quant_min);
+    double initial_zero_point = quant_min - lo / s;
+    uint8_t zp;
+    if(initial_zero_point <= quant_min){
+        zp = quant_min;
+    }else if(initial_zero_point >= quant_max){
+        zp = quant_max;
+    }else{
+        zp = round(initial_zero_point);
+    }
+    *scale = s;
+    *zero_point = zp;
+    *nudged_min = (quant_min - zp) * s;
+    *nudged_max = (quant_max - zp) * s;
+    return 1;
+}
+
+// quantize and dequantize in place, values are >= 0 after the shift so truncating x + .5 rounds
+static void fake_quant_range_cpu(int n, float *x, float nudged_min, float nudged_max, float scale, uint8_t *mask)
+{
+    int i;
+    if(mask){
+        for(i = 0; i < n; ++i) mask[i] = (x[i] >= nudged_min && x[i] <= nudged_max);
+    }
+    for(i = 0; i < n; ++i){
+        float v = x[i] < nudged_min ? nudged_min : (x[i] > nudged_max ? nudged_max : x[i]);
+        int q = (int)((v - nudged_min) / scale + .5f);
+        x[i] = q * scale + nudged_min;
+    }
+}
+
+#define FAKE_QUANT_CHUNK 16384
+
+/*
+ * CPU training counterpart of fake_quant_with_min_max_channel, for n channels of size
+ * values each. Channels run in parallel, a single channel is split into chunks instead.
+ * min_value/max_value are only read for inputs and activations. mask, if given, is set
+ * to 1 where x fell inside the range, which is where the straight-through estimator
+ * lets the gradient through.
+ */
+void fake_quant_cpu(int n, int size, float *x, float *min_value, float *max_value,
+                    float *scales, uint8_t *zero_points, int func_type, float decay, uint8_t *mask)
+{
+    int i;
+    if(n > 1){
+        #pragma omp parallel for
+        for(i = 0; i < n; ++i){
+            float lo, hi, nudged_min, nudged_max;
+            min_max_cpu(size, x + i*size, &lo, &hi);
+            if(update_quant_range(lo, hi, min_value ? min_value + i : 0, max_value ? max_value + i : 0, func_type, decay,
+                                  scales + i, zero_points + i, &nudged_min, &nudged_max)){
+                fake_quant_range_cpu(size, x + i*size, nudged_min, nudged_max, scales[i], mask ? mask + i*size : 0);
+            }else if(mask){
+                memset(mask + i*size, 1, size);
+            }
+        }
+        return;
+    }
+    int c;
+    int chunks = (size + FAKE_QUANT_CHUNK - 1) / FAKE_QUANT_CHUNK;
+    float lo = 0, hi = 0, nudged_min, nudged_max;
+    #pragma omp parallel for reduction(min:lo) reduction(max:hi)
+    for(c = 0; c < chunks; ++c){
+        float clo, chi;
+        min_max_cpu(min(FAKE_QUANT_CHUNK, size - c*FAKE_QUANT_CHUNK), x + c*FAKE_QUANT_CHUNK, &clo, &chi);
+        lo = clo < lo ? clo : lo;
+        hi = chi > hi ? chi : hi;
+    }
+    if(!update_quant_range(lo, hi, min_value, max_value, func_type, decay, scales, zero_points, &nudged_min, &nudged_max)){
+        if(mask) memset(mask, 1, size);
+        return;
+    }
+    #pragma omp parallel for
+    for(c = 0; c < chunks; ++c){
+        int offset = c*FAKE_QUANT_CHUNK;
+        fake_quant_range_cpu(min(FAKE_QUANT_CHUNK, size - offset), x + offset, nudged_min, nudged_max, scales[0], mask ? mask + offset : 0);
+    }
+}
+
+int qat_enabled(layer l, network net)
+{
+    return net.train && l.layer_quant_flag && *net.seen > net.quant_start_step;
+}
+
+// fake quantize a quantized layer's activations while training on CPU
+void fake_quant_layer_output(layer l, network net)
+{
+    if(!qat_enabled(l, net)) return;
+    // output_uint8_final is unused while training, it keeps the STE mask for backward
+    fake_quant_cpu(1, l.outputs*l.batch, l.output, l.min_activ_value, l.max_activ_value,
+            l.activ_data_uint8_scales, l.activ_data_uint8_zero_point, ACTIV_QUANT, .999, l.output_uint8_final);
+}
+
+// straight-through estimator: the gradient passes where the activation was not clamped
+void backward_fake_quant_layer_output(layer l, network net)
+{
+    int i;
+    if(!qat_enabled(l, net)) return;
+    // a single input route keeps no mask, its input layer clamps the gradient
+    if(l.type == ROUTE && l.n == 1) return;
+    for(i = 0; i < l.outputs*l.batch; ++i){
+        l.delta[i] *= l.output_uint8_final[i];
+    }
+}
+
 void quant_weights_with_min_max_channel(int size_channel, float *input, uint8_t *input_int8, int16_t *input_int16, int16_t *zero_point_int16, int size_feature, 
                                 float *quantzation_scale, uint8_t *quantization_zero_point, int zp_flag) 
 {
@@ -182,7 +328,8 @@ void quantization_weights_preprocess(network *net)
             }
             if(l->layer_quant_flag){
                 // quant_weights_with_min_max_channel(l->n, l->weights, l->weights_uint8, l->weights_int16, l->zero_point_int16, l->c*l->size*l->size, l->weight_data_uint8_scales, l->weight_data_uint8_zero_point, 1);
-                for(int j = 0; j < l->n; ++j){
+                // released int4 layers have no int16 copy to fill
+                for(int j = 0; l->weights_int16 && j < l->n; ++j){
                     for(int ji = 0; ji < l->c*l->size*l->size; ++ji){
                         int index = j*l->c*l->size*l->size + ji;
                         assert(l->weight_data_uint8_scales[j] != 0);
@@ -195,10 +342,14 @@ void quantization_weights_preprocess(network *net)
                 if (i > 0)
                 {
                     l->input_data_uint8_scales[0] = net->layers[i-1].activ_data_uint8_scales[0];
-                    l->input_data_uint8_zero_point = net->layers[i-1].activ_data_uint8_zero_point;
+                    l->input_data_uint8_zero_point[0] = net->layers[i-1].activ_data_uint8_zero_point[0];
                 }
             }
-
+            // sign-pack again now that batch norm is folded into the weights
+            if(l->weights_bit) pack_convolutional_bit_weights(l, net->drop_float_weights);
+        }
+        if(l->type == SHORTCUT && l->layer_quant_flag){
+            quantize_shortcut_layer(net, i);
         }
         extern const char* type_array[];
         int inheritance_type = (l->type == MAXPOOL || l->type == ROUTE || l->type == UPSAMPLE);
@@ -236,9 +387,7 @@ void quantization_activations_preprocess(network *net, float *input)
         if (l->type == CONVOLUTIONAL && l->layer_quant_flag){
             for(int ii = 0; ii < l->n; ++ii){
                 l->mult_zero_point[ii] = l->c*l->size*l->size*l->input_data_uint8_zero_point[0]*l->weight_data_uint8_zero_point[ii];
-                for (int jj = 0; jj < l->c*l->size*l->size; ++jj){
-                    l->weights_sum_int[ii] += l->weights_uint8[ii*l->c*l->size*l->size+jj];
-                }
+                l->weights_sum_int[ii] += convolutional_weights_sum(*l, ii);
                 l->weights_sum_int[ii] =  l->mult_zero_point[ii] - l->weights_sum_int[ii] * l->input_data_uint8_zero_point[0];
                 assert(l->activ_data_uint8_scales[0] != 0);
                 l->M[ii] = l->input_data_uint8_scales[0] * l->weight_data_uint8_scales[ii] / l->activ_data_uint8_scales[0];
@@ -251,33 +400,17 @@ void quantization_activations_preprocess(network *net, float *input)
                 assert(l->input_data_uint8_scales[0] != 0);
                 l->biases_int32[jj] = l->biases[jj] / (l->input_data_uint8_scales[0] * l->weight_data_uint8_scales[jj])  + l->weights_sum_int[jj];
             }
+            release_convolutional_int4_copies(l);
         }
     }
 }
 
-// actually we don't need to quantization weights, because I got them from weights filt
-void quantization_weights_and_activations(network *net)
+// per-layer quantization once layer 0 has its input scale and zero point
+static void quantization_weights(network *net)
 {
-    int i;    
+    int i;
     for (i = 0; i < net->n; ++i) {
         layer *l = &net->layers[i];
-        if(i == 0){
-            // int num =0;
-            // for (int input_index = 0; input_index < net->c*net->w*net->h; ++input_index) {
-            //     assert(l->input_data_uint8_scales[0] != 0);
-            //     int input_quant_value_temp = round(net->input[input_index] / l->input_data_uint8_scales[0] + l->input_data_uint8_zero_point[0]);
-            //     if(input_quant_value_temp < 0 || input_quant_value_temp > 255){
-            //         num++;
-            //     }
-                
-            //     uint8_t input_quant_value = clamp(round(net->input[input_index] / l->input_data_uint8_scales[0] + l->input_data_uint8_zero_point[0]), QUANT_NEGATIVE_LIMIT, QUANT_POSITIVE_LIMIT);
-            //     // l_0->input_int16[input_index] = input_quant_value;
-            //     net->input_uint8[input_index] = input_quant_value;
-            // }
-            // printf("input invalid num is %d\n", num);
-            int temp = 0;
-            quant_weights_with_min_max_channel(1, net->input, net->input_uint8, l->input_int16, &temp, net->c*net->w*net->h, l->input_data_uint8_scales, l->input_data_uint8_zero_point, 0);
-        }
         if (l->type == CONVOLUTIONAL){
             if(l->batch_normalize){
                 assert(l->groups != 0);
@@ -287,7 +420,8 @@ void quantization_weights_and_activations(network *net)
             }
             if(l->layer_quant_flag){
                 // quant_weights_with_min_max_channel(l->n, l->weights, l->weights_uint8, l->weights_int16, l->zero_point_int16, l->c*l->size*l->size, l->weight_data_uint8_scales, l->weight_data_uint8_zero_point, 1);
-                for(int j = 0; j < l->n; ++j){
+                // released int4 layers have no int16 copy to fill
+                for(int j = 0; l->weights_int16 && j < l->n; ++j){
                     for(int ji = 0; ji < l->c*l->size*l->size; ++ji){
                         int index = j*l->c*l->size*l->size + ji;
                         assert(l->weight_data_uint8_scales[j] != 0);
@@ -301,13 +435,11 @@ void quantization_weights_and_activations(network *net)
                 if (i > 0)
                 {
                     l->input_data_uint8_scales[0] = net->layers[i-1].activ_data_uint8_scales[0];
-                    l->input_data_uint8_zero_point = net->layers[i-1].activ_data_uint8_zero_point;
+                    l->input_data_uint8_zero_point[0] = net->layers[i-1].activ_data_uint8_zero_point[0];
                 }
                 for(int ii = 0; ii < l->n; ++ii){
                     l->mult_zero_point[ii] = l->c*l->size*l->size*l->input_data_uint8_zero_point[0]*l->weight_data_uint8_zero_point[ii];
-                    for (int jj = 0; jj < l->c*l->size*l->size; ++jj){
-                        l->weights_sum_int[ii] += l->weights_uint8[ii*l->c*l->size*l->size+jj];
-                    }
+                    l->weights_sum_int[ii] += convolutional_weights_sum(*l, ii);
                         l->weights_sum_int[ii] =  l->mult_zero_point[ii] - l->weights_sum_int[ii] * l->input_data_uint8_zero_point[0];
                     assert(l->activ_data_uint8_scales[0] != 0);
                     l->M[ii] = l->input_data_uint8_scales[0] * l->weight_data_uint8_scales[ii] / l->activ_data_uint8_scales[0];
@@ -332,9 +464,13 @@ void quantization_weights_and_activations(network *net)
                     assert(l->input_data_uint8_scales[0] != 0);
                     l->biases_int32[jj] = l->biases[jj] / (l->input_data_uint8_scales[0] * l->weight_data_uint8_scales[jj])  + l->weights_sum_int[jj];
                 }
-
+                release_convolutional_int4_copies(l);
             }
-
+            // sign-pack again now that batch norm is folded into the weights
+            if(l->weights_bit) pack_convolutional_bit_weights(l, net->drop_float_weights);
+        }
+        if(l->type == SHORTCUT && l->layer_quant_flag){
+            quantize_shortcut_layer(net, i);
         }
         extern const char* type_array[];
         int inheritance_type = (l->type == MAXPOOL || l->type == ROUTE || l->type == UPSAMPLE);
@@ -345,6 +481,24 @@ void quantization_weights_and_activations(network *net)
     }
 }
 
+// actually we don't need to quantization weights, because I got them from weights filt
+void quantization_weights_and_activations(network *net)
+{
+    layer *l = &net->layers[0];
+    int temp = 0;
+    quant_weights_with_min_max_channel(1, net->input, net->input_uint8, l->input_int16, &temp, net->c*net->w*net->h, l->input_data_uint8_scales, l->input_data_uint8_zero_point, 0);
+    quantization_weights(net);
+}
+
+// pins the layer-0 input scale to 1/255 with a zero point of 0, so uint8 pixels are already quantized
+void quantization_weights_and_activations_fixed(network *net)
+{
+    layer *l = &net->layers[0];
+    l->input_data_uint8_scales[0] = 1./255.;
+    l->input_data_uint8_zero_point[0] = 0;
+    quantization_weights(net);
+}
+
 void free_net(network * net){
     int i;
     for (i = 0; i < net->n; ++i) {
@@ -417,6 +571,32 @@ void quant_multi_smaller_than_one_to_scale_and_shift(float real_multiplier,
     *right_shift = s;
 }
 
+// two 4-bit values per byte, low nibble first; every row starts on a byte boundary
+void pack_uint4_cpu(uint8_t *in, int rows, int cols, uint8_t *out)
+{
+    int i, j;
+    int packed_cols = (cols + 1)/2;
+    for(i = 0; i < rows; ++i){
+        for(j = 0; j < packed_cols; ++j){
+            uint8_t lo = in[i*cols + 2*j] & 0x0F;
+            uint8_t hi = (2*j + 1 < cols) ? (in[i*cols + 2*j + 1] & 0x0F) : 0;
+            out[i*packed_cols + j] = lo | (hi << 4);
+        }
+    }
+}
+
+void unpack_uint4_cpu(uint8_t *in, int rows, int cols, uint8_t *out)
+{
+    int i, j;
+    int packed_cols = (cols + 1)/2;
+    for(i = 0; i < rows; ++i){
+        for(j = 0; j < cols; ++j){
+            uint8_t packed = in[i*packed_cols + j/2];
+            out[i*cols + j] = (j & 1) ? (packed >> 4) : (packed & 0x0F);
+        }
+    }
+}
+
 void reorg_cpu(float *x, int w, int h, int c, int batch, int stride, int forward, float *out)
 {
     int b,i,j,k;
@@ -38,6 +38,11 @@ void batch_normalize_bias(float *biases, float *rolling_mean, float *rolling_var
 void batch_normalize_weights(float *weights, float *variance, float *scales, int filters, int spatial);
 void fake_quant_with_min_max_channel(int size_channel, float *input, uint8_t *input_int8, int size_feature, float *min_activ_value, float *max_activ_value, 
                                  float *quantzation_scale, uint8_t *quantization_zero_point, int func_type, float decay);              
+void fake_quant_cpu(int n, int size, float *x, float *min_value, float *max_value,
+                    float *scales, uint8_t *zero_points, int func_type, float decay, uint8_t *mask);
+int qat_enabled(layer l, network net);
+void fake_quant_layer_output(layer l, network net);
+void backward_fake_quant_layer_output(layer l, network net);
 void l2normalize_cpu(float *x, float *dx, int batch, int filters, int spatial);
 void quant_multi_smaller_than_one_to_scale_and_shift(float real_multiplier, int32_t* quantized_multiplier, int* right_shift);
 
@@ -52,6 +57,8 @@ void weighted_delta_cpu(float *a, float *b, float *s, float *da, float *db, floa
 void softmax(float *input, int n, float temp, int stride, float *output);
 void softmax_cpu(float *input, int n, int batch, int batch_offset, int groups, int group_offset, int stride, float temp, float *output);
 void upsample_cpu(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out);
+void pack_uint4_cpu(uint8_t *in, int rows, int cols, uint8_t *out);
+void unpack_uint4_cpu(uint8_t *in, int rows, int cols, uint8_t *out);
 void upsample_quant_cpu(uint8_t *in, int w, int h, int c, int batch, int stride, int forward, float scale, uint8_t *out);
 #ifdef GPU
 #include "cuda.h"
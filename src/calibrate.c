@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "calibrate.h"
+#include "parser.h"
+#include "network.h"
+#include "convolutional_layer.h"
+#include "image.h"
+#include "data.h"
+#include "blas.h"
+#include "utils.h"
+
+#define CALIBRATE_BINS 2048
+#define CALIBRATE_LEVELS (QUANT_POSITIVE_LIMIT - QUANT_NEGATIVE_LIMIT + 1)
+
+/*
+ * One activation range shared by a set of layers. maxpool, upsample and route
+ * move uint8 codes without requantizing, so they and every layer they read
+ * must agree on a scale; only convs and shortcuts produce new values.
+ */
+typedef struct{
+    float min;
+    float max;
+    double *hist;
+    float lo;
+    float hi;
+} calibrate_range;
+
+CALIBRATE_METHOD get_calibrate_method(char *s)
+{
+    if (strcmp(s, "minmax")==0) return CALIBRATE_MINMAX;
+    if (strcmp(s, "percentile")==0) return CALIBRATE_PERCENTILE;
+    if (strcmp(s, "kl")==0) return CALIBRATE_KL;
+    printf("Couldn't find calibrate method %s, going with percentile\n", s);
+    return CALIBRATE_PERCENTILE;
+}
+
+/*
+ * A plain darknet weights file has none of the quantization fields, so it is told
+ * apart from one saved by a QUANTIZATION build by its size.
+ */
+static int is_float_weights(network *net, char *filename)
+{
+    int i;
+    int major = 0, minor = 0, revision = 0;
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) file_error(filename);
+    fread(&major, sizeof(int), 1, fp);
+    fread(&minor, sizeof(int), 1, fp);
+    fread(&revision, sizeof(int), 1, fp);
+    size_t size = 3*sizeof(int);
+    size += ((major*10 + minor) >= 2 && major < 1000 && minor < 1000) ? sizeof(size_t) : sizeof(int);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.dontload || l.type != CONVOLUTIONAL) continue;
+        size += (l.n + l.nweights)*sizeof(float);
+        if(l.batch_normalize && !l.dontloadscales) size += 3*l.n*sizeof(float);
+    }
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fclose(fp);
+    return file_size == size;
+}
+
+static void load_float_weights(network *net, char *filename)
+{
+    int i;
+    int major, minor, revision;
+    printf("Loading float weights from %s...", filename);
+    fflush(stdout);
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) file_error(filename);
+    fread(&major, sizeof(int), 1, fp);
+    fread(&minor, sizeof(int), 1, fp);
+    fread(&revision, sizeof(int), 1, fp);
+    if ((major*10 + minor) >= 2 && major < 1000 && minor < 1000){
+        fread(net->seen, sizeof(size_t), 1, fp);
+    } else {
+        int iseen = 0;
+        fread(&iseen, sizeof(int), 1, fp);
+        *net->seen = iseen;
+    }
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.dontload || l.type != CONVOLUTIONAL) continue;
+        fread(l.biases, sizeof(float), l.n, fp);
+        if(l.batch_normalize && !l.dontloadscales){
+            fread(l.scales, sizeof(float), l.n, fp);
+            fread(l.rolling_mean, sizeof(float), l.n, fp);
+            fread(l.rolling_variance, sizeof(float), l.n, fp);
+        }
+        fread(l.weights, sizeof(float), l.nweights, fp);
+    }
+    printf("Done!\n");
+    fclose(fp);
+}
+
+static int find_range_root(int *parent, int i)
+{
+    while(parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+static void join_ranges(network *net, int *parent, int a, int b)
+{
+    if(b < 0 || !net->layers[b].layer_quant_flag) return;
+    parent[find_range_root(parent, a)] = find_range_root(parent, b);
+}
+
+/*
+ * Map every quantized layer to the range it shares, -1 for float layers.
+ * producer[i] is set for the layers whose outputs are sampled.
+ */
+static int group_ranges(network *net, int *range_of, int *producer)
+{
+    int i, k, n = 0;
+    int *parent = calloc(net->n, sizeof(int));
+    int *index = calloc(net->n, sizeof(int));
+    for(i = 0; i < net->n; ++i) parent[i] = i;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!l.layer_quant_flag) continue;
+        if(l.type == MAXPOOL || l.type == UPSAMPLE) join_ranges(net, parent, i, i-1);
+        if(l.type == ROUTE){
+            for(k = 0; k < l.n; ++k) join_ranges(net, parent, i, l.input_layers[k]);
+        }
+    }
+    for(i = 0; i < net->n; ++i) index[i] = -1;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        range_of[i] = -1;
+        producer[i] = 0;
+        if(!l.layer_quant_flag) continue;
+        int root = find_range_root(parent, i);
+        if(index[root] < 0) index[root] = n++;
+        range_of[i] = index[root];
+        producer[i] = (l.type == CONVOLUTIONAL || l.type == SHORTCUT);
+    }
+    // a range nothing produces (a maxpool behind a float layer) samples its own members
+    int *produced = calloc(n ? n : 1, sizeof(int));
+    for(i = 0; i < net->n; ++i){
+        if(producer[i]) produced[range_of[i]] = 1;
+    }
+    for(i = 0; i < net->n; ++i){
+        if(range_of[i] >= 0 && !produced[range_of[i]]) producer[i] = 1;
+    }
+    free(produced);
+    free(index);
+    free(parent);
+    return n;
+}
+
+static void collect_range(calibrate_range *r, float *x, int n, int pass)
+{
+    int i;
+    if(pass == 0){
+        float lo = r->min, hi = r->max;
+        #pragma omp parallel for reduction(min:lo) reduction(max:hi)
+        for(i = 0; i < n; ++i){
+            lo = x[i] < lo ? x[i] : lo;
+            hi = x[i] > hi ? x[i] : hi;
+        }
+        r->min = lo;
+        r->max = hi;
+        return;
+    }
+    if(r->max <= r->min) return;
+    float bins_per_unit = CALIBRATE_BINS/(r->max - r->min);
+    #pragma omp parallel
+    {
+        int j;
+        int *hist = calloc(CALIBRATE_BINS, sizeof(int));
+        #pragma omp for
+        for(j = 0; j < n; ++j){
+            int b = (x[j] - r->min)*bins_per_unit;
+            hist[b < 0 ? 0 : (b >= CALIBRATE_BINS ? CALIBRATE_BINS - 1 : b)]++;
+        }
+        #pragma omp critical
+        for(j = 0; j < CALIBRATE_BINS; ++j) r->hist[j] += hist[j];
+        free(hist);
+    }
+}
+
+// float forward, sampling each layer before a shortcut can add into its buffer
+static void forward_calibrate(network *net, calibrate_range *ranges, int *range_of, int *producer, int count, int pass)
+{
+    int i;
+    network n = *net;
+    for(i = 0; i < n.n; ++i){
+        layer l = n.layers[i];
+        n.index = i;
+        l.forward(l, n);
+        n.input = l.output;
+        if(producer[i]) collect_range(ranges + range_of[i], l.output, l.outputs*count, pass);
+    }
+}
+
+// one pass over the images, the loader keeps a batch of them in flight
+static void calibrate_pass(network *net, char **paths, int m, calibrate_range *ranges, int *range_of, int *producer,
+                           int pass, float *input_min, float *input_max)
+{
+    int i, t, j;
+    int nthreads = net->batch;
+    image *buf = calloc(nthreads, sizeof(image));
+    image *buf_resized = calloc(nthreads, sizeof(image));
+    pthread_t *thr = calloc(nthreads, sizeof(pthread_t));
+
+    load_args args = {0};
+    args.w = net->w;
+    args.h = net->h;
+    args.type = LETTERBOX_DATA;
+    for(t = 0; t < nthreads && t < m; ++t){
+        args.path = paths[t];
+        args.im = &buf[t];
+        args.resized = &buf_resized[t];
+        thr[t] = load_data_in_thread(args);
+    }
+    for(i = 0; i < m; i += nthreads){
+        int count = min(nthreads, m - i);
+        for(t = 0; t < count; ++t){
+            pthread_join(thr[t], 0);
+            memcpy(net->input + t*net->inputs, buf_resized[t].data, net->inputs*sizeof(float));
+            free_image(buf[t]);
+            free_image(buf_resized[t]);
+            if(i + nthreads + t < m){
+                args.path = paths[i + nthreads + t];
+                args.im = &buf[t];
+                args.resized = &buf_resized[t];
+                thr[t] = load_data_in_thread(args);
+            }
+        }
+        if(pass == 0){
+            for(j = 0; j < count*net->inputs; ++j){
+                *input_min = min(*input_min, net->input[j]);
+                *input_max = max(*input_max, net->input[j]);
+            }
+        }
+        forward_calibrate(net, ranges, range_of, producer, count, pass);
+        fprintf(stderr, "\rpass %d: %d/%d images", pass + 1, i + count, m);
+    }
+    fprintf(stderr, "\n");
+    free(buf);
+    free(buf_resized);
+    free(thr);
+}
+
+static void percentile_range(calibrate_range *r, float percentile)
+{
+    int i;
+    double total = 0;
+    for(i = 0; i < CALIBRATE_BINS; ++i) total += r->hist[i];
+    double tail = total*(100 - percentile)/100;
+    double width = (r->max - r->min)/CALIBRATE_BINS;
+    int a = 0, b = CALIBRATE_BINS;
+    double s = 0;
+    while(a < CALIBRATE_BINS - 1 && s + r->hist[a] <= tail) s += r->hist[a++];
+    s = 0;
+    while(b > a + 1 && s + r->hist[b-1] <= tail) s += r->hist[--b];
+    r->lo = r->min + a*width;
+    r->hi = r->min + b*width;
+}
+
+/*
+ * KL(P||Q) of the histogram clipped to bins [a, b) against the same bins merged
+ * into CALIBRATE_LEVELS codes. Clipped mass goes to the edge bins of P, Q spreads
+ * each code evenly over the bins P has something in.
+ */
+static double clipped_kl_divergence(double *hist, int a, int b, double below, double above, double *p, double *q)
+{
+    int i, j;
+    int n = b - a;
+    double sp = 0, sq = 0, kl = 0;
+    for(i = 0; i < n; ++i) p[i] = hist[a + i];
+    p[0] += below;
+    p[n-1] += above;
+    for(i = 0; i < CALIBRATE_LEVELS; ++i){
+        int start = (long)i*n/CALIBRATE_LEVELS;
+        int stop = (long)(i + 1)*n/CALIBRATE_LEVELS;
+        double sum = 0;
+        int nonzero = 0;
+        for(j = start; j < stop; ++j){
+            sum += hist[a + j];
+            nonzero += (p[j] != 0);
+        }
+        for(j = start; j < stop; ++j) q[j] = (p[j] != 0) ? sum/nonzero : 0;
+    }
+    for(i = 0; i < n; ++i){
+        sp += p[i];
+        sq += q[i];
+    }
+    if(sp == 0 || sq == 0) return DBL_MAX;
+    for(i = 0; i < n; ++i){
+        if(p[i] == 0) continue;
+        double pi = p[i]/sp;
+        double qi = q[i] ? q[i]/sq : 1e-12;
+        kl += pi*log(pi/qi);
+    }
+    return kl;
+}
+
+/*
+ * The usual entropy calibration, made asymmetric for the uint8 zero point:
+ * candidate windows shrink towards zero keeping the share of bins on each side.
+ */
+static void kl_range(calibrate_range *r)
+{
+    int i, j;
+    double width = (r->max - r->min)/CALIBRATE_BINS;
+    double zero = -r->min/width;
+    double *p = calloc(CALIBRATE_BINS, sizeof(double));
+    double *q = calloc(CALIBRATE_BINS, sizeof(double));
+    double *prefix = calloc(CALIBRATE_BINS + 1, sizeof(double));
+    for(j = 0; j < CALIBRATE_BINS; ++j) prefix[j+1] = prefix[j] + r->hist[j];
+    double best = DBL_MAX;
+    int best_a = 0, best_b = CALIBRATE_BINS;
+    for(i = CALIBRATE_LEVELS; i <= CALIBRATE_BINS; ++i){
+        int a = round(zero*(CALIBRATE_BINS - i)/CALIBRATE_BINS);
+        int b = a + i;
+        double kl = clipped_kl_divergence(r->hist, a, b, prefix[a], prefix[CALIBRATE_BINS] - prefix[b], p, q);
+        if(kl < best){
+            best = kl;
+            best_a = a;
+            best_b = b;
+        }
+    }
+    r->lo = r->min + best_a*width;
+    r->hi = r->min + best_b*width;
+    free(prefix);
+    free(p);
+    free(q);
+}
+
+// same nudge as quant_weights_with_min_max_channel, the range always holds zero
+static void range_to_quant(float lo, float hi, float *scale, uint8_t *zero_point)
+{
+    lo = min(lo, 0);
+    hi = max(hi, 0);
+    if(hi - lo <= 0) hi = 1;
+    float s = (hi - lo)/(QUANT_POSITIVE_LIMIT - QUANT_NEGATIVE_LIMIT);
+    double initial_zero_point = QUANT_NEGATIVE_LIMIT - lo/s;
+    *scale = s;
+    *zero_point = clamp(round(initial_zero_point), QUANT_NEGATIVE_LIMIT, QUANT_POSITIVE_LIMIT);
+}
+
+/*
+ * Codes come from the weights with batch norm folded in, as they are at load time,
+ * while the file keeps the unfolded float weights and statistics.
+ */
+static void calibrate_convolutional_weights(layer l)
+{
+    int i, j;
+    int size = l.nweights/l.n;
+    float *weights = calloc(l.nweights, sizeof(float));
+    char *dead = calloc(l.n, sizeof(char));
+    memcpy(weights, l.weights, l.nweights*sizeof(float));
+    if(l.batch_normalize) batch_normalize_weights(weights, l.rolling_variance, l.scales, l.n, size);
+    for(i = 0; i < l.n; ++i){
+        for(j = 0; j < size && weights[i*size + j] == 0; ++j);
+        // an all-zero filter has no range, quantize it against a unit one and reset its codes below
+        if(j == size){
+            dead[i] = 1;
+            weights[i*size] = 1;
+        }
+    }
+    quant_weights_with_min_max_channel(l.n, weights, l.weights_uint8, l.weights_int16, l.zero_point_int16, size,
+                                       l.weight_data_uint8_scales, l.weight_data_uint8_zero_point, 1);
+    for(i = 0; i < l.n; ++i){
+        if(dead[i]) memset(l.weights_uint8 + i*size, l.weight_data_uint8_zero_point[i], size);
+    }
+    if(l.int4_flag) quantize_convolutional_weights_int4(l);
+    free(dead);
+    free(weights);
+}
+
+/*
+ * Post-training quantization: run the float network over calibration images, pick
+ * an activation range per shared scale, quantize the conv weights per channel and
+ * save a file load_convolutional_weights reads. weightfile may be a plain darknet
+ * file or one saved by this build.
+ */
+void calibrate_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile, char *method_s, float percentile, int images)
+{
+    int i;
+    extern const char* type_array[];
+    if(!weightfile || !outfile){
+        fprintf(stderr, "usage: detector calibrate [data] [cfg] [float weights] [out weights] [-method minmax/percentile/kl] [-percentile p] [-images n]\n");
+        return;
+    }
+    CALIBRATE_METHOD method = get_calibrate_method(method_s);
+    list *options = read_data_cfg(datacfg);
+    char *calib_list = option_find_str(options, "calib", option_find_str(options, "train", "data/train.list"));
+
+    gpu_index = -1;
+    network *net = parse_network_cfg(cfgfile, 1);
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        if(l->type == CONNECTED || l->type == BATCHNORM || l->type == LOCAL || l->type == DECONVOLUTIONAL ||
+           l->type == RNN || l->type == GRU || l->type == LSTM || l->type == CRNN){
+            error("calibrate: only convolutional layers may carry weights");
+        }
+        if(l->type == CONVOLUTIONAL) l->forward = forward_convolutional_layer;
+    }
+    if(is_float_weights(net, weightfile)) load_float_weights(net, weightfile);
+    else load_weights(net, weightfile);
+    net->train = 0;
+
+    list *plist = get_paths(calib_list);
+    char **paths = (char **)list_to_array(plist);
+    int m = (images > 0 && images < plist->size) ? images : plist->size;
+    if(m == 0) error("calibrate: no calibration images");
+
+    int *range_of = calloc(net->n, sizeof(int));
+    int *producer = calloc(net->n, sizeof(int));
+    int nranges = group_ranges(net, range_of, producer);
+    calibrate_range *ranges = calloc(nranges ? nranges : 1, sizeof(calibrate_range));
+    for(i = 0; i < nranges; ++i) ranges[i].hist = calloc(CALIBRATE_BINS, sizeof(double));
+
+    printf("Calibrating %d ranges over %d images from %s, method %s\n", nranges, m, calib_list, method_s);
+    double start = what_time_is_it_now();
+    float input_min = 0, input_max = 0;
+    calibrate_pass(net, paths, m, ranges, range_of, producer, 0, &input_min, &input_max);
+    if(method != CALIBRATE_MINMAX){
+        calibrate_pass(net, paths, m, ranges, range_of, producer, 1, &input_min, &input_max);
+    }
+    for(i = 0; i < nranges; ++i){
+        calibrate_range *r = ranges + i;
+        r->lo = r->min;
+        r->hi = r->max;
+        if(r->max <= r->min) continue;
+        if(method == CALIBRATE_PERCENTILE) percentile_range(r, percentile);
+        else if(method == CALIBRATE_KL) kl_range(r);
+    }
+
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        if(range_of[i] < 0) continue;
+        calibrate_range *r = ranges + range_of[i];
+        range_to_quant(r->lo, r->hi, l->activ_data_uint8_scales, l->activ_data_uint8_zero_point);
+        if(l->type == CONVOLUTIONAL){
+            calibrate_convolutional_weights(*l);
+            if(i == 0){
+                range_to_quant(input_min, input_max, l->input_data_uint8_scales, l->input_data_uint8_zero_point);
+            }else if(net->layers[i-1].layer_quant_flag){
+                l->input_data_uint8_scales[0] = net->layers[i-1].activ_data_uint8_scales[0];
+                l->input_data_uint8_zero_point[0] = net->layers[i-1].activ_data_uint8_zero_point[0];
+            }
+        }
+        printf("layer:  %2d, type:  [%5s], activ range [%f, %f] of [%f, %f], scale: %f, zero_p: %d\n", i, type_array[l->type],
+               r->lo, r->hi, r->min, r->max, l->activ_data_uint8_scales[0], l->activ_data_uint8_zero_point[0]);
+    }
+    printf("Calibrated in %f seconds\n", what_time_is_it_now() - start);
+    save_weights(net, outfile);
+
+    for(i = 0; i < nranges; ++i) free(ranges[i].hist);
+    free(ranges);
+    free(range_of);
+    free(producer);
+    free(paths);
+    free_list(plist);
+}
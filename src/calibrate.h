@@ -0,0 +1,11 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+#include "darknet.h"
+
+typedef enum{
+    CALIBRATE_MINMAX, CALIBRATE_PERCENTILE, CALIBRATE_KL
+} CALIBRATE_METHOD;
+
+CALIBRATE_METHOD get_calibrate_method(char *s);
+
+#endif
@@ -0,0 +1,219 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+#include "utils.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// snapshots waiting on the disk before the next save blocks
+#define CHECKPOINT_QUEUE 2
+
+typedef struct checkpoint_job{
+    char *filename;
+    char *data;
+    size_t size;
+    size_t capacity;
+    struct checkpoint_job *next;
+} checkpoint_job;
+
+/*
+ * The training thread serializes the weights into memory, which is the only
+ * part it waits for, and a writer thread puts them on disk as <file>.tmp,
+ * fsyncs and renames over <file>, so a crash never leaves a torn checkpoint.
+ */
+struct checkpoint_writer{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    checkpoint_job *head;
+    checkpoint_job *tail;
+    checkpoint_job *spare;
+    int queued;
+    int stop;
+};
+
+static int write_all(int fd, char *data, size_t size)
+{
+    while(size){
+        ssize_t n = write(fd, data, size);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void sync_parent_dir(char *filename)
+{
+    char dir[4096];
+    strncpy(dir, filename, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = 0;
+    char *slash = strrchr(dir, '/');
+    if(slash == dir) slash[1] = 0;
+    else if(slash) *slash = 0;
+    else strcpy(dir, ".");
+    int fd = open(dir, O_RDONLY);
+    if(fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+static void write_checkpoint(checkpoint_job *job)
+{
+    char tmp[4096];
+    double start = what_time_is_it_now();
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->filename);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write_all(fd, job->data, job->size) && !fsync(fd);
+    if(fd >= 0 && close(fd)) ok = 0;
+    if(ok && rename(tmp, job->filename)) ok = 0;
+    if(!ok){
+        fprintf(stderr, "Couldn't write %s: %s\n", job->filename, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    sync_parent_dir(job->filename);
+    fprintf(stderr, "Wrote %s: %.1f MB in %lf seconds\n", job->filename, job->size/1048576., what_time_is_it_now() - start);
+}
+
+static void *checkpoint_thread(void *ptr)
+{
+    checkpoint_writer *w = ptr;
+    pthread_mutex_lock(&w->mutex);
+    while(1){
+        if(!w->head){
+            if(w->stop) break;
+            pthread_cond_wait(&w->changed, &w->mutex);
+            continue;
+        }
+        checkpoint_job *job = w->head;
+        w->head = job->next;
+        if(!w->head) w->tail = 0;
+        pthread_mutex_unlock(&w->mutex);
+
+        write_checkpoint(job);
+        free(job->filename);
+        job->filename = 0;
+
+        pthread_mutex_lock(&w->mutex);
+        job->next = w->spare;
+        w->spare = job;
+        --w->queued;
+        pthread_cond_broadcast(&w->changed);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return 0;
+}
+
+checkpoint_writer *make_checkpoint_writer()
+{
+    checkpoint_writer *w = calloc(1, sizeof(checkpoint_writer));
+    pthread_mutex_init(&w->mutex, 0);
+    pthread_cond_init(&w->changed, 0);
+    if(pthread_create(&w->thread, 0, checkpoint_thread, w)) error("Thread creation failed");
+    return w;
+}
+
+/*
+ * save_weights without waiting on the disk. Returns once the weights are
+ * copied out, the file appears later under its final name. Blocks only when
+ * CHECKPOINT_QUEUE snapshots are still unwritten.
+ */
+void save_weights_async(checkpoint_writer *w, network *net, char *filename)
+{
+    double start = what_time_is_it_now();
+
+    pthread_mutex_lock(&w->mutex);
+    while(w->queued >= CHECKPOINT_QUEUE) pthread_cond_wait(&w->changed, &w->mutex);
+    ++w->queued;
+    checkpoint_job *job = w->spare;
+    if(job) w->spare = job->next;
+    pthread_mutex_unlock(&w->mutex);
+    if(!job) job = calloc(1, sizeof(checkpoint_job));
+    job->filename = copy_string(filename);
+    job->next = 0;
+
+    // a buffer from an earlier checkpoint is already faulted in, copying into it is the cheap case
+    FILE *fp = 0;
+    if(job->data){
+        fp = fmemopen(job->data, job->capacity, "w");
+        if(fp){
+            setvbuf(fp, 0, _IONBF, 0);
+            write_weights_upto(net, fp, net->n);
+            fflush(fp);
+            job->size = ftell(fp);
+            fclose(fp);
+        }
+    }
+    // first checkpoint, or the model outgrew the buffer
+    if(!fp || job->size >= job->capacity){
+        free(job->data);
+        job->data = 0;
+        fp = open_memstream(&job->data, &job->size);
+        if(!fp) error("open_memstream failed");
+        write_weights_upto(net, fp, net->n);
+        fclose(fp);
+        job->capacity = job->size + 1;
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    if(w->tail) w->tail->next = job;
+    else w->head = job;
+    w->tail = job;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->mutex);
+    printf("Saving weights to %s, %lf seconds stall\n", filename, what_time_is_it_now() - start);
+}
+
+// waits for every queued checkpoint to reach the disk
+void free_checkpoint_writer(checkpoint_writer *w)
+{
+    if(!w) return;
+    pthread_mutex_lock(&w->mutex);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, 0);
+    while(w->spare){
+        checkpoint_job *job = w->spare;
+        w->spare = job->next;
+        free(job->data);
+        free(job);
+    }
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->changed);
+    free(w);
+}
+
+#else
+
+struct checkpoint_writer{
+    int unused;
+};
+
+checkpoint_writer *make_checkpoint_writer()
+{
+    return calloc(1, sizeof(checkpoint_writer));
+}
+
+void save_weights_async(checkpoint_writer *w, network *net, char *filename)
+{
+    save_weights(net, filename);
+}
+
+void free_checkpoint_writer(checkpoint_writer *w)
+{
+    free(w);
+}
+
+#endif
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "network.h"
+#include "utils.h"
+
+// kernels every generated module shares, the per-layer calls pass their shapes as literals
+static const char *compiled_kernels =
+"#define ALIGNED __attribute__((aligned(64)))\n"
+"#define KERNEL static inline __attribute__((always_inline))\n"
+"\n"
+"enum { ACT_LINEAR, ACT_RELU, ACT_RELU6, ACT_LEAKY };\n"
+"\n"
+"#define OB 8\n"
+"#define JB 512\n"
+"static uint8_t col[COL_SIZE] ALIGNED;\n"
+"static int32_t acc[OB][JB] ALIGNED;\n"
+"\n"
+"/* im2col_cpu_uint8: out-of-image taps read the input zero point */\n"
+"KERNEL void im2col(const uint8_t *restrict in, uint8_t *restrict out, const int C, const int H, const int W,\n"
+"                   const int K, const int S, const int P, const int OH, const int OW, const uint8_t izp)\n"
+"{\n"
+"    int c, ky, kx, y, x;\n"
+"    for(c = 0; c < C; ++c){\n"
+"        for(ky = 0; ky < K; ++ky){\n"
+"            for(kx = 0; kx < K; ++kx){\n"
+"                uint8_t *dst = out + ((c*K + ky)*K + kx)*OH*OW;\n"
+"                for(y = 0; y < OH; ++y){\n"
+"                    const int iy = y*S + ky - P;\n"
+"                    const uint8_t *src = in + (c*H + iy)*W;\n"
+"                    for(x = 0; x < OW; ++x){\n"
+"                        const int ix = x*S + kx - P;\n"
+"                        dst[y*OW + x] = (iy >= 0 && iy < H && ix >= 0 && ix < W) ? src[ix] : izp;\n"
+"                    }\n"
+"                }\n"
+"            }\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"/*\n"
+" * sum((w - wzp)*x) over the im2col matrix, OB filters by JB columns at a time so the\n"
+" * accumulators stay in L1, then the requant of requant_convolutional_output.\n"
+" */\n"
+"KERNEL void conv(const uint8_t *restrict in, uint8_t *restrict out, const uint8_t *restrict w, const uint8_t *restrict wzp,\n"
+"                 const int32_t *restrict bias, const double *restrict m, const double *restrict shift,\n"
+"                 const int C, const int H, const int W, const int N, const int G, const int K, const int S, const int P,\n"
+"                 const int OH, const int OW, const int izp, const int ozp, const int act)\n"
+"{\n"
+"    const int CG = C/G, NG = N/G, KK = CG*K*K, NN = OH*OW;\n"
+"    int g, o, i, j, j0, kk;\n"
+"    for(g = 0; g < G; ++g){\n"
+"        const uint8_t *b = in + g*CG*H*W;\n"
+"        if(K != 1 || S != 1 || P != 0){\n"
+"            im2col(b, col, CG, H, W, K, S, P, OH, OW, izp);\n"
+"            b = col;\n"
+"        }\n"
+"        for(o = g*NG; o < (g + 1)*NG; o += OB){\n"
+"            const int ob = (g + 1)*NG - o < OB ? (g + 1)*NG - o : OB;\n"
+"            for(j0 = 0; j0 < NN; j0 += JB){\n"
+"                const int jn = NN - j0 < JB ? NN - j0 : JB;\n"
+"                memset(acc, 0, sizeof(acc));\n"
+"                for(kk = 0; kk < KK; ++kk){\n"
+"                    const uint8_t *r = b + kk*NN + j0;\n"
+"                    for(i = 0; i < ob; ++i){\n"
+"                        const int32_t wv = (int32_t)w[(o + i)*KK + kk] - wzp[o + i];\n"
+"                        for(j = 0; j < jn; ++j) acc[i][j] += wv*r[j];\n"
+"                    }\n"
+"                }\n"
+"                for(i = 0; i < ob; ++i){\n"
+"                    uint8_t *dst = out + (o + i)*NN + j0;\n"
+"                    for(j = 0; j < jn; ++j){\n"
+"                        int32_t q = acc[i][j];\n"
+"                        int64_t t = (q + bias[o + i])*m[o + i];\n"
+"                        q = t*shift[o + i];\n"
+"                        double v = q + ozp;\n"
+"                        if(act == ACT_LEAKY && q < 0) v = round(q*0.1) + ozp;\n"
+"                        if(act == ACT_RELU6 && q <= 0) v = ozp;\n"
+"                        dst[j] = (uint8_t)(int32_t)v;\n"
+"                    }\n"
+"                }\n"
+"            }\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void maxpool(const uint8_t *restrict in, uint8_t *restrict out, const int C, const int H, const int W,\n"
+"                    const int K, const int S, const int P, const int OH, const int OW)\n"
+"{\n"
+"    int c, y, x, n, m;\n"
+"    for(c = 0; c < C; ++c){\n"
+"        for(y = 0; y < OH; ++y){\n"
+"            for(x = 0; x < OW; ++x){\n"
+"                uint8_t max = 0;\n"
+"                for(n = 0; n < K; ++n){\n"
+"                    for(m = 0; m < K; ++m){\n"
+"                        const int iy = -P/2 + y*S + n;\n"
+"                        const int ix = -P/2 + x*S + m;\n"
+"                        if(iy < 0 || iy >= H || ix < 0 || ix >= W) continue;\n"
+"                        const uint8_t v = in[(c*H + iy)*W + ix];\n"
+"                        max = v > max ? v : max;\n"
+"                    }\n"
+"                }\n"
+"                out[(c*OH + y)*OW + x] = max;\n"
+"            }\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void upsample(const uint8_t *restrict in, uint8_t *restrict out, const int C, const int H, const int W, const int S)\n"
+"{\n"
+"    int c, y, x;\n"
+"    for(c = 0; c < C; ++c){\n"
+"        for(y = 0; y < H*S; ++y){\n"
+"            for(x = 0; x < W*S; ++x) out[(c*H*S + y)*W*S + x] = in[(c*H + y/S)*W + x/S];\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void dequant(const uint8_t *restrict in, float *restrict out, const int N, const uint8_t zp, const float scale)\n"
+"{\n"
+"    int i;\n"
+"    for(i = 0; i < N; ++i) out[i] = (in[i] - zp)*scale;\n"
+"}\n"
+"\n"
+"KERNEL void yolo(const float *restrict in, float *restrict out, const int N, const int A, const int WH, const int CLASSES)\n"
+"{\n"
+"    int a, i;\n"
+"    memcpy(out, in, N*sizeof(float));\n"
+"    for(a = 0; a < A; ++a){\n"
+"        float *p = out + a*WH*(4 + 1 + CLASSES);\n"
+"        for(i = 0; i < 2*WH; ++i) p[i] = 1./(1. + exp(-p[i]));\n"
+"        p += 4*WH;\n"
+"        for(i = 0; i < (1 + CLASSES)*WH; ++i) p[i] = 1./(1. + exp(-p[i]));\n"
+"    }\n"
+"}\n"
+"\n";
+
+static void emit_uint8_array(FILE *fp, char *prefix, char *name, int index, uint8_t *a, int n)
+{
+    int i;
+    fprintf(fp, "static const uint8_t %s_l%d_%s[%d] ALIGNED = {", prefix, index, name, n);
+    for(i = 0; i < n; ++i) fprintf(fp, "%s%d,", (i%32) ? "" : "\n", a[i]);
+    fprintf(fp, "\n};\n");
+}
+
+static void emit_int32_array(FILE *fp, char *prefix, char *name, int index, int32_t *a, int n)
+{
+    int i;
+    fprintf(fp, "static const int32_t %s_l%d_%s[%d] ALIGNED = {", prefix, index, name, n);
+    for(i = 0; i < n; ++i) fprintf(fp, "%s%d,", (i%16) ? "" : "\n", a[i]);
+    fprintf(fp, "\n};\n");
+}
+
+// hex floats so the requant multipliers round-trip exactly
+static void emit_double_array(FILE *fp, char *prefix, char *name, int index, double *a, int n)
+{
+    int i;
+    fprintf(fp, "static const double %s_l%d_%s[%d] ALIGNED = {", prefix, index, name, n);
+    for(i = 0; i < n; ++i) fprintf(fp, "%s%a,", (i%8) ? "" : "\n", a[i]);
+    fprintf(fp, "\n};\n");
+}
+
+static int compiled_activation(ACTIVATION a)
+{
+    switch(a){
+        case LINEAR: return 0;
+        case RELU: return 1;
+        case RELU6: return 2;
+        case LEAKY: return 3;
+        default: return -1;
+    }
+}
+
+// the subset compile handles is what the quantized forward pass runs end to end in uint8
+static int compilable_layer(network *net, int i)
+{
+    layer l = net->layers[i];
+    if(l.type == YOLO) return i > 0 && net->layers[i-1].quant_stop_flag;
+    if(!l.layer_quant_flag || l.close_quantization) return 0;
+    if(l.type == CONVOLUTIONAL){
+        return !l.int4_flag && !l.binary && !l.xnor && compiled_activation(l.activation) >= 0;
+    }
+    return l.type == MAXPOOL || l.type == ROUTE || l.type == UPSAMPLE;
+}
+
+static void emit_declarations(FILE *fp, network *net, char *prefix)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == CONVOLUTIONAL){
+            emit_uint8_array(fp, prefix, "weights", i, l.weights_uint8, l.nweights);
+            emit_uint8_array(fp, prefix, "weights_zero_point", i, l.weight_data_uint8_zero_point, l.n);
+            emit_int32_array(fp, prefix, "biases", i, l.biases_int32, l.n);
+            emit_double_array(fp, prefix, "M", i, l.M_value, l.n);
+            emit_double_array(fp, prefix, "shift", i, l.M0_right_shift_value, l.n);
+        }
+        if(l.type == YOLO){
+            fprintf(fp, "static float %s_l%d_output[%d] ALIGNED;\n", prefix, i, l.outputs);
+            fprintf(fp, "static const float %s_l%d_anchors[%d] = {", prefix, i, 2*l.n);
+            int n;
+            for(n = 0; n < l.n; ++n) fprintf(fp, "%a, %a,", l.biases[2*l.mask[n]], l.biases[2*l.mask[n]+1]);
+            fprintf(fp, "};\n");
+            continue;
+        }
+        fprintf(fp, "static uint8_t %s_l%d_output[%d] ALIGNED;\n", prefix, i, l.outputs);
+        if(l.quant_stop_flag) fprintf(fp, "static float %s_l%d_output_float[%d] ALIGNED;\n", prefix, i, l.outputs);
+    }
+    fprintf(fp, "\n");
+}
+
+static void emit_forward(FILE *fp, network *net, char *prefix)
+{
+    int i, j;
+    char input[256];
+    strcpy(input, "input");
+    fprintf(fp, "void %s_forward(const uint8_t *input)\n{\n", prefix);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == CONVOLUTIONAL){
+            fprintf(fp, "    conv(%s, %s_l%d_output, %s_l%d_weights, %s_l%d_weights_zero_point, %s_l%d_biases, %s_l%d_M, %s_l%d_shift,\n",
+                    input, prefix, i, prefix, i, prefix, i, prefix, i, prefix, i, prefix, i);
+            fprintf(fp, "         %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d);\n",
+                    l.c, l.h, l.w, l.n, l.groups, l.size, l.stride, l.pad, l.out_h, l.out_w,
+                    l.input_data_uint8_zero_point[0], l.activ_data_uint8_zero_point[0], compiled_activation(l.activation));
+        }else if(l.type == MAXPOOL){
+            fprintf(fp, "    maxpool(%s, %s_l%d_output, %d, %d, %d, %d, %d, %d, %d, %d);\n",
+                    input, prefix, i, l.c, l.h, l.w, l.size, l.stride, l.pad, l.out_h, l.out_w);
+        }else if(l.type == UPSAMPLE){
+            fprintf(fp, "    upsample(%s, %s_l%d_output, %d, %d, %d, %d);\n", input, prefix, i, l.c, l.h, l.w, l.stride);
+        }else if(l.type == ROUTE){
+            int offset = 0;
+            for(j = 0; j < l.n; ++j){
+                int index = l.input_layers[j];
+                fprintf(fp, "    memcpy(%s_l%d_output + %d, %s_l%d_output, %d);\n", prefix, i, offset, prefix, index, l.input_sizes[j]);
+                if(l.quant_stop_flag){
+                    layer in = net->layers[index];
+                    fprintf(fp, "    dequant(%s_l%d_output + %d, %s_l%d_output_float + %d, %d, %d, %a);\n", prefix, i, offset, prefix, i, offset,
+                            l.input_sizes[j], in.activ_data_uint8_zero_point[0], in.activ_data_uint8_scales[0]);
+                }
+                offset += l.input_sizes[j];
+            }
+        }else if(l.type == YOLO){
+            fprintf(fp, "    yolo(%s_l%d_output_float, %s_l%d_output, %d, %d, %d, %d);\n", prefix, i-1, prefix, i, l.outputs, l.n, l.w*l.h, l.classes);
+            continue;
+        }
+        if(l.quant_stop_flag && l.type != ROUTE){
+            fprintf(fp, "    dequant(%s_l%d_output, %s_l%d_output_float, %d, %d, %a);\n", prefix, i, prefix, i,
+                    l.outputs, l.activ_data_uint8_zero_point[0], l.activ_data_uint8_scales[0]);
+        }
+        sprintf(input, "%s_l%d_output", prefix, i);
+    }
+    fprintf(fp, "}\n\n");
+}
+
+// get_yolo_detections without the class threshold and box correction, relative to the network input
+static void emit_detections(FILE *fp, network *net, char *prefix)
+{
+    int i;
+    fprintf(fp, "typedef struct{\n    float x, y, w, h;\n    float objectness;\n    int class;\n    float prob;\n} %s_detection;\n\n", prefix);
+    fprintf(fp, "static int %s_yolo_detections(const float *out, const float *anchors, int lw, int lh, int n, int classes, float thresh, %s_detection *dets, int count, int max)\n{\n", prefix, prefix);
+    fprintf(fp,
+"    int i, a, j;\n"
+"    const int wh = lw*lh;\n"
+"    for(i = 0; i < wh; ++i){\n"
+"        for(a = 0; a < n; ++a){\n"
+"            const float *p = out + a*wh*(4 + 1 + classes) + i;\n"
+"            float objectness = p[4*wh];\n"
+"            if(objectness <= thresh || count >= max) continue;\n"
+"            %s_detection d;\n"
+"            d.x = (i%%lw + p[0]) / lw;\n"
+"            d.y = (i/lw + p[wh]) / lh;\n"
+"            d.w = exp(p[2*wh]) * anchors[2*a] / %d;\n"
+"            d.h = exp(p[3*wh]) * anchors[2*a+1] / %d;\n"
+"            d.objectness = objectness;\n"
+"            d.class = 0;\n"
+"            for(j = 1; j < classes; ++j){\n"
+"                if(p[(5 + j)*wh] > p[(5 + d.class)*wh]) d.class = j;\n"
+"            }\n"
+"            d.prob = objectness*p[(5 + d.class)*wh];\n"
+"            dets[count++] = d;\n"
+"        }\n"
+"    }\n"
+"    return count;\n"
+"}\n\n", prefix, net->w, net->h);
+    fprintf(fp, "int %s_detections(float thresh, %s_detection *dets, int max)\n{\n    int count = 0;\n", prefix, prefix);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type != YOLO) continue;
+        fprintf(fp, "    count = %s_yolo_detections(%s_l%d_output, %s_l%d_anchors, %d, %d, %d, %d, thresh, dets, count, max);\n",
+                prefix, prefix, i, prefix, i, l.w, l.h, l.n, l.classes);
+    }
+    fprintf(fp, "    return count;\n}\n");
+}
+
+/*
+ * Write a standalone C module running cfgfile/weightfile without the parser, the
+ * layer struct or the heap. Every shape is a literal at its kernel call, so with
+ * the always_inline kernels the compiler sees constant trip counts per layer.
+ * Weights and requant constants come from the same preparation `detector serve`
+ * uses, with the input scale pinned to 1/255, so raw pixels are the input.
+ */
+void compile_network(char *cfgfile, char *weightfile, char *outfile, char *prefix)
+{
+    int i;
+    gpu_index = -1;
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, 1);
+    for(i = 0; i < net->n; ++i){
+        if(!compilable_layer(net, i)){
+            fprintf(stderr, "compile: layer %d is not a quantized conv, maxpool, route, upsample or yolo layer\n", i);
+            free_network(net);
+            return;
+        }
+    }
+    quantization_weights_and_activations_fixed(net);
+
+    int col_size = 1;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == CONVOLUTIONAL && l.out_w*l.out_h*l.size*l.size*l.c/l.groups > col_size) col_size = l.out_w*l.out_h*l.size*l.size*l.c/l.groups;
+    }
+
+    FILE *fp = fopen(outfile, "w");
+    if(!fp) file_error(outfile);
+    fprintf(fp, "/*\n * Generated by `darknet compile %s %s`.\n", cfgfile, weightfile ? weightfile : "");
+    fprintf(fp, " * %s_forward() takes a letterboxed %dx%dx%d planar uint8 image.\n", prefix, net->w, net->h, net->c);
+    fprintf(fp, " * %s_detections() then lists boxes relative to that input, one per cell and anchor\n", prefix);
+    fprintf(fp, " * above thresh with its best class; apply NMS and undo the letterbox as needed.\n");
+    fprintf(fp, " * Build with -O3 -march=<target> and link with -lm.\n */\n");
+    fprintf(fp, "#include <stdint.h>\n#include <string.h>\n#include <math.h>\n\n");
+    fprintf(fp, "#define %s_WIDTH %d\n#define %s_HEIGHT %d\n#define %s_CHANNELS %d\n#define COL_SIZE %d\n\n",
+            prefix, net->w, prefix, net->h, prefix, net->c, col_size);
+    fputs(compiled_kernels, fp);
+    emit_declarations(fp, net, prefix);
+    emit_forward(fp, net, prefix);
+    emit_detections(fp, net, prefix);
+    fclose(fp);
+    printf("Compiled %d layers of %s into %s\n", net->n, cfgfile, outfile);
+    free_network(net);
+}
@@ -5,6 +5,7 @@
 #include "col2im.h"
 #include "blas.h"
 #include "gemm.h"
+#include "quant_kernels.h"
 #include <stdio.h>
 #include <time.h>
 #ifdef OPENBLAS
@@ -43,6 +44,34 @@ void binarize_weights(float *weights, int n, int size, float *binary)
     }
 }
 
+// sign bits plus the mean magnitude per filter, the same scaling binarize_weights uses
+void binarize_weights_bit(float *weights, int n, int size, uint64_t *binary, float *scales)
+{
+    int i, f;
+    int ldw = (size + 63)/64;
+    for(f = 0; f < n; ++f){
+        float mean = 0;
+        for(i = 0; i < ldw; ++i) binary[f*ldw + i] = 0;
+        for(i = 0; i < size; ++i){
+            mean += fabs(weights[f*size + i]);
+            if(weights[f*size + i] > 0) binary[f*ldw + i/64] |= 1ULL << (i%64);
+        }
+        scales[f] = mean / size;
+    }
+}
+
+// the float weights a bit layer computes with, +-scale by sign
+void unbinarize_weights_bit(uint64_t *binary, float *scales, int n, int size, float *weights)
+{
+    int i, f;
+    int ldw = (size + 63)/64;
+    for(f = 0; f < n; ++f){
+        for(i = 0; i < size; ++i){
+            weights[f*size + i] = ((binary[f*ldw + i/64] >> (i%64)) & 1) ? scales[f] : -scales[f];
+        }
+    }
+}
+
 void binarize_cpu(float *input, int n, float *binary)
 {
     int i;
@@ -118,7 +147,9 @@ static size_t get_workspace_size(layer l){
         return most;
     }
 #endif
-    return (size_t)l.out_h*l.out_w*l.size*l.size*l.c/l.groups*sizeof(float);
+    size_t s = (size_t)l.out_h*l.out_w*l.size*l.size*l.c/l.groups*sizeof(float);
+    if(l.weights_winograd && winograd_workspace_size(l) > s) s = winograd_workspace_size(l);
+    return s;
 }
 
 #ifdef GPU
@@ -195,6 +226,7 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     l.size = size;
     l.pad = padding;
     l.batch_normalize = batch_normalize;
+    l.activation = activation;
 
     l.nweights = c/groups*n*size*size;
     l.nbiases = n;
@@ -259,7 +291,8 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
 #ifdef OPENBLAS
         l.forward = forward_convolutional_layer_quant_inputi_outputi_mkl;
 #else
-		l.forward = forward_convolutional_layer_quant_inputi_outputi;
+        l.forward = select_convolutional_quant_kernel(l);
+        if(!l.forward) l.forward = forward_convolutional_layer_quant_inputi_outputi;
 #endif
     }else if (l.layer_quant_flag && l.close_quantization){
 #ifdef OPENBLAS
@@ -268,6 +301,8 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     }else{
         l.forward = forward_convolutional_layer_nobn;
     }
+    // forward above is inference only (uint8, or no batch norm), training runs this instead
+    l.forward_qat = forward_convolutional_layer_qat;
 #else
     l.forward = forward_convolutional_layer;
 #endif
@@ -398,7 +433,6 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     }
 #endif
     l.workspace_size = get_workspace_size(l);
-    l.activation = activation;
 
     printf("conv  %5d %2d x%2d /%2d  %4d x%4d x%4d   ->  %4d x%4d x%4d  %5.3f BFLOPs\n", n, size, size, stride, w, h, c, l.out_w, l.out_h, l.out_c, (2.0 * l.n * l.size*l.size*l.c/l.groups * l.out_h*l.out_w)/1000000000.);
 
@@ -465,6 +499,20 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
         l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
         l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
     }
+#ifdef QUANTIZATION
+    l->input_uint8 = realloc(l->input_uint8, l->inputs*sizeof(uint8_t));
+    l->input_int16 = realloc(l->input_int16, l->inputs*sizeof(int16_t));
+    l->input_sum_int = realloc(l->input_sum_int, l->out_w*l->out_h*l->n*sizeof(uint32_t));
+    l->output_int32 = realloc(l->output_int32, l->batch*l->outputs*sizeof(int32_t));
+    l->output_uint8_final = realloc(l->output_uint8_final, l->batch*l->outputs*sizeof(uint8_t));
+#endif
+    if(l->weights_bit && l->xnor){
+        int ldw = (l->c/l->groups*l->size*l->size + 63)/64;
+        l->binary_input = realloc(l->binary_input, l->batch*l->inputs*sizeof(float));
+        l->input_bit = realloc(l->input_bit, l->out_h*l->out_w*ldw*sizeof(uint64_t));
+        l->input_bit_mask = realloc(l->input_bit_mask, l->out_h*l->out_w*ldw*sizeof(uint64_t));
+        l->input_bit_valid = realloc(l->input_bit_valid, l->out_h*l->out_w*sizeof(int));
+    }
 
 #ifdef GPU
     cuda_free(l->delta_gpu);
@@ -533,10 +581,8 @@ void forward_convolutional_layer_quant_inputi_outputi_mkl(convolutional_layer l,
     int m = l.n/l.groups;
     int k = l.size*l.size*l.c/l.groups;
     int n = l.out_h*l.out_w;
-    net.workspace_quant16 = calloc(1, l.out_h*l.out_w*l.size*l.size*l.c*sizeof(int16_t));
-    for(int in = 0; in < l.out_h*l.out_w*l.size*l.size*l.c; ++in){
-        net.workspace_quant16[in] = l.input_data_uint8_zero_point[0];
-    }
+    // im2col_cpu_int16 fills the whole buffer, which fits in the float workspace
+    net.workspace_quant16 = (int16_t *)net.workspace;
     if(l.count > 0){
         for (int input_index = 0; input_index < l.c*l.w*l.h; ++input_index) {
             l.input_int16[input_index] = (int16_t)net.input_uint8[input_index];
@@ -611,7 +657,7 @@ void forward_convolutional_layer_quant_inputf_outputf(convolutional_layer l, net
     int m = l.n / l.groups;
     int k = l.size * l.size * l.c / l.groups;
     int n = l.out_h * l.out_w;
-    net.workspace_quant16 = calloc(1, l.out_h * l.out_w * l.size * l.size * l.c * sizeof(int16_t));
+    net.workspace_quant16 = (int16_t *)net.workspace;
     for (int input_index = 0; input_index < l.c * l.w * l.h; ++input_index) {
         int16_t input_quant_value = round(net.input[input_index] / l.input_data_uint8_scales[0]) + l.input_data_uint8_zero_point[0];
         l.input_int16[input_index] = input_quant_value;
@@ -693,16 +739,13 @@ void forward_convolutional_layer_quant_inputf_outputf(convolutional_layer l, net
 #endif
 void forward_convolutional_layer_quant_inputi_outputi(convolutional_layer l, network net)
 {
-    int i, j, s, t;
     int batch_index, groups_index;
     // y = conv(x) --> q1*q2
     int m = l.n/l.groups;
     int k = l.size*l.size*l.c/l.groups;
     int n = l.out_h*l.out_w;
-    net.workspace_quant = calloc(1, l.out_h*l.out_w*l.size*l.size*l.c*sizeof(uint8_t));
-    for(int in = 0; in < l.out_h*l.out_w*l.size*l.size*l.c; ++in){
-        net.workspace_quant[in] = l.input_data_uint8_zero_point[0];
-    }
+    // im2col_cpu_uint8 writes every element, padding included, so the float workspace is reused as is
+    net.workspace_quant = (uint8_t *)net.workspace;
     for(batch_index = 0;batch_index < l.batch; batch_index++){
         for(groups_index = 0;groups_index < l.groups; groups_index++){
             uint8_t *a = l.weights_uint8 + groups_index*l.nweights/l.groups;
@@ -721,11 +764,352 @@ void forward_convolutional_layer_quant_inputi_outputi(convolutional_layer l, net
             gemm_nn_uint8_int32_te(m, n, k, -1, l.zero_point_uint8, k, b, n, 1, c, n);
         }
 	}
+    requant_convolutional_output(l);
+}
+
+// z2*sum(a1) over each column instead of a second gemm against a zero point matrix
+static void subtract_weight_zero_point(convolutional_layer l, uint8_t *b, int32_t *c, int32_t *col_sum, int m, int n, int k, int groups_index)
+{
+    int i, j, kk;
+    for(j = 0; j < n; ++j) col_sum[j] = 0;
+    for(kk = 0; kk < k; ++kk){
+        for(j = 0; j < n; ++j) col_sum[j] += b[kk*n + j];
+    }
+    for(i = 0; i < m; ++i){
+        int32_t zero_point = l.weight_data_uint8_zero_point[groups_index*m + i];
+        for(j = 0; j < n; ++j) c[i*n + j] -= zero_point*col_sum[j];
+    }
+}
+
+void forward_convolutional_layer_quant_int4(convolutional_layer l, network net)
+{
+    int batch_index, groups_index;
+    int m = l.n/l.groups;
+    int k = l.size*l.size*l.c/l.groups;
+    int n = l.out_h*l.out_w;
+    int lda = (k + 1)/2;
+    // workspace_size covers a float im2col buffer, plenty for the uint8 one
+    uint8_t *workspace = (uint8_t *)net.workspace;
+    int32_t *col_sum = (int32_t *)l.input_sum_int;
+    for(batch_index = 0;batch_index < l.batch; batch_index++){
+        for(groups_index = 0;groups_index < l.groups; groups_index++){
+            uint8_t *a = l.weights_int4 + groups_index*m*lda;
+            uint8_t *b = workspace;
+            int32_t *c = l.output_int32 + (batch_index*l.groups + groups_index)*n*m;
+            uint8_t *im =  net.input_uint8 + (batch_index*l.groups + groups_index)*l.c/l.groups*l.h*l.w;
+            if (l.size == 1) {
+                b = im;
+            } else {
+                im2col_cpu_uint8(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b, l.input_data_uint8_zero_point[0]);
+            }
+            gemm_nn_uint4_uint8_int32(m, n, k, a, lda, b, n, c, n);
+            subtract_weight_zero_point(l, b, c, col_sum, m, n, k, groups_index);
+        }
+    }
+    requant_convolutional_output(l);
+}
+
+void forward_convolutional_layer_quant_colsum(convolutional_layer l, network net)
+{
+    int batch_index, groups_index;
+    int m = l.n/l.groups;
+    int k = l.size*l.size*l.c/l.groups;
+    int n = l.out_h*l.out_w;
+    uint8_t *workspace = (uint8_t *)net.workspace;
+    int32_t *col_sum = (int32_t *)l.input_sum_int;
+    for(batch_index = 0;batch_index < l.batch; batch_index++){
+        for(groups_index = 0;groups_index < l.groups; groups_index++){
+            uint8_t *a = l.weights_uint8 + groups_index*l.nweights/l.groups;
+            uint8_t *b = workspace;
+            int32_t *c = l.output_int32 + (batch_index*l.groups + groups_index)*n*m;
+            uint8_t *im =  net.input_uint8 + (batch_index*l.groups + groups_index)*l.c/l.groups*l.h*l.w;
+            if (l.size == 1) {
+                b = im;
+            } else {
+                im2col_cpu_uint8(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b, l.input_data_uint8_zero_point[0]);
+            }
+            gemm_nn_uint8_int32_tiled(m, n, k, a, k, b, n, c, n, l.tune_tile ? l.tune_tile : n, l.tune_split);
+            subtract_weight_zero_point(l, b, c, col_sum, m, n, k, groups_index);
+        }
+    }
+    requant_convolutional_output(l);
+}
+
+static void direct_conv_row(convolutional_layer *l, uint8_t *im, int o, int y, int32_t *out)
+{
+    int c, ky, kx, x;
+    int cg = l->c/l->groups;
+    uint8_t *input = im + o/(l->n/l->groups)*cg*l->h*l->w;
+    int32_t zero_point = l->input_data_uint8_zero_point[0];
+    int32_t weight_zero_point = l->weight_data_uint8_zero_point[o];
+    for(x = 0; x < l->out_w; ++x) out[x] = 0;
+    for(c = 0; c < cg; ++c){
+        uint8_t *w = l->weights_uint8 + (o*cg + c)*l->size*l->size;
+        for(ky = 0; ky < l->size; ++ky){
+            int iy = y*l->stride - l->pad + ky;
+            if(iy < 0 || iy >= l->h){
+                int32_t sum = 0;
+                for(kx = 0; kx < l->size; ++kx) sum += w[ky*l->size + kx] - weight_zero_point;
+                for(x = 0; x < l->out_w; ++x) out[x] += sum*zero_point;
+                continue;
+            }
+            uint8_t *row = input + (c*l->h + iy)*l->w;
+            for(kx = 0; kx < l->size; ++kx){
+                int32_t a = w[ky*l->size + kx] - weight_zero_point;
+                int offset = kx - l->pad;
+                // x*stride + offset stays inside the row for x0 <= x < x1
+                int x0 = offset < 0 ? (-offset + l->stride - 1)/l->stride : 0;
+                int x1 = (l->w - offset + l->stride - 1)/l->stride;
+                if(x1 > l->out_w) x1 = l->out_w;
+                if(x0 > x1) x0 = x1;
+                for(x = 0; x < x0; ++x) out[x] += a*zero_point;
+                for(; x < x1; ++x) out[x] += a*row[x*l->stride + offset];
+                for(; x < l->out_w; ++x) out[x] += a*zero_point;
+            }
+        }
+    }
+}
+
+/*
+ * Quantized conv read straight from the uint8 input, no im2col buffer. Each weight
+ * tap is applied along a whole output row and padding reads the input zero point,
+ * so output_int32 matches the gemm paths exactly. tune_split = 0 gives each thread
+ * output channels, 1 gives it output rows, which suits layers with few channels.
+ */
+void forward_convolutional_layer_quant_direct(convolutional_layer l, network net)
+{
+    int b, o, y;
+    for(b = 0; b < l.batch; ++b){
+        uint8_t *im = net.input_uint8 + b*l.c*l.h*l.w;
+        int32_t *out = l.output_int32 + b*l.n*l.out_h*l.out_w;
+        if(l.tune_split){
+            #pragma omp parallel for private(o)
+            for(y = 0; y < l.out_h; ++y){
+                for(o = 0; o < l.n; ++o) direct_conv_row(&l, im, o, y, out + (o*l.out_h + y)*l.out_w);
+            }
+        }else{
+            #pragma omp parallel for private(y)
+            for(o = 0; o < l.n; ++o){
+                for(y = 0; y < l.out_h; ++y) direct_conv_row(&l, im, o, y, out + (o*l.out_h + y)*l.out_w);
+            }
+        }
+    }
+    requant_convolutional_output(l);
+}
+
+// |B^T d B| for uint8 d, the largest transformed input an accumulator can see
+#define WINOGRAD_INPUT_BOUND (4*255)
+
+int winograd_supported(convolutional_layer l)
+{
+    return l.size == 3 && l.stride == 1 && l.groups == 1 && l.layer_quant_flag && !l.int4_flag;
+}
+
+// M (16 x n x tiles int32) followed by V (16 x c x tiles int16), reused for every batch
+size_t winograd_workspace_size(convolutional_layer l)
+{
+    size_t tiles = (size_t)((l.out_h + 1)/2)*((l.out_w + 1)/2);
+    return 16*tiles*(l.n*sizeof(int32_t) + l.c*sizeof(int16_t));
+}
+
+/*
+ * Winograd F(2x2, 3x3) weight transform U = G g G^T with G doubled so every entry
+ * is an integer, which makes U four times the real transform. g is taken around the
+ * per-channel zero point. If an output channel could overflow the int32 accumulators
+ * the transformed weights are dropped, so the tuner no longer offers winograd and a
+ * layer that was set to it goes back to its default kernel.
+ */
+void transform_convolutional_weights_winograd(convolutional_layer *l)
+{
+    int o, c, i, j, t;
+    int plane = l->n*l->c;
+    for(o = 0; o < l->n; ++o){
+        int zero_point = l->weight_data_uint8_zero_point[o];
+        for(c = 0; c < l->c; ++c){
+            uint8_t *w = l->weights_uint8 + (o*l->c + c)*9;
+            int g[3][3], tmp[4][3];
+            for(i = 0; i < 9; ++i) g[i/3][i%3] = w[i] - zero_point;
+            for(j = 0; j < 3; ++j){
+                tmp[0][j] = 2*g[0][j];
+                tmp[1][j] = g[0][j] + g[1][j] + g[2][j];
+                tmp[2][j] = g[0][j] - g[1][j] + g[2][j];
+                tmp[3][j] = 2*g[2][j];
+            }
+            for(i = 0; i < 4; ++i){
+                int16_t *u = l->weights_winograd + (i*4)*plane + o*l->c + c;
+                u[0*plane] = 2*tmp[i][0];
+                u[1*plane] = tmp[i][0] + tmp[i][1] + tmp[i][2];
+                u[2*plane] = tmp[i][0] - tmp[i][1] + tmp[i][2];
+                u[3*plane] = 2*tmp[i][2];
+            }
+        }
+        for(t = 0; t < 16; ++t){
+            int64_t bound = 0;
+            for(c = 0; c < l->c; ++c) bound += abs(l->weights_winograd[t*plane + o*l->c + c]);
+            if(bound*WINOGRAD_INPUT_BOUND > INT32_MAX){
+                fprintf(stderr, "layer %d: winograd accumulators may overflow, not using winograd\n", l->count);
+                free(l->weights_winograd);
+                l->weights_winograd = 0;
+                l->winograd = 0;
+                if(l->forward == forward_convolutional_layer_quant_winograd){
+                    l->forward = select_convolutional_quant_kernel(*l);
+                    if(!l->forward) l->forward = forward_convolutional_layer_quant_inputi_outputi;
+                }
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Quantized 3x3/stride 1 conv as sixteen (n x c) * (c x tiles) int16 gemms, 16 multiplies
+ * per 2x2 output tile instead of 36. Padding uses the input zero point like im2col, so
+ * output_int32 holds the same sum((w - z2)*x) as the im2col path, exactly.
+ */
+void forward_convolutional_layer_quant_winograd(convolutional_layer l, network net)
+{
+    int b, c, o, ty, tx, i, j;
+    int tiles_h = (l.out_h + 1)/2;
+    int tiles_w = (l.out_w + 1)/2;
+    int tiles = tiles_h*tiles_w;
+    uint8_t zero_point = l.input_data_uint8_zero_point[0];
+    int32_t *M = (int32_t *)net.workspace;
+    int16_t *V = (int16_t *)(M + 16*l.n*tiles);
+    for(b = 0; b < l.batch; ++b){
+        uint8_t *im = net.input_uint8 + b*l.c*l.h*l.w;
+        int32_t *out = l.output_int32 + b*l.n*l.out_h*l.out_w;
+        #pragma omp parallel for private(ty, tx, i, j)
+        for(c = 0; c < l.c; ++c){
+            for(ty = 0; ty < tiles_h; ++ty){
+                for(tx = 0; tx < tiles_w; ++tx){
+                    int d[4][4], tmp[4][4];
+                    for(i = 0; i < 4; ++i){
+                        for(j = 0; j < 4; ++j){
+                            int y = 2*ty - l.pad + i;
+                            int x = 2*tx - l.pad + j;
+                            d[i][j] = (y < 0 || x < 0 || y >= l.h || x >= l.w) ? zero_point : im[(c*l.h + y)*l.w + x];
+                        }
+                    }
+                    for(j = 0; j < 4; ++j){
+                        tmp[0][j] = d[0][j] - d[2][j];
+                        tmp[1][j] = d[1][j] + d[2][j];
+                        tmp[2][j] = d[2][j] - d[1][j];
+                        tmp[3][j] = d[1][j] - d[3][j];
+                    }
+                    int16_t *v = V + c*tiles + ty*tiles_w + tx;
+                    for(i = 0; i < 4; ++i){
+                        v[(i*4 + 0)*l.c*tiles] = tmp[i][0] - tmp[i][2];
+                        v[(i*4 + 1)*l.c*tiles] = tmp[i][1] + tmp[i][2];
+                        v[(i*4 + 2)*l.c*tiles] = tmp[i][2] - tmp[i][1];
+                        v[(i*4 + 3)*l.c*tiles] = tmp[i][1] - tmp[i][3];
+                    }
+                }
+            }
+        }
+        for(i = 0; i < 16; ++i){
+            gemm_nn_int16_int32(l.n, tiles, l.c, l.weights_winograd + i*l.n*l.c, l.c, V + i*l.c*tiles, tiles, M + i*l.n*tiles, tiles);
+        }
+        #pragma omp parallel for private(ty, tx, i, j)
+        for(o = 0; o < l.n; ++o){
+            for(ty = 0; ty < tiles_h; ++ty){
+                for(tx = 0; tx < tiles_w; ++tx){
+                    int64_t m[16], tmp[2][4];
+                    for(i = 0; i < 16; ++i) m[i] = M[(i*l.n + o)*tiles + ty*tiles_w + tx];
+                    for(j = 0; j < 4; ++j){
+                        tmp[0][j] = m[j] + m[4 + j] + m[8 + j];
+                        tmp[1][j] = m[4 + j] - m[8 + j] - m[12 + j];
+                    }
+                    for(i = 0; i < 2; ++i){
+                        int y = 2*ty + i;
+                        if(y >= l.out_h) continue;
+                        for(j = 0; j < 2; ++j){
+                            int x = 2*tx + j;
+                            if(x >= l.out_w) continue;
+                            int64_t s = j ? tmp[i][1] - tmp[i][2] - tmp[i][3] : tmp[i][0] + tmp[i][1] + tmp[i][2];
+                            out[(o*l.out_h + y)*l.out_w + x] = s/4;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    requant_convolutional_output(l);
+}
+
+/*
+ * Re-quantize the per-channel uint8 weights onto a 4-bit grid and pack them two per byte.
+ * weights_uint8 keeps the unpacked 0..15 codes so weights_sum_int and the int16 path stay valid.
+ */
+void quantize_convolutional_weights_int4(convolutional_layer l)
+{
+    int i, j;
+    int size = l.c/l.groups*l.size*l.size;
+    for(i = 0; i < l.n; ++i){
+        float scale = l.weight_data_uint8_scales[i];
+        int zero_point = l.weight_data_uint8_zero_point[i];
+        float min_value = 0;
+        float max_value = 0;
+        for(j = 0; j < size; ++j){
+            float w = (l.weights_uint8[i*size + j] - zero_point)*scale;
+            min_value = min(min_value, w);
+            max_value = max(max_value, w);
+        }
+        float scale4 = (max_value - min_value)/15.;
+        if(scale4 == 0) scale4 = scale;
+        int zero_point4 = clamp(round(-min_value/scale4), 0, 15);
+        for(j = 0; j < size; ++j){
+            float w = (l.weights_uint8[i*size + j] - zero_point)*scale;
+            l.weights_uint8[i*size + j] = clamp(round(w/scale4) + zero_point4, 0, 15);
+        }
+        l.weight_data_uint8_scales[i] = scale4;
+        l.weight_data_uint8_zero_point[i] = zero_point4;
+    }
+    pack_uint4_cpu(l.weights_uint8, l.n, size, l.weights_int4);
+}
+
+// sum of the weight codes of filter i, from the packed copy once the unpacked one is gone
+int32_t convolutional_weights_sum(convolutional_layer l, int i)
+{
+    int j;
+    int32_t sum = 0;
+    int size = l.c*l.size*l.size;
+    if(l.weights_uint8){
+        for(j = 0; j < size; ++j) sum += l.weights_uint8[i*size + j];
+        return sum;
+    }
+    int cols = l.nweights/l.n;
+    uint8_t *row = l.weights_int4 + i*((cols + 1)/2);
+    for(j = 0; j < cols; ++j) sum += (j & 1) ? (row[j/2] >> 4) : (row[j/2] & 0x0F);
+    return sum;
+}
+
+/*
+ * An int4 layer running its own kernel reads only weights_int4 and the per-channel zero
+ * points, so once the quantization sums are taken the unpacked uint8/int16 copies and the
+ * full-size zero point matrices are freed.
+ */
+void release_convolutional_int4_copies(convolutional_layer *l)
+{
+    if(!l->int4_flag || l->forward != forward_convolutional_layer_quant_int4) return;
+    free(l->weights_uint8);
+    free(l->weights_int16);
+    free(l->zero_point_int16);
+    free(l->zero_point_uint8);
+    l->weights_uint8 = 0;
+    l->weights_int16 = 0;
+    l->zero_point_int16 = 0;
+    l->zero_point_uint8 = 0;
+}
+
+void requant_convolutional_output(convolutional_layer l)
+{
+    int b, i, j, s;
     // // y_i = alpha1 * conv(x) --> M*(nz1z2-z1a2-z2a1+q1q2) + z3
     //#pragma omp parallel for
+    for (b = 0; b < l.batch; ++b)
     for (i = 0; i < l.out_c; ++i) {
         for (j = 0; j < l.out_w*l.out_h; ++j){
-            int out_index = i*l.out_w*l.out_h + j;
+            int out_index = b*l.outputs + i*l.out_w*l.out_h + j;
             // int32_t output_quant_value = l.output_int32[out_index] - l.input_sum_int[out_index];
             int32_t output_quant_value = l.output_int32[out_index];
 
@@ -751,11 +1135,8 @@ void forward_convolutional_layer_quant_inputi_outputi(convolutional_layer l, net
     }
     if(l.quant_stop_flag){
         #pragma omp parallel for
-        for (s = 0; s < l.out_c; ++s) {
-            for (t = 0; t < l.out_w*l.out_h; ++t){
-                int out_index = s*l.out_w*l.out_h + t;
-                l.output[out_index] = (l.output_uint8_final[out_index] -  l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
-            }
+        for (s = 0; s < l.outputs*l.batch; ++s) {
+            l.output[s] = (l.output_uint8_final[s] -  l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
         }
     }
 }
@@ -799,6 +1180,95 @@ void forward_convolutional_layer_nobn(convolutional_layer l, network net)
 }
 
 
+void make_convolutional_bit_layer(convolutional_layer *l, int xnor)
+{
+    int ldw = (l->c/l->groups*l->size*l->size + 63)/64;
+    l->xnor = xnor;
+    l->weights_bit = calloc(l->n*ldw, sizeof(uint64_t));
+    l->weights_bit_scales = calloc(l->n, sizeof(float));
+    if(!l->binary_weights) l->binary_weights = calloc(l->nweights, sizeof(float));
+    if(xnor){
+        l->binary_input = calloc(l->inputs*l->batch, sizeof(float));
+        l->input_bit = calloc(l->out_h*l->out_w*ldw, sizeof(uint64_t));
+        l->input_bit_mask = calloc(l->out_h*l->out_w*ldw, sizeof(uint64_t));
+        l->input_bit_valid = calloc(l->out_h*l->out_w, sizeof(int));
+    }
+    l->forward = forward_convolutional_layer_bit;
+    pack_convolutional_bit_weights(l, 0);
+}
+
+/*
+ * Sign-pack the float weights of a binary/xnor layer, after loading, after quantization
+ * folds batch norm in and after every update. drop_float (drop_float_weights=1) frees
+ * the float copies, which only training and saving read, for inference-only networks.
+ */
+void pack_convolutional_bit_weights(convolutional_layer *l, int drop_float)
+{
+    if(!l->weights) return;
+    binarize_weights_bit(l->weights, l->n, l->nweights/l->n, l->weights_bit, l->weights_bit_scales);
+    if(!drop_float) return;
+    free(l->weights);
+    free(l->binary_weights);
+    free(l->binary_input);
+    l->weights = 0;
+    l->binary_weights = 0;
+    l->binary_input = 0;
+}
+
+/*
+ * Inference path for binary=1 and xnor=1 layers, on the sign bits packed at load;
+ * xnor layers also pack the input and run an xnor + popcount gemm, binary layers
+ * add or subtract float inputs. Training still goes through the float path.
+ */
+void forward_convolutional_layer_bit(convolutional_layer l, network net)
+{
+    int i, j;
+    if(net.train){
+#ifdef QUANTIZATION
+        forward_convolutional_layer_nobn(l, net);
+#else
+        forward_convolutional_layer(l, net);
+#endif
+        return;
+    }
+    int m = l.n/l.groups;
+    int k = l.size*l.size*l.c/l.groups;
+    int n = l.out_w*l.out_h;
+    int ldw = (k + 63)/64;
+
+    fill_cpu(l.outputs*l.batch, 0, l.output, 1);
+    for(i = 0; i < l.batch; ++i){
+        for(j = 0; j < l.groups; ++j){
+            uint64_t *a = l.weights_bit + j*m*ldw;
+            float *scales = l.weights_bit_scales + j*m;
+            float *c = l.output + (i*l.groups + j)*n*m;
+            float *im =  net.input + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
+            if(l.xnor){
+                im2col_cpu_bit(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, l.input_bit, l.input_bit_mask, l.input_bit_valid);
+                gemm_nt_xnor(m, n, k, a, l.input_bit, l.input_bit_mask, l.input_bit_valid, ldw, scales, c, n);
+            }else{
+                float *b = net.workspace;
+                if (l.size == 1) {
+                    b = im;
+                } else {
+                    im2col_cpu(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b);
+                }
+                gemm_nn_bit(m, n, k, a, ldw, b, n, scales, c, n);
+            }
+        }
+    }
+#ifdef QUANTIZATION
+    add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+#else
+    if(l.batch_normalize){
+        forward_batchnorm_layer(l, net);
+    }else{
+        add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+    }
+#endif
+    activate_array(l.output, l.outputs*l.batch, l.activation);
+}
+
 void forward_convolutional_layer(convolutional_layer l, network net)
 {
     int i, j;
@@ -847,6 +1317,77 @@ void forward_convolutional_layer(convolutional_layer l, network net)
     // }
 }
 
+#ifdef QUANTIZATION
+// output = weights * im2col(input), the gemm half of forward_convolutional_layer
+static void forward_convolutional_gemm(convolutional_layer l, network net, float *weights, float *output)
+{
+    int i, j;
+    int m = l.n/l.groups;
+    int k = l.size*l.size*l.c/l.groups;
+    int n = l.out_w*l.out_h;
+    fill_cpu(l.outputs*l.batch, 0, output, 1);
+    for(i = 0; i < l.batch; ++i){
+        for(j = 0; j < l.groups; ++j){
+            float *a = weights + j*l.nweights/l.groups;
+            float *b = net.workspace;
+            float *c = output + (i*l.groups + j)*n*m;
+            float *im =  net.input + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
+
+            if (l.size == 1) {
+                b = im;
+            } else {
+                im2col_cpu(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b);
+            }
+            gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
+        }
+    }
+}
+
+/*
+ * Quantization-aware training forward on CPU, the counterpart of
+ * forward_convolutional_layer_quant_gpu. Batch norm is folded into the weights with the
+ * batch statistics of a plain conv pass, the folded weights are fake quantized per
+ * output channel into weights_norm and the activations per tensor with an EMA range.
+ * backward_convolutional_layer is unchanged: it sees the unfolded conv + batch norm and
+ * the float weights, so rounding passes the gradient straight through.
+ */
+void forward_convolutional_layer_qat(convolutional_layer l, network net)
+{
+    int i, j;
+    if(!qat_enabled(l, net)){
+        forward_convolutional_layer(l, net);
+        return;
+    }
+    if(l.count == 0){
+        fake_quant_cpu(1, l.inputs*l.batch, net.input, l.min_input_value, l.max_input_value,
+                l.input_data_uint8_scales, l.input_data_uint8_zero_point, INPUT_QUANT, .999, 0);
+    }
+    int size = l.nweights/l.n;
+    float *biases = l.biases_bn_backup;
+    if(l.batch_normalize){
+        // batch and rolling statistics, plus x and x_norm for backward
+        forward_convolutional_gemm(l, net, l.weights, l.output);
+        forward_batchnorm_layer(l, net);
+        for(i = 0; i < l.n; ++i){
+            float s = l.scales[i]/(sqrt(l.variance[i]) + .000001f);
+            for(j = 0; j < size; ++j){
+                l.weights_norm[i*size + j] = l.weights[i*size + j]*s;
+            }
+            biases[i] = l.biases[i] - l.mean[i]*s;
+        }
+    }else{
+        copy_cpu(l.nweights, l.weights, 1, l.weights_norm, 1);
+        copy_cpu(l.n, l.biases, 1, biases, 1);
+    }
+    fake_quant_cpu(l.n, size, l.weights_norm, 0, 0, l.weight_data_uint8_scales, l.weight_data_uint8_zero_point,
+            WEIGHT_QUANT, 0, 0);
+    forward_convolutional_gemm(l, net, l.weights_norm, l.output);
+    add_bias(l.output, biases, l.batch, l.n, l.out_h*l.out_w);
+    activate_array(l.output, l.outputs*l.batch, l.activation);
+    fake_quant_layer_output(l, net);
+}
+#endif
+
 void backward_convolutional_layer(convolutional_layer l, network net)
 {
     int i, j;
@@ -916,6 +1457,7 @@ void update_convolutional_layer(convolutional_layer l, update_args a)
     axpy_cpu(l.nweights, -decay*batch, l.weights, 1, l.weight_updates, 1);
     axpy_cpu(l.nweights, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
     scal_cpu(l.nweights, momentum, l.weight_updates, 1);
+    if(l.weights_bit) pack_convolutional_bit_weights(&l, 0);
 }
 
 
@@ -36,13 +36,30 @@ void forward_convolutional_layer_quant_inputf_outputf(convolutional_layer l, net
 void forward_convolutional_layer_quant_inputi_outputi(convolutional_layer l, network net);
 void forward_convolutional_layer_quant_inputi_outputi_mkl(convolutional_layer l, network net);
 void forward_convolutional_layer_quant_inputi_outputi_cblas(convolutional_layer l, network net);
+void forward_convolutional_layer_quant_int4(convolutional_layer l, network net);
+void forward_convolutional_layer_quant_colsum(convolutional_layer l, network net);
+void forward_convolutional_layer_quant_direct(convolutional_layer l, network net);
+void forward_convolutional_layer_quant_winograd(convolutional_layer l, network net);
+int winograd_supported(convolutional_layer l);
+size_t winograd_workspace_size(convolutional_layer l);
+void transform_convolutional_weights_winograd(convolutional_layer *l);
+void requant_convolutional_output(convolutional_layer l);
+void pack_convolutional_bit_weights(convolutional_layer *l, int drop_float);
+void quantize_convolutional_weights_int4(convolutional_layer l);
+int32_t convolutional_weights_sum(convolutional_layer l, int i);
+void release_convolutional_int4_copies(convolutional_layer *l);
 void forward_convolutional_layer(const convolutional_layer layer, network net);
+void forward_convolutional_layer_qat(convolutional_layer l, network net);
 void update_convolutional_layer(convolutional_layer layer, update_args a);
 image *visualize_convolutional_layer(convolutional_layer layer, char *window, image *prev_weights);
 void binarize_weights(float *weights, int n, int size, float *binary);
 void binarize_cpu(float *input, int n, float *binary);
 void swap_binary(convolutional_layer *l);
 void binarize_weights2(float *weights, int n, int size, char *binary, float *scales);
+void binarize_weights_bit(float *weights, int n, int size, uint64_t *binary, float *scales);
+void unbinarize_weights_bit(uint64_t *binary, float *scales, int n, int size, float *weights);
+void make_convolutional_bit_layer(convolutional_layer *l, int xnor);
+void forward_convolutional_layer_bit(convolutional_layer l, network net);
 
 void backward_convolutional_layer(convolutional_layer layer, network net);
 
@@ -444,9 +444,8 @@ void fill_truth_mask(char *path, int num_boxes, float *truth, int classes, int w
 }
 
 
-void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy)
+void detection_label_path(char *path, char *labelpath)
 {
-    char labelpath[4096];
     find_replace(path, "images", "labels", labelpath);
     find_replace(labelpath, "JPEGImages", "labels", labelpath);
 
@@ -455,8 +454,21 @@ void fill_truth_detection(char *path, int num_boxes, float *truth, int classes,
     find_replace(labelpath, ".png", ".txt", labelpath);
     find_replace(labelpath, ".JPG", ".txt", labelpath);
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
+}
+
+void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy)
+{
+    char labelpath[4096];
+    detection_label_path(path, labelpath);
     int count = 0;
     box_label *boxes = read_boxes(labelpath, &count);
+    fill_truth_detection_boxes(boxes, count, num_boxes, truth, flip, dx, dy, sx, sy);
+    free(boxes);
+}
+
+// shuffles and moves boxes in place
+void fill_truth_detection_boxes(box_label *boxes, int count, int num_boxes, float *truth, int flip, float dx, float dy, float sx, float sy)
+{
     randomize_boxes(boxes, count);
     correct_boxes(boxes, count, dx, dy, sx, sy, flip);
     if(count > num_boxes) count = num_boxes;
@@ -483,7 +495,6 @@ void fill_truth_detection(char *path, int num_boxes, float *truth, int classes,
         truth[(i-sub)*5+3] = h;
         truth[(i-sub)*5+4] = id;
     }
-    free(boxes);
 }
 
 #define NUMCHARS 37
@@ -1033,55 +1044,65 @@ data load_data_swag(char **paths, int n, int classes, float jitter)
     return d;
 }
 
-data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure)
+// jittered aspect ratio and random offset of an orig_w x orig_h image in a w x h canvas
+void random_detection_placement(int orig_w, int orig_h, int w, int h, float jitter, float *nw, float *nh, float *dx, float *dy)
 {
-    char **random_paths = get_random_paths(paths, n, m);
-    int i;
-    data d = {0};
-    d.shallow = 0;
+    float dw = jitter * orig_w;
+    float dh = jitter * orig_h;
 
-    d.X.rows = n;
-    d.X.vals = calloc(d.X.rows, sizeof(float*));
-    d.X.cols = h*w*3;
+    float new_ar = (orig_w + rand_uniform(-dw, dw)) / (orig_h + rand_uniform(-dh, dh));
+    //float scale = rand_uniform(.25, 2);
+    float scale = 1;
 
-    d.y = make_matrix(n, 5*boxes);
-    for(i = 0; i < n; ++i){
-        image orig = load_image_color(random_paths[i], 0, 0);
-        image sized = make_image(w, h, orig.c);
-        fill_image(sized, .5);
+    if(new_ar < 1){
+        *nh = scale * h;
+        *nw = *nh * new_ar;
+    } else {
+        *nw = scale * w;
+        *nh = *nw / new_ar;
+    }
 
-        float dw = jitter * orig.w;
-        float dh = jitter * orig.h;
+    *dx = rand_uniform(0, w - *nw);
+    *dy = rand_uniform(0, h - *nh);
+}
 
-        float new_ar = (orig.w + rand_uniform(-dw, dw)) / (orig.h + rand_uniform(-dh, dh));
-        //float scale = rand_uniform(.25, 2);
-        float scale = 1;
+// one augmented image and its truth, written into X (w*h*3) and truth (5*boxes)
+void load_image_detection(char *path, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure, float *X, float *truth)
+{
+    image orig = load_image_color(path, 0, 0);
+    image sized = float_to_image(w, h, orig.c, X);
+    fill_image(sized, .5);
 
-        float nw, nh;
+    float nw, nh, dx, dy;
+    random_detection_placement(orig.w, orig.h, w, h, jitter, &nw, &nh, &dx, &dy);
 
-        if(new_ar < 1){
-            nh = scale * h;
-            nw = nh * new_ar;
-        } else {
-            nw = scale * w;
-            nh = nw / new_ar;
-        }
+    place_image(orig, nw, nh, dx, dy, sized);
 
-        float dx = rand_uniform(0, w - nw);
-        float dy = rand_uniform(0, h - nh);
+    random_distort_image(sized, hue, saturation, exposure);
 
-        place_image(orig, nw, nh, dx, dy, sized);
+    int flip = rand()%2;
+    if(flip) flip_image(sized);
 
-        random_distort_image(sized, hue, saturation, exposure);
+    fill_truth_detection(path, boxes, truth, classes, flip, -dx/w, -dy/h, nw/w, nh/h);
 
-        int flip = rand()%2;
-        if(flip) flip_image(sized);
-        d.X.vals[i] = sized.data;
+    free_image(orig);
+}
 
+data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure)
+{
+    char **random_paths = get_random_paths(paths, n, m);
+    int i;
+    data d = {0};
+    d.shallow = 0;
 
-        fill_truth_detection(random_paths[i], boxes, d.y.vals[i], classes, flip, -dx/w, -dy/h, nw/w, nh/h);
+    d.X.rows = n;
+    d.X.vals = calloc(d.X.rows, sizeof(float*));
+    d.X.cols = h*w*3;
 
-        free_image(orig);
+    d.y = make_matrix(n, 5*boxes);
+    for(i = 0; i < n; ++i){
+        d.X.vals[i] = calloc(d.X.cols, sizeof(float));
+        load_image_detection(random_paths[i], w, h, boxes, classes, jitter, hue, saturation, exposure, d.X.vals[i], d.y.vals[i]);
     }
     free(random_paths);
     return d;
@@ -24,7 +24,12 @@ void load_data_blocking(load_args args);
 void print_letters(float *pred, int n);
 data load_data_captcha(char **paths, int n, int m, int k, int w, int h);
 data load_data_captcha_encode(char **paths, int n, int m, int w, int h);
+char **get_random_paths(char **paths, int n, int m);
 data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure);
+void random_detection_placement(int orig_w, int orig_h, int w, int h, float jitter, float *nw, float *nh, float *dx, float *dy);
+void detection_label_path(char *path, char *labelpath);
+void fill_truth_detection_boxes(box_label *boxes, int count, int num_boxes, float *truth, int flip, float dx, float dy, float sx, float sy);
+void load_image_detection(char *path, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure, float *X, float *truth);
 data load_data_tag(char **paths, int n, int m, int k, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure);
 matrix load_image_augment_paths(char **paths, int n, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
 data load_data_super(char **paths, int n, int m, int w, int h, int scale);
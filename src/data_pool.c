@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "data.h"
+#include "shard.h"
+#include "utils.h"
+
+typedef enum{
+    SLOT_FREE, SLOT_FILLING, SLOT_READY, SLOT_IN_USE
+} slot_state;
+
+/*
+ * One batch buffer. X rows point into a single block sized for the largest
+ * resolution the slot has held, so filling never allocates once it is warm.
+ */
+typedef struct{
+    slot_state state;
+    int seq;
+    int gen;
+    int w, h;
+    int next;
+    int done;
+    char **paths;
+    int *indexes;
+    float *X;
+    size_t X_size;
+    data d;
+} data_slot;
+
+/*
+ * Long-lived loader: args.threads workers pull single images off the oldest
+ * batch still being filled and claim a free slot when there is none, so up to
+ * depth batches are prefetched. Batches are handed out in the order they were
+ * claimed. resize_data_pool bumps a generation and stale batches are dropped.
+ */
+struct data_pool{
+    load_args args;
+    int n;
+    int depth;
+    data_slot *slots;
+    int gen;
+    int next_seq;
+    int head_seq;
+    int stop;
+    int threads;
+    pthread_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    int loaded;
+    double last_get;
+    double stall;
+    double images_per_second;
+};
+
+static data_slot *find_slot(data_pool *p, int seq)
+{
+    int i;
+    for(i = 0; i < p->depth; ++i){
+        data_slot *s = p->slots + i;
+        if(s->state != SLOT_FREE && s->seq == seq) return s;
+    }
+    return 0;
+}
+
+// called with the mutex held
+static void claim_slot(data_pool *p, data_slot *s)
+{
+    int i;
+    size_t size = (size_t)p->args.w*p->args.h*3;
+    s->state = SLOT_FILLING;
+    s->seq = p->next_seq++;
+    s->gen = p->gen;
+    s->w = p->args.w;
+    s->h = p->args.h;
+    s->next = 0;
+    s->done = 0;
+    if(size*p->n > s->X_size){
+        free(s->X);
+        s->X = calloc(size*p->n, sizeof(float));
+        s->X_size = size*p->n;
+    }
+    s->d.X.cols = size;
+    for(i = 0; i < p->n; ++i) s->d.X.vals[i] = s->X + i*size;
+    for(i = 0; i < p->n; ++i) memset(s->d.y.vals[i], 0, s->d.y.cols*sizeof(float));
+    if(p->args.shards){
+        s->indexes = calloc(p->n, sizeof(int));
+        for(i = 0; i < p->n; ++i) s->indexes[i] = rand()%p->args.m;
+    }else{
+        s->paths = get_random_paths(p->args.paths, p->n, p->args.m);
+    }
+}
+
+// the oldest batch with images left to hand out, or a free slot turned into one
+static data_slot *next_job_slot(data_pool *p)
+{
+    int i;
+    data_slot *s = 0;
+    for(i = 0; i < p->depth; ++i){
+        data_slot *c = p->slots + i;
+        if(c->state == SLOT_FILLING && c->next < p->n && (!s || c->seq < s->seq)) s = c;
+    }
+    if(s) return s;
+    for(i = 0; i < p->depth; ++i){
+        if(p->slots[i].state == SLOT_FREE){
+            claim_slot(p, p->slots + i);
+            return p->slots + i;
+        }
+    }
+    return 0;
+}
+
+static void *data_pool_worker(void *ptr)
+{
+    data_pool *p = ptr;
+    load_args a = p->args;
+    pthread_mutex_lock(&p->mutex);
+    while(!p->stop){
+        data_slot *s = next_job_slot(p);
+        if(!s){
+            pthread_cond_wait(&p->changed, &p->mutex);
+            continue;
+        }
+        if(s->gen != p->gen){
+            s->done += p->n - s->next;
+            s->next = p->n;
+        }else{
+            int i = s->next++;
+            pthread_mutex_unlock(&p->mutex);
+            if(a.shards){
+                load_shard_detection(a.shards, s->indexes[i], s->w, s->h, a.num_boxes, a.jitter, a.hue, a.saturation, a.exposure,
+                                     s->d.X.vals[i], s->d.y.vals[i]);
+            }else{
+                load_image_detection(s->paths[i], s->w, s->h, a.num_boxes, a.classes, a.jitter, a.hue, a.saturation, a.exposure,
+                                     s->d.X.vals[i], s->d.y.vals[i]);
+            }
+            pthread_mutex_lock(&p->mutex);
+            ++s->done;
+            ++p->loaded;
+        }
+        if(s->done == p->n){
+            free(s->paths);
+            free(s->indexes);
+            s->paths = 0;
+            s->indexes = 0;
+            s->state = SLOT_READY;
+            pthread_cond_broadcast(&p->changed);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return 0;
+}
+
+data_pool *make_data_pool(load_args args, int depth)
+{
+    int i;
+    if(args.type != DETECTION_DATA) error("data pool: only DETECTION_DATA is supported");
+    if(args.threads == 0) args.threads = 1;
+    if(depth < 1) depth = 1;
+    if(args.exposure == 0) args.exposure = 1;
+    if(args.saturation == 0) args.saturation = 1;
+    if(args.aspect == 0) args.aspect = 1;
+
+    data_pool *p = calloc(1, sizeof(data_pool));
+    p->args = args;
+    p->n = args.n;
+    p->depth = depth;
+    p->threads = args.threads;
+    p->slots = calloc(depth, sizeof(data_slot));
+    for(i = 0; i < depth; ++i){
+        data_slot *s = p->slots + i;
+        s->d.shallow = 1;
+        s->d.X.rows = p->n;
+        s->d.X.vals = calloc(p->n, sizeof(float *));
+        s->d.y = make_matrix(p->n, 5*args.num_boxes);
+    }
+    pthread_mutex_init(&p->mutex, 0);
+    pthread_cond_init(&p->changed, 0);
+    p->last_get = what_time_is_it_now();
+    p->workers = calloc(p->threads, sizeof(pthread_t));
+    for(i = 0; i < p->threads; ++i){
+        if(pthread_create(&p->workers[i], 0, data_pool_worker, p)) error("Thread creation failed");
+    }
+    return p;
+}
+
+/*
+ * Blocks until the next batch is loaded. The data stays owned by the pool and
+ * goes back with release_pool_data, do not free_data it.
+ */
+data get_pool_data(data_pool *p)
+{
+    data d = {0};
+    double start = what_time_is_it_now();
+    pthread_mutex_lock(&p->mutex);
+    while(1){
+        data_slot *s = find_slot(p, p->head_seq);
+        if(s && s->state == SLOT_READY){
+            ++p->head_seq;
+            if(s->gen != p->gen){
+                s->state = SLOT_FREE;
+                pthread_cond_broadcast(&p->changed);
+                continue;
+            }
+            s->state = SLOT_IN_USE;
+            d = s->d;
+            break;
+        }
+        pthread_cond_wait(&p->changed, &p->mutex);
+    }
+    double now = what_time_is_it_now();
+    p->stall = now - start;
+    p->images_per_second = p->loaded/(now - p->last_get);
+    p->loaded = 0;
+    p->last_get = now;
+    pthread_mutex_unlock(&p->mutex);
+    return d;
+}
+
+void release_pool_data(data_pool *p, data d)
+{
+    int i;
+    pthread_mutex_lock(&p->mutex);
+    for(i = 0; i < p->depth; ++i){
+        data_slot *s = p->slots + i;
+        if(s->state == SLOT_IN_USE && s->d.X.vals == d.X.vals){
+            s->state = SLOT_FREE;
+            pthread_cond_broadcast(&p->changed);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// batches queued at the old size are dropped, the next get returns the new size
+void resize_data_pool(data_pool *p, int w, int h)
+{
+    pthread_mutex_lock(&p->mutex);
+    p->args.w = w;
+    p->args.h = h;
+    ++p->gen;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// seconds the last get waited and images loaded per second since the get before it
+void data_pool_stats(data_pool *p, double *stall, double *images_per_second)
+{
+    pthread_mutex_lock(&p->mutex);
+    *stall = p->stall;
+    *images_per_second = p->images_per_second;
+    pthread_mutex_unlock(&p->mutex);
+}
+
+void free_data_pool(data_pool *p)
+{
+    int i;
+    if(!p) return;
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->mutex);
+    for(i = 0; i < p->threads; ++i) pthread_join(p->workers[i], 0);
+    for(i = 0; i < p->depth; ++i){
+        data_slot *s = p->slots + i;
+        free(s->paths);
+        free(s->indexes);
+        free(s->X);
+        free(s->d.X.vals);
+        free_matrix(s->d.y);
+    }
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->changed);
+    free(p->workers);
+    free(p->slots);
+    free(p);
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "depth_first.h"
+#include "utils.h"
+
+// stripe working set the automatic row count aims for, roughly one core's L2
+#define DEPTH_FIRST_CACHE_BYTES (1024*1024)
+// give up on fitting the cache before halo recompute costs more than this
+#define DEPTH_FIRST_MAX_OVERHEAD 1.15
+
+typedef struct{
+    uint8_t *input;
+    uint8_t *output_uint8;
+    int32_t *output_int32;
+    float *output;
+    int *indexes;
+    int input_size;
+    int output_size;
+} stripe_buffers;
+
+int depth_first_supported(layer l)
+{
+    if(!l.layer_quant_flag || l.close_quantization) return 0;
+    return l.type == CONVOLUTIONAL || l.type == MAXPOOL;
+}
+
+// first input row read by output row 0, as in im2col and forward_maxpool_layer_quant
+static int stripe_row_offset(layer l)
+{
+    return l.type == MAXPOOL ? l.pad/2 : l.pad;
+}
+
+static int stripe_out_height(layer l, int h)
+{
+    if(l.type == MAXPOOL) return (h + l.pad - l.size)/l.stride + 1;
+    return (h + 2*l.pad - l.size)/l.stride + 1;
+}
+
+/*
+ * Number of leading layers that run depth-first: at most net->depth_first, stopping at
+ * the first layer that is not a quantized conv or maxpool. Every layer but the last of
+ * the chain only exists one stripe at a time, so the cut is moved up until no later
+ * route or shortcut reads one of them.
+ */
+int get_depth_first_cut(network *net)
+{
+    int i, j;
+    int n = 0;
+    while(n < net->depth_first && n < net->n && depth_first_supported(net->layers[n])) ++n;
+    for(i = n; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j){
+                if(l.input_layers[j] < n - 1) n = l.input_layers[j] + 1;
+            }
+        }
+        if(l.type == SHORTCUT && l.index < n - 1) n = l.index + 1;
+    }
+    return n;
+}
+
+// rows of layer j's input needed for out rows [ya, yb], start aligned to the stride
+static void stripe_input_rows(layer l, int ya, int yb, int *ia, int *ib)
+{
+    int a = ya*l.stride - stripe_row_offset(l);
+    *ia = a < 0 ? 0 : a/l.stride*l.stride;
+    *ib = min(l.h - 1, yb*l.stride - stripe_row_offset(l) + l.size - 1);
+}
+
+// multiply-adds per output pixel, maxpool counted by its compares
+static double stripe_layer_cost(layer l)
+{
+    if(l.type == MAXPOOL) return l.c*l.size*l.size;
+    return (double)l.n*l.c/l.groups*l.size*l.size;
+}
+
+/*
+ * Walk the stripes for a given row count, returning the work done relative to running
+ * the layers whole (halo rows get recomputed by neighbouring stripes) and the largest
+ * per-stripe working set in bytes.
+ */
+static double stripe_overhead(network *net, int n, int rows, size_t *working_set)
+{
+    int j, y;
+    double full = 0, striped = 0;
+    layer last = net->layers[n-1];
+    *working_set = 0;
+    for(j = 0; j < n; ++j){
+        layer l = net->layers[j];
+        full += stripe_layer_cost(l)*l.out_h*l.out_w;
+    }
+    for(y = 0; y < last.out_h; y += rows){
+        int ya = y, yb = min(y + rows, last.out_h) - 1, ia, ib;
+        size_t bytes = 0;
+        for(j = n - 1; j >= 0; --j){
+            layer l = net->layers[j];
+            stripe_input_rows(l, ya, yb, &ia, &ib);
+            striped += stripe_layer_cost(l)*stripe_out_height(l, ib - ia + 1)*l.out_w;
+            bytes += (size_t)l.c*(ib - ia + 1)*l.w + (size_t)l.out_c*(yb - ya + 1)*l.out_w;
+            ya = ia;
+            yb = ib;
+        }
+        if(bytes > *working_set) *working_set = bytes;
+    }
+    return striped/full;
+}
+
+/*
+ * Output rows of the last chain layer per stripe. net->depth_first_rows wins if set,
+ * otherwise the stripe is halved until it fits the cache, as long as the halo
+ * recompute stays under DEPTH_FIRST_MAX_OVERHEAD.
+ */
+int get_depth_first_rows(network *net, int n)
+{
+    int rows = net->layers[n-1].out_h;
+    size_t working_set;
+    if(net->depth_first_rows > 0) return min(net->depth_first_rows, rows);
+    while(rows > 1){
+        stripe_overhead(net, n, rows, &working_set);
+        if(working_set <= DEPTH_FIRST_CACHE_BYTES) break;
+        if(stripe_overhead(net, n, (rows + 1)/2, &working_set) > DEPTH_FIRST_MAX_OVERHEAD) break;
+        rows = (rows + 1)/2;
+    }
+    return rows;
+}
+
+static uint8_t *grow_input(uint8_t *buffer, int *size, int needed)
+{
+    if(needed <= *size) return buffer;
+    *size = needed;
+    return realloc(buffer, needed*sizeof(uint8_t));
+}
+
+static void copy_rows(uint8_t *src, int src_h, int src_row, uint8_t *dst, int dst_h, int dst_row, int rows, int w, int c)
+{
+    int k;
+    for(k = 0; k < c; ++k){
+        memcpy(dst + (k*dst_h + dst_row)*w, src + (k*src_h + src_row)*w, rows*w*sizeof(uint8_t));
+    }
+}
+
+/*
+ * Run the first get_depth_first_cut layers stripe by stripe: each stripe of the last
+ * layer's output is produced by running every chain layer on just the input rows it
+ * needs, halo included, so intermediate activations stay in cache instead of making
+ * a full-resolution round trip through memory per layer. Sub-layers keep their own
+ * padding only where the stripe touches the real image border, so the result is
+ * identical to forward_network. Returns the number of layers run and leaves net
+ * pointing at the last one's output.
+ */
+int forward_network_depth_first(network *net)
+{
+    int n = get_depth_first_cut(net);
+    if(n < 2) return 0;
+    int rows = get_depth_first_rows(net, n);
+    layer last = net->layers[n-1];
+    stripe_buffers *buffers = calloc(n, sizeof(stripe_buffers));
+    int *ya = calloc(n, sizeof(int));
+    int *yb = calloc(n, sizeof(int));
+    int *ia = calloc(n, sizeof(int));
+    int *ib = calloc(n, sizeof(int));
+    int b, j, y;
+
+    for(b = 0; b < last.batch; ++b){
+        for(y = 0; y < last.out_h; y += rows){
+            ya[n-1] = y;
+            yb[n-1] = min(y + rows, last.out_h) - 1;
+            for(j = n - 1; j >= 0; --j){
+                stripe_input_rows(net->layers[j], ya[j], yb[j], &ia[j], &ib[j]);
+                if(j > 0){
+                    ya[j-1] = ia[j];
+                    yb[j-1] = ib[j];
+                }
+            }
+            for(j = 0; j < n; ++j){
+                layer l = net->layers[j];
+                stripe_buffers *s = &buffers[j];
+                layer sub = l;
+                sub.batch = 1;
+                sub.h = ib[j] - ia[j] + 1;
+                sub.out_h = stripe_out_height(l, sub.h);
+                sub.inputs = sub.h*l.w*l.c;
+                sub.outputs = sub.out_h*l.out_w*l.out_c;
+                if(j == 0){
+                    s->input = grow_input(s->input, &s->input_size, sub.inputs);
+                    copy_rows(net->input_uint8 + b*l.inputs, l.h, ia[j], s->input, sub.h, 0, sub.h, l.w, l.c);
+                }
+                if(sub.outputs > s->output_size){
+                    s->output_size = sub.outputs;
+                    s->output_uint8 = realloc(s->output_uint8, sub.outputs*sizeof(uint8_t));
+                    s->output_int32 = realloc(s->output_int32, sub.outputs*sizeof(int32_t));
+                    s->output = realloc(s->output, sub.outputs*sizeof(float));
+                    s->indexes = realloc(s->indexes, sub.outputs*sizeof(int));
+                }
+                sub.output_uint8_final = s->output_uint8;
+                sub.output_int32 = s->output_int32;
+                sub.output = s->output;
+                sub.indexes = s->indexes;
+
+                network subnet = *net;
+                subnet.input_uint8 = s->input;
+                sub.forward(sub, subnet);
+
+                int first = ya[j] - ia[j]/l.stride;
+                int count = yb[j] - ya[j] + 1;
+                assert(first >= 0 && first + count <= sub.out_h);
+                if(j < n - 1){
+                    stripe_buffers *next = &buffers[j+1];
+                    next->input = grow_input(next->input, &next->input_size, count*l.out_w*l.out_c);
+                    copy_rows(s->output_uint8, sub.out_h, first, next->input, count, 0, count, l.out_w, l.out_c);
+                }else{
+                    copy_rows(s->output_uint8, sub.out_h, first, l.output_uint8_final + b*l.outputs, l.out_h, ya[j], count, l.out_w, l.out_c);
+                    if(l.quant_stop_flag){
+                        int k;
+                        for(k = 0; k < l.out_c; ++k){
+                            memcpy(l.output + b*l.outputs + (k*l.out_h + ya[j])*l.out_w, s->output + (k*sub.out_h + first)*l.out_w, count*l.out_w*sizeof(float));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for(j = 0; j < n; ++j){
+        free(buffers[j].input);
+        free(buffers[j].output_uint8);
+        free(buffers[j].output_int32);
+        free(buffers[j].output);
+        free(buffers[j].indexes);
+    }
+    free(buffers);
+    free(ya);
+    free(yb);
+    free(ia);
+    free(ib);
+    net->input_uint8 = last.output_uint8_final;
+    net->input = last.output;
+    printf("transfer [uint8] data | depth-first layers 0-%d in stripes of %d rows...\n", n - 1, rows);
+    return n;
+}
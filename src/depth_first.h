@@ -0,0 +1,10 @@
+#ifndef DEPTH_FIRST_H
+#define DEPTH_FIRST_H
+#include "darknet.h"
+
+int depth_first_supported(layer l);
+int get_depth_first_cut(network *net);
+int get_depth_first_rows(network *net, int n);
+int forward_network_depth_first(network *net);
+
+#endif
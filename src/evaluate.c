@@ -0,0 +1,681 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "evaluate.h"
+#include "network.h"
+#include "image.h"
+#include "data.h"
+#include "box.h"
+#include "tile.h"
+#include "utils.h"
+
+typedef struct{
+    char *cfgfile;
+    char *weightfile;
+    int close_quantization;
+    char **paths;
+    int m;
+    float thresh;
+    float hier;
+    eval_detections *dets;
+    int next;
+    pthread_mutex_t mutex;
+} eval_job;
+
+static int next_eval_image(eval_job *job)
+{
+    pthread_mutex_lock(&job->mutex);
+    int i = job->next++;
+    pthread_mutex_unlock(&job->mutex);
+    if(i%100 == 0 && i < job->m) fprintf(stderr, "%d/%d\n", i, job->m);
+    return i < job->m ? i : -1;
+}
+
+// one network per worker, images handed out one at a time
+static void *eval_worker(void *ptr)
+{
+    eval_job *job = ptr;
+    network *net = load_network(job->cfgfile, job->weightfile, job->close_quantization);
+    set_batch_network(net, 1);
+#ifdef QUANTIZATION
+#ifndef GPU
+    // letterboxed pixels are 8-bit already, so a fixed 1/255 input scale quantizes them exactly
+    quantization_weights_and_activations_fixed(net);
+#endif
+#endif
+    image_tile whole = {0, 0, net->w, net->h};
+    int i, j, k;
+    while((i = next_eval_image(job)) >= 0){
+        image im = load_image_color(job->paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        load_image_tile(net, sized, whole, 0);
+        network_predict(net, net->input);
+        int nboxes = 0;
+        detection *dets = get_network_boxes(net, im.w, im.h, job->thresh, job->hier, 0, 1, &nboxes);
+        eval_detections *d = job->dets + i;
+        d->classes = net->layers[net->n-1].classes;
+        d->c = calloc(nboxes, sizeof(eval_candidate));
+        int nprobs = 0;
+        for(k = 0; k < nboxes; ++k){
+            for(j = 0; j < dets[k].classes; ++j) if(dets[k].prob[j]) ++nprobs;
+        }
+        d->probs = calloc(nprobs + 1, sizeof(eval_class_prob));
+        nprobs = 0;
+        for(k = 0; k < nboxes; ++k){
+            if(dets[k].objectness == 0) continue;
+            eval_candidate *c = d->c + d->n++;
+            c->bbox = dets[k].bbox;
+            c->objectness = dets[k].objectness;
+            c->probs = d->probs + nprobs;
+            for(j = 0; j < dets[k].classes; ++j){
+                if(!dets[k].prob[j]) continue;
+                eval_class_prob p = {j, dets[k].prob[j]};
+                c->probs[c->nprobs++] = p;
+            }
+            nprobs += c->nprobs;
+        }
+        free_detections(dets, nboxes);
+        free_image(im);
+        free_image(sized);
+    }
+    free_network(net);
+    return 0;
+}
+
+// runs every image through the network once, keeping the boxes above thresh before nms
+eval_detections *predict_eval_detections(char *cfgfile, char *weightfile, int close_quantization, char **paths, int m, float thresh, float hier, int threads)
+{
+    int i;
+    eval_job job = {0};
+    job.cfgfile = cfgfile;
+    job.weightfile = weightfile;
+    job.close_quantization = close_quantization;
+    job.paths = paths;
+    job.m = m;
+    job.thresh = thresh;
+    job.hier = hier;
+    job.dets = calloc(m, sizeof(eval_detections));
+    pthread_mutex_init(&job.mutex, 0);
+#ifdef GPU
+    threads = 1;
+#endif
+    if(threads < 1) threads = 1;
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    for(i = 0; i < threads; ++i){
+        if(pthread_create(&workers[i], 0, eval_worker, &job)) error("Thread creation failed");
+    }
+    for(i = 0; i < threads; ++i) pthread_join(workers[i], 0);
+    pthread_mutex_destroy(&job.mutex);
+    free(workers);
+    return job.dets;
+}
+
+void free_eval_detections(eval_detections *d, int m)
+{
+    int i;
+    for(i = 0; i < m; ++i){
+        free(d[i].c);
+        free(d[i].probs);
+    }
+    free(d);
+}
+
+static int eval_candidate_comparator(const void *pa, const void *pb)
+{
+    float diff = ((eval_candidate *)pa)->objectness - ((eval_candidate *)pb)->objectness;
+    if(diff < 0) return 1;
+    else if(diff > 0) return -1;
+    return 0;
+}
+
+/*
+ * do_nms_obj on candidates: sorts by objectness and moves the survivors to the
+ * front, still sorted, returning how many there are. A box a threshold keeps
+ * is only ever suppressed by a higher one, so nms once at the lowest threshold
+ * and cutting the sorted survivors gives the same boxes as nms per threshold.
+ */
+int eval_nms(eval_candidate *c, int n, float nms)
+{
+    int i, j, kept = 0;
+    qsort(c, n, sizeof(eval_candidate), eval_candidate_comparator);
+    if(!nms) return n;
+    for(i = 0; i < n; ++i){
+        if(c[i].objectness == 0) continue;
+        for(j = i+1; j < n; ++j){
+            if(c[j].objectness != 0 && box_iou(c[i].bbox, c[j].bbox) > nms) c[j].objectness = 0;
+        }
+        c[kept++] = c[i];
+    }
+    return kept;
+}
+
+#define LABEL_INDEX_MAGIC 0x5844494c
+#define LABEL_INDEX_VERSION 1
+
+static label_index *make_label_index(int m, int nboxes)
+{
+    label_index *idx = calloc(1, sizeof(label_index));
+    idx->m = m;
+    idx->w = calloc(m, sizeof(int));
+    idx->h = calloc(m, sizeof(int));
+    idx->first = calloc(m + 1, sizeof(int));
+    idx->boxes = calloc(nboxes + 1, sizeof(label_box));
+    return idx;
+}
+
+void free_label_index(label_index *idx)
+{
+    if(!idx) return;
+    free(idx->w);
+    free(idx->h);
+    free(idx->first);
+    free(idx->boxes);
+    free(idx);
+}
+
+static int label_box_comparator(const void *pa, const void *pb)
+{
+    return ((label_box *)pa)->id - ((label_box *)pb)->id;
+}
+
+static label_index *build_label_index(char **paths, char **labelpaths, int m)
+{
+    int i, j;
+    box_label **labels = calloc(m, sizeof(box_label *));
+    int *counts = calloc(m, sizeof(int));
+    int *w = calloc(m, sizeof(int));
+    int *h = calloc(m, sizeof(int));
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < m; ++i){
+        labels[i] = read_boxes(labelpaths[i], &counts[i]);
+        if(!image_size(paths[i], &w[i], &h[i])) w[i] = h[i] = 0;
+    }
+    int nboxes = 0;
+    for(i = 0; i < m; ++i) nboxes += counts[i];
+    label_index *idx = make_label_index(m, nboxes);
+    for(i = 0; i < m; ++i){
+        label_box *b = idx->boxes + idx->first[i];
+        idx->first[i+1] = idx->first[i] + counts[i];
+        idx->w[i] = w[i];
+        idx->h[i] = h[i];
+        for(j = 0; j < counts[i]; ++j){
+            label_box l = {labels[i][j].id, labels[i][j].x, labels[i][j].y, labels[i][j].w, labels[i][j].h};
+            b[j] = l;
+        }
+        qsort(b, counts[i], sizeof(label_box), label_box_comparator);
+        free(labels[i]);
+    }
+    free(labels);
+    free(counts);
+    free(w);
+    free(h);
+    return idx;
+}
+
+static label_index *read_label_index(char *filename, int m)
+{
+    int header[4];
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    if(fread(header, sizeof(int), 4, fp) != 4 || header[0] != LABEL_INDEX_MAGIC || header[1] != LABEL_INDEX_VERSION
+            || header[2] != m || header[3] < 0){
+        fclose(fp);
+        return 0;
+    }
+    label_index *idx = make_label_index(m, header[3]);
+    int ok = fread(idx->w, sizeof(int), m, fp) == m
+        && fread(idx->h, sizeof(int), m, fp) == m
+        && fread(idx->first, sizeof(int), m + 1, fp) == m + 1
+        && idx->first[m] == header[3]
+        && fread(idx->boxes, sizeof(label_box), header[3], fp) == header[3];
+    fclose(fp);
+    if(!ok){
+        free_label_index(idx);
+        return 0;
+    }
+    return idx;
+}
+
+static void write_label_index(char *filename, label_index *idx)
+{
+    int nboxes = idx->first[idx->m];
+    int header[4] = {LABEL_INDEX_MAGIC, LABEL_INDEX_VERSION, idx->m, nboxes};
+    FILE *fp = fopen(filename, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't cache labels in %s\n", filename);
+        return;
+    }
+    fwrite(header, sizeof(int), 4, fp);
+    fwrite(idx->w, sizeof(int), idx->m, fp);
+    fwrite(idx->h, sizeof(int), idx->m, fp);
+    fwrite(idx->first, sizeof(int), idx->m + 1, fp);
+    fwrite(idx->boxes, sizeof(label_box), nboxes, fp);
+    fclose(fp);
+}
+
+// the cache holds while it is newer than the list and every label file
+static int label_index_fresh(char *filename, char *listfile, char **labelpaths, int m)
+{
+    int i;
+    struct stat cache, st;
+    if(stat(filename, &cache) || stat(listfile, &st) || st.st_mtime > cache.st_mtime) return 0;
+    for(i = 0; i < m; ++i){
+        if(stat(labelpaths[i], &st) || st.st_mtime > cache.st_mtime) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Labels and image sizes of every image in the list, cached in <listfile>.labels
+ * so repeated evaluations skip the label path rewriting and text parsing.
+ */
+label_index *load_label_index(char *listfile, char **paths, int m)
+{
+    int i;
+    char cache[4096];
+    char **labelpaths = calloc(m, sizeof(char *));
+    for(i = 0; i < m; ++i){
+        char labelpath[4096];
+        detection_label_path(paths[i], labelpath);
+        labelpaths[i] = copy_string(labelpath);
+    }
+    snprintf(cache, sizeof(cache), "%s.labels", listfile);
+    label_index *idx = 0;
+    if(label_index_fresh(cache, listfile, labelpaths, m)) idx = read_label_index(cache, m);
+    if(!idx){
+        double start = what_time_is_it_now();
+        idx = build_label_index(paths, labelpaths, m);
+        write_label_index(cache, idx);
+        fprintf(stderr, "Indexed %d labels of %d images in %lf seconds\n", idx->first[m], m, what_time_is_it_now() - start);
+    }
+    free_ptrs((void **)labelpaths, m);
+    return idx;
+}
+
+/*
+ * Class agnostic recall, precision and F1 for every objectness threshold and
+ * nms value from a single inference pass. A truth box is found when a kept
+ * detection above the threshold overlaps it by more than iou_thresh.
+ */
+void evaluate_detector_f1(char *datacfg, char *cfgfile, char *weightfile, char *thresholds, char *nms_values, float hier_thresh, float iou_thresh, int close_quantization, char *outfile, int threads)
+{
+    list *options = read_data_cfg(datacfg);
+    char *valid_images = option_find_str(options, "valid", "data/train.list");
+    list *plist = get_paths(valid_images);
+    char **paths = (char **)list_to_array(plist);
+    int m = plist->size;
+    int nt, nn, i, j, k, s, t;
+    float *threshs = read_floatlist(thresholds, &nt, .5);
+    float *nms = read_floatlist(nms_values, &nn, .1);
+    float lowest = threshs[0];
+    for(t = 1; t < nt; ++t) if(threshs[t] < lowest) lowest = threshs[t];
+
+    label_index *truth = load_label_index(valid_images, paths, m);
+
+    double start = what_time_is_it_now();
+    eval_detections *dets = predict_eval_detections(cfgfile, weightfile, close_quantization, paths, m, lowest, hier_thresh, threads);
+    fprintf(stderr, "Predicted %d images once in %lf seconds\n", m, what_time_is_it_now() - start);
+
+    FILE *fp = 0;
+    if(outfile){
+        fp = fopen(outfile, "a");
+        if(!fp) file_error(outfile);
+    }
+    int max_candidates = 0;
+    for(i = 0; i < m; ++i) if(dets[i].n > max_candidates) max_candidates = dets[i].n;
+    eval_candidate *kept = calloc(max_candidates + 1, sizeof(eval_candidate));
+    int *tp = calloc(nt, sizeof(int));
+    int *positives = calloc(nt, sizeof(int));
+    float *iou_sum = calloc(nt, sizeof(float));
+
+    for(s = 0; s < nn; ++s){
+        int total = 0;
+        memset(tp, 0, nt*sizeof(int));
+        memset(positives, 0, nt*sizeof(int));
+        memset(iou_sum, 0, nt*sizeof(float));
+        for(i = 0; i < m; ++i){
+            memcpy(kept, dets[i].c, dets[i].n*sizeof(eval_candidate));
+            int n = eval_nms(kept, dets[i].n, nms[s]);
+            total += truth->first[i+1] - truth->first[i];
+            for(t = 0; t < nt; ++t){
+                for(k = 0; k < n && kept[k].objectness > threshs[t]; ++k) ++positives[t];
+                for(j = truth->first[i]; j < truth->first[i+1]; ++j){
+                    box b = {truth->boxes[j].x, truth->boxes[j].y, truth->boxes[j].w, truth->boxes[j].h};
+                    float best_iou = 0;
+                    for(k = 0; k < n && kept[k].objectness > threshs[t]; ++k){
+                        float iou = box_iou(kept[k].bbox, b);
+                        if(iou > best_iou) best_iou = iou;
+                    }
+                    iou_sum[t] += best_iou;
+                    if(best_iou > iou_thresh) ++tp[t];
+                }
+            }
+        }
+        for(t = 0; t < nt; ++t){
+            float recall = total ? 100.*tp[t]/total : 0;
+            float precision = positives[t] ? 100.*tp[t]/positives[t] : 0;
+            float f1 = (total + positives[t]) ? 100.*2*tp[t]/(total + positives[t]) : 0;
+            printf("nms %.2f thresh %.2f: %5d %5d %5d\tIOU: %.2f%%\tRecall:%.2f%%\tPrecision:%.2f%%\tF1:%.2f%%\n",
+                    nms[s], threshs[t], tp[t], total, positives[t], total ? iou_sum[t]*100/total : 0, recall, precision, f1);
+            if(fp) fprintf(fp, "nms = %f, thresh = %f, recall = %f, precison = %f, f1 score = %f\n", nms[s], threshs[t], recall, precision, f1);
+        }
+    }
+    if(fp) fclose(fp);
+
+    free(kept);
+    free(tp);
+    free(positives);
+    free(iou_sum);
+    free_eval_detections(dets, m);
+    free_label_index(truth);
+    free(threshs);
+    free(nms);
+    free_ptrs((void **)paths, m);
+    free_list(plist);
+    free_list(options);
+}
+
+typedef struct{
+    int image;
+    int class;
+    float score;
+    box bbox;
+} map_detection;
+
+static int map_detection_comparator(const void *pa, const void *pb)
+{
+    map_detection *a = (map_detection *)pa;
+    map_detection *b = (map_detection *)pb;
+    if(a->class != b->class) return a->class - b->class;
+    if(a->score < b->score) return 1;
+    if(a->score > b->score) return -1;
+    return 0;
+}
+
+/*
+ * Every class above the threshold of every candidate, as validate_detector
+ * writes them after do_nms_sort: a box and class pair survives unless a higher
+ * scoring box of the same class overlaps it by more than nms.
+ */
+static int predicted_map_detections(eval_detections *dets, int m, int classes, float nms, map_detection **out)
+{
+    int i, j, k, n = 0;
+    for(i = 0; i < m; ++i){
+        for(j = 0; j < dets[i].n; ++j) n += dets[i].c[j].nprobs;
+    }
+    map_detection *d = calloc(n + 1, sizeof(map_detection));
+    n = 0;
+    for(i = 0; i < m; ++i){
+        // the image's pairs go at the end of d, survivors are moved down over them
+        map_detection *r = d + n;
+        int nr = 0;
+        for(j = 0; j < dets[i].n; ++j){
+            eval_candidate c = dets[i].c[j];
+            for(k = 0; k < c.nprobs; ++k){
+                if(c.probs[k].class >= classes) continue;
+                map_detection e = {i, c.probs[k].class, c.probs[k].prob, c.bbox};
+                r[nr++] = e;
+            }
+        }
+        qsort(r, nr, sizeof(map_detection), map_detection_comparator);
+        for(j = 0; j < nr; ++j){
+            if(r[j].score == 0) continue;
+            for(k = j+1; k < nr && r[k].class == r[j].class; ++k){
+                if(r[k].score != 0 && box_iou(r[j].bbox, r[k].bbox) > nms) r[k].score = 0;
+            }
+            d[n++] = r[j];
+        }
+    }
+    *out = d;
+    return n;
+}
+
+typedef struct{
+    char *id;
+    int image;
+} image_id;
+
+static int image_id_comparator(const void *pa, const void *pb)
+{
+    return strcmp(((image_id *)pa)->id, ((image_id *)pb)->id);
+}
+
+/*
+ * Reads the per class files the valid modes write, <prefix>/<outfile><name>.txt,
+ * one "id score xmin ymin xmax ymax" line per box in 1-based pixels, back into
+ * boxes relative to the image size the label index holds.
+ */
+static int read_map_detections(char *prefix, char *outfile, char **names, int classes, char **paths, label_index *truth, map_detection **out)
+{
+    int i, j, n = 0, size = 1024, unknown = 0;
+    map_detection *d = calloc(size, sizeof(map_detection));
+    image_id *ids = calloc(truth->m, sizeof(image_id));
+    for(i = 0; i < truth->m; ++i){
+        ids[i].id = basecfg(paths[i]);
+        ids[i].image = i;
+    }
+    qsort(ids, truth->m, sizeof(image_id), image_id_comparator);
+    for(j = 0; j < classes; ++j){
+        char buff[4096];
+        char id[4096];
+        float score, xmin, ymin, xmax, ymax;
+        snprintf(buff, sizeof(buff), "%s/%s%s.txt", prefix, outfile, names[j]);
+        FILE *fp = fopen(buff, "r");
+        if(!fp){
+            fprintf(stderr, "No detections for %s, %s is missing\n", names[j], buff);
+            continue;
+        }
+        while(fscanf(fp, "%4095s %f %f %f %f %f", id, &score, &xmin, &ymin, &xmax, &ymax) == 6){
+            image_id key = {id, 0};
+            image_id *found = bsearch(&key, ids, truth->m, sizeof(image_id), image_id_comparator);
+            if(!found || !truth->w[found->image]){
+                ++unknown;
+                continue;
+            }
+            i = found->image;
+            if(n == size){
+                size *= 2;
+                d = realloc(d, size*sizeof(map_detection));
+            }
+            float w = truth->w[i];
+            float h = truth->h[i];
+            map_detection r = {i, j, score, {((xmin + xmax)/2 - 1)/w, ((ymin + ymax)/2 - 1)/h, (xmax - xmin)/w, (ymax - ymin)/h}};
+            d[n++] = r;
+        }
+        fclose(fp);
+    }
+    if(unknown) fprintf(stderr, "Skipped %d detections of images missing from the list\n", unknown);
+    for(i = 0; i < truth->m; ++i) free(ids[i].id);
+    free(ids);
+    *out = d;
+    return n;
+}
+
+// first box of class at or after lo, the boxes of an image being sorted by class
+static int first_of_class(label_box *b, int lo, int hi, int class)
+{
+    while(lo < hi){
+        int mid = (lo + hi)/2;
+        if(b[mid].id < class) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * VOC matching at every iou threshold, images in parallel. Detections sorted by
+ * class and score take the truth of their class they overlap most, and are a
+ * true positive when the overlap is above the threshold and no higher scored
+ * detection took that truth already. Sets tp[u*n + i] for detection i.
+ */
+static void match_map_detections(map_detection *d, int n, label_index *truth, float *ious, int nious, unsigned char *tp)
+{
+    int i, m = truth->m;
+    int *first = calloc(m + 1, sizeof(int));
+    int *next = calloc(m, sizeof(int));
+    int *order = calloc(n + 1, sizeof(int));
+    for(i = 0; i < n; ++i) ++first[d[i].image + 1];
+    for(i = 0; i < m; ++i) first[i+1] += first[i];
+    memcpy(next, first, m*sizeof(int));
+    // stable, so each image keeps its detections in class and score order
+    for(i = 0; i < n; ++i) order[next[d[i].image]++] = i;
+
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < m; ++i){
+        int j, k, u;
+        int lo = truth->first[i];
+        int hi = truth->first[i+1];
+        unsigned char *taken = calloc(hi - lo + 1, 1);
+        for(u = 0; u < nious; ++u){
+            memset(taken, 0, hi - lo + 1);
+            for(j = first[i]; j < first[i+1]; ++j){
+                map_detection *det = d + order[j];
+                int best = -1;
+                float best_iou = 0;
+                for(k = first_of_class(truth->boxes, lo, hi, det->class); k < hi && truth->boxes[k].id == det->class; ++k){
+                    label_box l = truth->boxes[k];
+                    box b = {l.x, l.y, l.w, l.h};
+                    float iou = box_iou(det->bbox, b);
+                    if(iou > best_iou){
+                        best_iou = iou;
+                        best = k;
+                    }
+                }
+                if(best >= 0 && best_iou > ious[u] && !taken[best - lo]){
+                    taken[best - lo] = 1;
+                    tp[u*n + order[j]] = 1;
+                }
+            }
+        }
+        free(taken);
+    }
+    free(first);
+    free(next);
+    free(order);
+}
+
+// all point interpolated average precision of one class, its detections sorted by score
+static float average_precision(unsigned char *tp, int n, int npos)
+{
+    int i, hits = 0;
+    if(!npos || !n) return 0;
+    float *precision = calloc(n, sizeof(float));
+    float *recall = calloc(n, sizeof(float));
+    for(i = 0; i < n; ++i){
+        hits += tp[i];
+        recall[i] = (float)hits/npos;
+        precision[i] = (float)hits/(i+1);
+    }
+    for(i = n-2; i >= 0; --i){
+        if(precision[i+1] > precision[i]) precision[i] = precision[i+1];
+    }
+    float ap = 0;
+    float last = 0;
+    for(i = 0; i < n; ++i){
+        ap += (recall[i] - last)*precision[i];
+        last = recall[i];
+    }
+    free(precision);
+    free(recall);
+    return ap;
+}
+
+/*
+ * Per class AP and mAP at each iou threshold of the valid list. Detections come
+ * from one inference pass with the thresholds validate_detector uses, or with
+ * from_results from the files a valid mode already wrote under the results
+ * prefix of the data cfg, outfile being the name it was given there.
+ */
+void evaluate_detector_map(char *datacfg, char *cfgfile, char *weightfile, char *iou_values, int from_results, char *outfile, int close_quantization, int threads)
+{
+    list *options = read_data_cfg(datacfg);
+    char *valid_images = option_find_str(options, "valid", "data/train.list");
+    char *name_list = option_find_str(options, "names", 0);
+    char *prefix = option_find_str(options, "results", "results");
+    int classes = option_find_int(options, "classes", 20);
+    list *plist = get_paths(valid_images);
+    char **paths = (char **)list_to_array(plist);
+    int m = plist->size;
+    int nious, n, i, j, u;
+    float *ious = read_floatlist(iou_values, &nious, .5);
+
+    list *nlist = name_list ? get_paths(name_list) : make_list();
+    char **names = (char **)list_to_array(nlist);
+    if(from_results && nlist->size < classes) error("map: every class needs a name to find its results file");
+
+    label_index *truth = load_label_index(valid_images, paths, m);
+    map_detection *d = 0;
+    if(from_results){
+        n = read_map_detections(prefix, outfile ? outfile : "", names, classes, paths, truth, &d);
+    } else {
+        double start = what_time_is_it_now();
+        eval_detections *dets = predict_eval_detections(cfgfile, weightfile, close_quantization, paths, m, .005, .5, threads);
+        fprintf(stderr, "Predicted %d images in %lf seconds\n", m, what_time_is_it_now() - start);
+        if(m) classes = dets[0].classes;
+        n = predicted_map_detections(dets, m, classes, .45, &d);
+        free_eval_detections(dets, m);
+    }
+
+    double start = what_time_is_it_now();
+    qsort(d, n, sizeof(map_detection), map_detection_comparator);
+    unsigned char *tp = calloc((size_t)nious*n + 1, 1);
+    match_map_detections(d, n, truth, ious, nious, tp);
+
+    int *npos = calloc(classes, sizeof(int));
+    for(i = 0; i < truth->first[m]; ++i){
+        int id = truth->boxes[i].id;
+        if(id >= 0 && id < classes) ++npos[id];
+    }
+    float *ap = calloc(classes*nious, sizeof(float));
+    int end = 0;
+    for(j = 0; j < classes; ++j){
+        int begin = end;
+        while(end < n && d[end].class == j) ++end;
+        for(u = 0; u < nious; ++u) ap[j*nious + u] = average_precision(tp + (size_t)u*n + begin, end - begin, npos[j]);
+    }
+    fprintf(stderr, "Matched %d detections to %d truths in %lf seconds\n", n, truth->first[m], what_time_is_it_now() - start);
+
+    // classes without truth have no AP and stay out of the mean
+    int counted = 0;
+    float *map = calloc(nious, sizeof(float));
+    printf("%-20s %8s", "class", "truths");
+    for(u = 0; u < nious; ++u) printf("   AP@%.2f", ious[u]);
+    printf("\n");
+    for(j = 0; j < classes; ++j){
+        char buff[32];
+        sprintf(buff, "%d", j);
+        printf("%-20s %8d", j < nlist->size ? names[j] : buff, npos[j]);
+        for(u = 0; u < nious; ++u){
+            if(npos[j]) printf("   %6.2f%%", 100*ap[j*nious + u]);
+            else printf("   %7s", "-");
+            if(npos[j]) map[u] += ap[j*nious + u];
+        }
+        printf("\n");
+        if(npos[j]) ++counted;
+    }
+    float mean = 0;
+    printf("%-20s %8d", "mAP", truth->first[m]);
+    for(u = 0; u < nious; ++u){
+        map[u] = counted ? map[u]/counted : 0;
+        mean += map[u]/nious;
+        printf("   %6.2f%%", 100*map[u]);
+    }
+    printf("\n");
+    if(nious > 1) printf("mAP averaged over %d iou thresholds: %.2f%%\n", nious, 100*mean);
+
+    free(map);
+    free(ap);
+    free(npos);
+    free(tp);
+    free(d);
+    free_label_index(truth);
+    free(ious);
+    free_ptrs((void **)names, nlist->size);
+    free_list(nlist);
+    free_ptrs((void **)paths, m);
+    free_list(plist);
+    free_list(options);
+}
@@ -0,0 +1,48 @@
+#ifndef EVALUATE_H
+#define EVALUATE_H
+#include "darknet.h"
+
+// a class of a candidate box whose probability passed the threshold
+typedef struct{
+    int class;
+    float prob;
+} eval_class_prob;
+
+// one raw box kept for evaluation, before nms, with every class above the threshold
+typedef struct{
+    box bbox;
+    float objectness;
+    int nprobs;
+    eval_class_prob *probs;
+} eval_candidate;
+
+// classes is the network's, the candidates' probs all live in probs
+typedef struct{
+    int n;
+    int classes;
+    eval_candidate *c;
+    eval_class_prob *probs;
+} eval_detections;
+
+eval_detections *predict_eval_detections(char *cfgfile, char *weightfile, int close_quantization, char **paths, int m, float thresh, float hier, int threads);
+void free_eval_detections(eval_detections *d, int m);
+int eval_nms(eval_candidate *c, int n, float nms);
+
+typedef struct{
+    int id;
+    float x, y, w, h;
+} label_box;
+
+// ground truth of a list: boxes of image i are first[i]..first[i+1]-1, sorted by class
+typedef struct{
+    int m;
+    int *w;
+    int *h;
+    int *first;
+    label_box *boxes;
+} label_index;
+
+label_index *load_label_index(char *listfile, char **paths, int m);
+void free_label_index(label_index *idx);
+
+#endif
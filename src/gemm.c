@@ -298,6 +298,197 @@ void gemm_nn_uint8_int32_te(int M, int N, int K, float ALPHA,
     }
 }
 
+// integer-only uint8 gemm, C is overwritten one panel of tile columns at a time
+// so the C row chunk and the B panel stay in cache
+void gemm_nn_uint8_int32_tiled(int M, int N, int K,
+        uint8_t *A, int lda,
+        uint8_t *B, int ldb,
+        int32_t *C, int ldc, int tile, int split)
+{
+    int t;
+    int tiles = (N + tile - 1)/tile;
+    // split hands whole column tiles to the threads instead of rows of C
+    #pragma omp parallel for if(split)
+    for(t = 0; t < tiles; ++t){
+        int jj = t*tile;
+        int width = min(tile, N - jj);
+        int i;
+        #pragma omp parallel for if(!split)
+        for(i = 0; i < M; ++i){
+            int j, k;
+            int32_t *c = C + i*ldc + jj;
+            for(j = 0; j < width; ++j) c[j] = 0;
+            for(k = 0; k < K; ++k){
+                int32_t a = A[i*lda + k];
+                uint8_t *b = B + k*ldb + jj;
+                for(j = 0; j < width; ++j) c[j] += a*b[j];
+            }
+        }
+    }
+}
+
+// int16 x int16 -> int32, C is overwritten
+void gemm_nn_int16_int32(int M, int N, int K,
+        int16_t *A, int lda,
+        int16_t *B, int ldb,
+        int32_t *C, int ldc)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < M; ++i){
+        int j, k;
+        int32_t *c = C + i*ldc;
+        for(j = 0; j < N; ++j) c[j] = 0;
+        for(k = 0; k < K; ++k){
+            int32_t a = A[i*lda + k];
+            int16_t *b = B + k*ldb;
+            for(j = 0; j < N; ++j) c[j] += a*b[j];
+        }
+    }
+}
+
+// A holds two 4-bit weights per byte (low nibble first), each row padded to lda bytes.
+// Nibbles are unpacked in registers, C is overwritten.
+void gemm_nn_uint4_uint8_int32(int M, int N, int K,
+        uint8_t *A, int lda,
+        uint8_t *B, int ldb,
+        int32_t *C, int ldc)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < M; ++i){
+        int j, k;
+        int32_t *c = C + i*ldc;
+        for(j = 0; j < N; ++j) c[j] = 0;
+        for(k = 0; k < K; k += 2){
+            uint8_t packed = A[i*lda + k/2];
+            int32_t a0 = packed & 0x0F;
+            int32_t a1 = (k + 1 < K) ? (packed >> 4) : 0;
+            uint8_t *b0 = B + k*ldb;
+            uint8_t *b1 = (k + 1 < K) ? b0 + ldb : b0;
+            j = 0;
+#ifdef AVX
+            // interleave rows k and k+1 so one madd gives a0*b0[j] + a1*b1[j]
+            __m256i pair = _mm256_set1_epi32((a1 << 16) | a0);
+            for(; j + 8 <= N; j += 8){
+                __m128i lo = _mm_loadl_epi64((__m128i*)(b0 + j));
+                __m128i hi = _mm_loadl_epi64((__m128i*)(b1 + j));
+                __m256i b = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(lo, hi));
+                __m256i acc = _mm256_loadu_si256((__m256i*)(c + j));
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(b, pair));
+                _mm256_storeu_si256((__m256i*)(c + j), acc);
+            }
+#endif
+            for(; j < N; ++j){
+                c[j] += a0*b0[j] + a1*b1[j];
+            }
+        }
+    }
+}
+
+#ifdef AVX
+#define popcount_u64(x) _mm_popcnt_u64(x)
+#else
+#define popcount_u64(x) __builtin_popcountll(x)
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define XNOR_X86
+#endif
+
+typedef void (*xnor_row_kernel)(uint64_t *a, uint64_t *B, uint64_t *mask, int *valid, int ldw, int N, float scale, float *c);
+
+static void xnor_row_c(uint64_t *a, uint64_t *B, uint64_t *mask, int *valid, int ldw, int N, float scale, float *c)
+{
+    int j, w;
+    for(j = 0; j < N; ++j){
+        uint64_t *b = B + j*ldw;
+        uint64_t *m = mask + j*ldw;
+        int count = 0;
+        for(w = 0; w < ldw; ++w){
+            count += popcount_u64(~(a[w] ^ b[w]) & m[w]);
+        }
+        c[j] += scale*(2*count - valid[j]);
+    }
+}
+
+#ifdef XNOR_X86
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void xnor_row_avx512(uint64_t *a, uint64_t *B, uint64_t *mask, int *valid, int ldw, int N, float scale, float *c)
+{
+    int j, w;
+    for(j = 0; j < N; ++j){
+        uint64_t *b = B + j*ldw;
+        uint64_t *m = mask + j*ldw;
+        __m512i acc = _mm512_setzero_si512();
+        for(w = 0; w + 8 <= ldw; w += 8){
+            __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + w), _mm512_loadu_si512(b + w));
+            x = _mm512_andnot_si512(x, _mm512_loadu_si512(m + w));
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        }
+        // the tail as one masked load rather than a scalar loop
+        if(w < ldw){
+            __mmask8 tail = (1 << (ldw - w)) - 1;
+            __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(tail, a + w), _mm512_maskz_loadu_epi64(tail, b + w));
+            x = _mm512_andnot_si512(x, _mm512_maskz_loadu_epi64(tail, m + w));
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        }
+        int count = _mm512_reduce_add_epi64(acc);
+        c[j] += scale*(2*count - valid[j]);
+    }
+}
+#endif
+
+static xnor_row_kernel select_xnor_row_kernel()
+{
+    static xnor_row_kernel kernel = 0;
+    if(kernel) return kernel;
+    xnor_row_kernel k = xnor_row_c;
+#ifdef XNOR_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) k = xnor_row_avx512;
+#endif
+    kernel = k;
+    return kernel;
+}
+
+// A: M rows of K sign bits, B: N columns of K sign bits, both ldw words per row.
+// C += scales[i] * (matches - mismatches) over the taps set in mask.
+void gemm_nt_xnor(int M, int N, int K,
+        uint64_t *A, uint64_t *B, uint64_t *mask, int *valid, int ldw,
+        float *scales, float *C, int ldc)
+{
+    int i;
+    xnor_row_kernel kernel = select_xnor_row_kernel();
+    #pragma omp parallel for
+    for(i = 0; i < M; ++i){
+        kernel(A + i*ldw, B, mask, valid, ldw, N, scales[i], C + i*ldc);
+    }
+}
+
+// binary weights against float inputs: every tap is an add or a subtract
+void gemm_nn_bit(int M, int N, int K,
+        uint64_t *A, int ldw,
+        float *B, int ldb,
+        float *scales, float *C, int ldc)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < M; ++i){
+        int j, k;
+        float *c = C + i*ldc;
+        for(k = 0; k < K; ++k){
+            float *b = B + k*ldb;
+            if((A[i*ldw + k/64] >> (k%64)) & 1){
+                for(j = 0; j < N; ++j) c[j] += scales[i]*b[j];
+            }else{
+                for(j = 0; j < N; ++j) c[j] -= scales[i]*b[j];
+            }
+        }
+    }
+}
+
 void gemm_nn_int8_int32(int M, int N, int K, int8_t ALPHA,
     int8_t *A, int lda,
     int8_t *B, int ldb,
@@ -471,6 +662,18 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
             C[i*ldc + j] *= BETA;
         }
     }
+    if(use_blocked_gemm(M, N, K))
+        gemm_cpu_blocked(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+    else
+        gemm_cpu_reference(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+}
+
+// the plain loops, C += ALPHA*op(A)*op(B)
+void gemm_cpu_reference(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float *C, int ldc)
+{
     if(!TA && !TB)
         gemm_nn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
     else if(TA && !TB)
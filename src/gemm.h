@@ -17,6 +17,30 @@ void gemm_nn_uint8_int32_te(int M, int N, int K, float ALPHA,
         uint8_t *B, int ldb,
         int BETA, int32_t *C, int ldc);
 
+void gemm_nn_uint8_int32_tiled(int M, int N, int K,
+        uint8_t *A, int lda,
+        uint8_t *B, int ldb,
+        int32_t *C, int ldc, int tile, int split);
+
+void gemm_nn_uint4_uint8_int32(int M, int N, int K,
+        uint8_t *A, int lda,
+        uint8_t *B, int ldb,
+        int32_t *C, int ldc);
+
+void gemm_nn_int16_int32(int M, int N, int K,
+        int16_t *A, int lda,
+        int16_t *B, int ldb,
+        int32_t *C, int ldc);
+
+void gemm_nt_xnor(int M, int N, int K,
+        uint64_t *A, uint64_t *B, uint64_t *mask, int *valid, int ldw,
+        float *scales, float *C, int ldc);
+
+void gemm_nn_bit(int M, int N, int K,
+        uint64_t *A, int ldw,
+        float *B, int ldb,
+        float *scales, float *C, int ldc);
+
 void gemm_nn_uint8_uint32(int M, int N, int K, float ALPHA, 
         uint8_t *A, int lda, 
         uint8_t *B, int ldb,
@@ -49,6 +73,19 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+void gemm_cpu_reference(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float *C, int ldc);
+
+void gemm_cpu_blocked(int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float *C, int ldc);
+
+int use_blocked_gemm(int M, int N, int K);
+int test_cpu_gemm();
+
 #ifdef GPU
 void gemm_gpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A_gpu, int lda, 
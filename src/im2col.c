@@ -74,6 +74,47 @@ void im2col_cpu_int16(int16_t* data_im,
     }
 }
 
+/*
+ * Sign-binarize and pack one column per output pixel, 64 taps per word, in the
+ * same tap order as im2col_cpu. Padded taps are cleared in mask so the xnor gemm
+ * can skip them; valid holds the number of real taps per column.
+ */
+void im2col_cpu_bit(float* data_im,
+    int channels, int height, int width,
+    int ksize, int stride, int pad, uint64_t* data_col, uint64_t* mask, int* valid)
+{
+    int j;
+    int height_col = (height + 2 * pad - ksize) / stride + 1;
+    int width_col = (width + 2 * pad - ksize) / stride + 1;
+    int channels_col = channels * ksize * ksize;
+    int ldw = (channels_col + 63) / 64;
+
+    #pragma omp parallel for
+    for (j = 0; j < height_col * width_col; ++j) {
+        int c, h = j / width_col, w = j % width_col;
+        int count = 0;
+        uint64_t *bits = data_col + j * ldw;
+        uint64_t *bits_mask = mask + j * ldw;
+        for (c = 0; c < ldw; ++c) {
+            bits[c] = 0;
+            bits_mask[c] = 0;
+        }
+        for (c = 0; c < channels_col; ++c) {
+            int w_offset = c % ksize;
+            int h_offset = (c / ksize) % ksize;
+            int c_im = c / ksize / ksize;
+            int im_row = h_offset + h * stride - pad;
+            int im_col = w_offset + w * stride - pad;
+            if (im_row < 0 || im_col < 0 || im_row >= height || im_col >= width) continue;
+            uint64_t bit = 1ULL << (c % 64);
+            bits_mask[c / 64] |= bit;
+            if (data_im[im_col + width * (im_row + height * c_im)] > 0) bits[c / 64] |= bit;
+            ++count;
+        }
+        valid[j] = count;
+    }
+}
+
 float im2col_get_pixel(float *im, int height, int width, int channels,
                         int row, int col, int channel, int pad)
 {
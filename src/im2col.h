@@ -13,6 +13,10 @@ void im2col_cpu_int16(int16_t* data_im,
     int channels, int height, int width,
     int ksize, int stride, int pad, int16_t* data_col, int16_t pad_value);
 
+void im2col_cpu_bit(float* data_im,
+    int channels, int height, int width,
+    int ksize, int stride, int pad, uint64_t* data_col, uint64_t* mask, int* valid);
+
 float im2col_get_pixel(float *im, int height, int width, int channels,
                         int row, int col, int channel, int pad);
 
@@ -1,6 +1,7 @@
 #include "image.h"
 #include "utils.h"
 #include "blas.h"
+#include "augment.h"
 #include "cuda.h"
 #include <stdio.h>
 #include <math.h>
@@ -1166,17 +1167,8 @@ void exposure_image(image im, float sat)
 
 void distort_image(image im, float hue, float sat, float val)
 {
-    rgb_to_hsv(im);
-    scale_image_channel(im, 1, sat);
-    scale_image_channel(im, 2, val);
-    int i;
-    for(i = 0; i < im.w*im.h; ++i){
-        im.data[i] = im.data[i] + hue;
-        if (im.data[i] > 1) im.data[i] -= 1;
-        if (im.data[i] < 0) im.data[i] += 1;
-    }
-    hsv_to_rgb(im);
-    constrain_image(im);
+    assert(im.c == 3);
+    distort_image_rgb(im, hue, sat, val);
 }
 
 void random_distort_image(image im, float hue, float saturation, float exposure)
@@ -1314,6 +1306,13 @@ image load_image_stb(char *filename, int channels)
     return im;
 }
 
+// reads only the header, returns 0 when the file is not an image stb can decode
+int image_size(char *filename, int *w, int *h)
+{
+    int c;
+    return stbi_info(filename, w, h, &c);
+}
+
 image load_image(char *filename, int w, int h, int c)
 {
 #ifdef OPENCV
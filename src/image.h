@@ -41,6 +41,9 @@ void distort_image(image im, float hue, float sat, float val);
 void saturate_exposure_image(image im, float sat, float exposure);
 void rgb_to_hsv(image im);
 void hsv_to_rgb(image im);
+float three_way_max(float a, float b, float c);
+float three_way_min(float a, float b, float c);
+int image_size(char *filename, int *w, int *h);
 void yuv_to_rgb(image im);
 void rgb_to_yuv(image im);
 
@@ -12,11 +12,19 @@ void free_layer(layer l)
 #endif
         return;
     }
+    if(l.type == SHORTCUT){
+        // parse_network_cfg points these at the layer before, which frees them
+        l.output = l.delta = 0;
+#ifdef GPU
+        l.output_gpu = l.delta_gpu = 0;
+#endif
+    }
     if(l.cweights)           free(l.cweights);
     if(l.indexes)            free(l.indexes);
     if(l.input_layers)       free(l.input_layers);
     if(l.input_sizes)        free(l.input_sizes);
     if(l.map)                free(l.map);
+    if(l.mask)               free(l.mask);
     if(l.rand)               free(l.rand);
     if(l.cost)               free(l.cost);
     if(l.state)              free(l.state);
@@ -52,6 +60,48 @@ void free_layer(layer l)
     if(l.r_cpu)              free(l.r_cpu);
     if(l.h_cpu)              free(l.h_cpu);
     if(l.binary_input)       free(l.binary_input);
+    if(l.weights_int4)       free(l.weights_int4);
+    if(l.weights_winograd)   free(l.weights_winograd);
+    if(l.weights_bit)        free(l.weights_bit);
+    if(l.weights_bit_scales) free(l.weights_bit_scales);
+    if(l.input_bit)          free(l.input_bit);
+    if(l.input_bit_mask)     free(l.input_bit_mask);
+    if(l.input_bit_valid)    free(l.input_bit_valid);
+
+    if(l.input_data_uint8_scales)      free(l.input_data_uint8_scales);
+    if(l.activ_data_uint8_scales)      free(l.activ_data_uint8_scales);
+    if(l.weight_data_uint8_scales)     free(l.weight_data_uint8_scales);
+    if(l.output_data_uint8_scales)     free(l.output_data_uint8_scales);
+    if(l.biases_data_uint8_scales)     free(l.biases_data_uint8_scales);
+    if(l.input_data_uint8_zero_point)  free(l.input_data_uint8_zero_point);
+    if(l.activ_data_uint8_zero_point)  free(l.activ_data_uint8_zero_point);
+    if(l.weight_data_uint8_zero_point) free(l.weight_data_uint8_zero_point);
+    if(l.biases_data_uint8_zero_point) free(l.biases_data_uint8_zero_point);
+    if(l.min_activ_value)              free(l.min_activ_value);
+    if(l.max_activ_value)              free(l.max_activ_value);
+    if(l.min_input_value)              free(l.min_input_value);
+    if(l.max_input_value)              free(l.max_input_value);
+    if(l.input_sum_int)                free(l.input_sum_int);
+    if(l.weights_sum_int)              free(l.weights_sum_int);
+    if(l.mult_zero_point)              free(l.mult_zero_point);
+    if(l.M)                            free(l.M);
+    if(l.M0)                           free(l.M0);
+    if(l.M_value)                      free(l.M_value);
+    if(l.M0_right_shift)               free(l.M0_right_shift);
+    if(l.M0_right_shift_value)         free(l.M0_right_shift_value);
+    if(l.input_uint8)                  free(l.input_uint8);
+    if(l.weights_uint8)                free(l.weights_uint8);
+    if(l.weights_norm)                 free(l.weights_norm);
+    if(l.biases_int32)                 free(l.biases_int32);
+    if(l.output_int32)                 free(l.output_int32);
+    if(l.output_uint8_final)           free(l.output_uint8_final);
+    if(l.weights_int16)                free(l.weights_int16);
+    if(l.input_int16)                  free(l.input_int16);
+    if(l.zero_point_int16)             free(l.zero_point_int16);
+    if(l.zero_point_uint8)             free(l.zero_point_uint8);
+    if(l.weights_bn_backup)            free(l.weights_bn_backup);
+    if(l.biases_bn_backup)             free(l.biases_bn_backup);
+    if(l.output_bn_backup)             free(l.output_bn_backup);
 
 #ifdef GPU
     if(l.indexes_gpu)           cuda_free((float *)l.indexes_gpu);
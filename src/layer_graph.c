@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "layer_graph.h"
+#include "blas.h"
+#include "utils.h"
+
+/*
+ * Inference forward pass as a dependency graph. forward_network hands layer i
+ * the float output of layer i-1 and the uint8 output of the last quantized
+ * layer before it; routes and shortcuts also read the layers they name. Routes
+ * are the only layers that ignore net.input and net.input_uint8, which is what
+ * separates the yolo heads into independent branches. Ready layers run on a pool of threads.
+ */
+typedef struct layer_graph{
+    int n;
+    int threads;
+    int *input;
+    int *input_uint8;
+    int **next;
+    int *nnext;
+
+    network *net;
+    int *pending;
+    int *ready;
+    int nready;
+    int remaining;
+    int stop;
+    float **workspaces;
+    size_t workspace_size;
+    pthread_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} layer_graph;
+
+typedef struct{
+    layer_graph *g;
+    int index;
+} graph_worker_args;
+
+static void add_graph_edge(layer_graph *g, int from, int to)
+{
+    int i;
+    if(from < 0 || from >= to) return;
+    for(i = 0; i < g->nnext[from]; ++i){
+        if(g->next[from][i] == to) return;
+    }
+    g->next[from] = realloc(g->next[from], (g->nnext[from] + 1)*sizeof(int));
+    g->next[from][g->nnext[from]++] = to;
+}
+
+// the float tensors layer j reads, as layer indices
+static int graph_reads(network *net, int j, int *reads)
+{
+    int i, n = 0;
+    layer l = net->layers[j];
+    if(l.type == ROUTE){
+        for(i = 0; i < l.n; ++i) reads[n++] = l.input_layers[i];
+        return n;
+    }
+    if(j > 0) reads[n++] = j - 1;
+    if(l.type == SHORTCUT) reads[n++] = l.index;
+    return n;
+}
+
+/*
+ * A shortcut adds into the previous layer's output buffer (see parse_network_cfg),
+ * so buffers are tracked by the layer that allocated them: reads wait for the last
+ * writer of the buffer and an in-place write waits for every earlier reader.
+ */
+static void build_graph_edges(layer_graph *g, network *net)
+{
+    int i, j, k, m;
+    int max_reads = 2;
+    for(j = 0; j < net->n; ++j){
+        if(net->layers[j].type == ROUTE && net->layers[j].n > max_reads) max_reads = net->layers[j].n;
+    }
+    int *owner = calloc(net->n, sizeof(int));
+    int *writer = calloc(net->n, sizeof(int));
+    int *nreads = calloc(net->n, sizeof(int));
+    int **reads = calloc(net->n, sizeof(int *));
+    int last_quant = -1;
+    for(j = 0; j < net->n; ++j){
+        layer l = net->layers[j];
+        reads[j] = calloc(max_reads, sizeof(int));
+        nreads[j] = graph_reads(net, j, reads[j]);
+        for(i = 0; i < nreads[j]; ++i){
+            m = reads[j][i];
+            add_graph_edge(g, m, j);
+            add_graph_edge(g, writer[owner[m]], j);
+        }
+        // a route reads the uint8 outputs of the layers it names, not the last quantized one
+        if(l.type != ROUTE) add_graph_edge(g, last_quant, j);
+        g->input[j] = j - 1;
+        g->input_uint8[j] = last_quant;
+        if(l.type == SHORTCUT && j > 0){
+            int root = owner[j-1];
+            for(k = writer[root] + 1; k < j; ++k){
+                for(i = 0; i < nreads[k]; ++i){
+                    if(owner[reads[k][i]] == root) add_graph_edge(g, k, j);
+                }
+            }
+            owner[j] = root;
+            writer[root] = j;
+        }else{
+            owner[j] = j;
+            writer[j] = j;
+        }
+        if(l.layer_quant_flag) last_quant = j;
+    }
+    for(j = 0; j < net->n; ++j) free(reads[j]);
+    free(reads);
+    free(nreads);
+    free(writer);
+    free(owner);
+}
+
+static void run_graph_layer(layer_graph *g, int j, float *workspace)
+{
+    network net = *g->net;
+    layer l = net.layers[j];
+    net.index = j;
+    if(g->input[j] >= 0) net.input = net.layers[g->input[j]].output;
+    if(g->input_uint8[j] >= 0) net.input_uint8 = net.layers[g->input_uint8[j]].output_uint8_final;
+    if(workspace) net.workspace = workspace;
+    if(l.delta){
+        fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
+    }
+    l.forward(l, net);
+}
+
+// called with the mutex held, returns with it held
+static void run_next_graph_layer(layer_graph *g, float *workspace)
+{
+    int i;
+    int j = g->ready[--g->nready];
+    pthread_mutex_unlock(&g->mutex);
+    run_graph_layer(g, j, workspace);
+    pthread_mutex_lock(&g->mutex);
+    for(i = 0; i < g->nnext[j]; ++i){
+        int s = g->next[j][i];
+        if(--g->pending[s] == 0) g->ready[g->nready++] = s;
+    }
+    --g->remaining;
+    pthread_cond_broadcast(&g->changed);
+}
+
+static void *graph_worker(void *ptr)
+{
+    graph_worker_args args = *(graph_worker_args *)ptr;
+    layer_graph *g = args.g;
+    free(ptr);
+    pthread_mutex_lock(&g->mutex);
+    while(!g->stop){
+        if(g->nready){
+            run_next_graph_layer(g, g->workspaces[args.index]);
+        }else{
+            pthread_cond_wait(&g->changed, &g->mutex);
+        }
+    }
+    pthread_mutex_unlock(&g->mutex);
+    return 0;
+}
+
+layer_graph *make_layer_graph(network *net, int threads)
+{
+    int i;
+    layer_graph *g = calloc(1, sizeof(layer_graph));
+    g->n = net->n;
+    g->threads = threads;
+    g->net = net;
+    g->input = calloc(net->n, sizeof(int));
+    g->input_uint8 = calloc(net->n, sizeof(int));
+    g->next = calloc(net->n, sizeof(int *));
+    g->nnext = calloc(net->n, sizeof(int));
+    g->pending = calloc(net->n, sizeof(int));
+    g->ready = calloc(net->n, sizeof(int));
+    build_graph_edges(g, net);
+
+    g->workspaces = calloc(threads, sizeof(float *));
+    g->workers = calloc(threads, sizeof(pthread_t));
+    pthread_mutex_init(&g->mutex, 0);
+    pthread_cond_init(&g->changed, 0);
+    // the calling thread is worker 0 and uses net->workspace
+    for(i = 1; i < threads; ++i){
+        graph_worker_args *args = calloc(1, sizeof(graph_worker_args));
+        args->g = g;
+        args->index = i;
+        if(pthread_create(&g->workers[i], 0, graph_worker, args)) error("Thread creation failed");
+    }
+    return g;
+}
+
+void free_layer_graph(layer_graph *g)
+{
+    int i;
+    if(!g) return;
+    pthread_mutex_lock(&g->mutex);
+    g->stop = 1;
+    pthread_cond_broadcast(&g->changed);
+    pthread_mutex_unlock(&g->mutex);
+    for(i = 1; i < g->threads; ++i) pthread_join(g->workers[i], 0);
+    for(i = 0; i < g->threads; ++i) free(g->workspaces[i]);
+    for(i = 0; i < g->n; ++i) free(g->next[i]);
+    pthread_mutex_destroy(&g->mutex);
+    pthread_cond_destroy(&g->changed);
+    free(g->workspaces);
+    free(g->workers);
+    free(g->next);
+    free(g->nnext);
+    free(g->pending);
+    free(g->ready);
+    free(g->input);
+    free(g->input_uint8);
+    free(g);
+}
+
+// float convs share net->workspace, every worker gets one sized for the current resolution
+static void size_graph_workspaces(layer_graph *g, network *net, int start)
+{
+    int i;
+    size_t size = 0;
+    for(i = start; i < net->n; ++i){
+        if(net->layers[i].workspace_size > size) size = net->layers[i].workspace_size;
+    }
+    if(size <= g->workspace_size) return;
+    for(i = 1; i < g->threads; ++i){
+        free(g->workspaces[i]);
+        g->workspaces[i] = calloc(1, size);
+    }
+    g->workspace_size = size;
+}
+
+/*
+ * Run layers [start, n) of an inference pass, earlier ones are done already
+ * (depth-first). Returns once every layer has finished.
+ */
+void forward_network_graph(network *net, int start)
+{
+    int i, j;
+    if(!net->graph) net->graph = make_layer_graph(net, net->graph_threads);
+    layer_graph *g = net->graph;
+    pthread_mutex_lock(&g->mutex);
+    size_graph_workspaces(g, net, start);
+    for(j = start; j < g->n; ++j) g->pending[j] = 0;
+    for(j = start; j < g->n; ++j){
+        for(i = 0; i < g->nnext[j]; ++i) ++g->pending[g->next[j][i]];
+    }
+    g->nready = 0;
+    for(j = g->n - 1; j >= start; --j){
+        if(g->pending[j] == 0) g->ready[g->nready++] = j;
+    }
+    g->remaining = g->n - start;
+    pthread_cond_broadcast(&g->changed);
+    while(g->remaining){
+        if(g->nready){
+            run_next_graph_layer(g, 0);
+        }else{
+            pthread_cond_wait(&g->changed, &g->mutex);
+        }
+    }
+    pthread_mutex_unlock(&g->mutex);
+}
@@ -0,0 +1,9 @@
+#ifndef LAYER_GRAPH_H
+#define LAYER_GRAPH_H
+#include "darknet.h"
+
+struct layer_graph *make_layer_graph(network *net, int threads);
+void free_layer_graph(struct layer_graph *g);
+void forward_network_graph(network *net, int start);
+
+#endif
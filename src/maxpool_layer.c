@@ -1,5 +1,6 @@
 #include "maxpool_layer.h"
 #include "cuda.h"
+#include "quant_kernels.h"
 #include <stdio.h>
 
 image get_maxpool_image(maxpool_layer l)
@@ -54,7 +55,7 @@ maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int s
     l.input_uint8 = calloc(output_size, sizeof(uint8_t));
     // printf("layer %d, close %d, quant %d\n", l.count, l.close_quantization, l.layer_quant_flag);
     if(l.layer_quant_flag && !l.close_quantization){
-        l.forward = forward_maxpool_layer_quant;
+        l.forward = select_maxpool_quant_kernel(l);
         // l.forward = forward_maxpool_layer;
     }
     // else if(l.layer_quant_flag && l.close_quantization && l.count  < 6){
@@ -63,6 +64,7 @@ maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int s
     else{
         l.forward = forward_maxpool_layer;
     }
+    if(l.layer_quant_flag) l.forward_qat = forward_maxpool_layer_qat;
 #endif
     #ifdef GPU
         // #ifdef QUANTIZATION
@@ -95,6 +97,10 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     l->indexes = realloc(l->indexes, output_size * sizeof(int));
     l->output = realloc(l->output, output_size * sizeof(float));
     l->delta = realloc(l->delta, output_size * sizeof(float));
+#ifdef QUANTIZATION
+    l->output_uint8_final = realloc(l->output_uint8_final, output_size * sizeof(uint8_t));
+    l->input_uint8 = realloc(l->input_uint8, output_size * sizeof(uint8_t));
+#endif
 
     #ifdef GPU
     cuda_free((float *)l->indexes_gpu);
@@ -162,11 +168,8 @@ void forward_maxpool_layer_quant(const maxpool_layer l, network net)
     if(l.quant_stop_flag){
         // printf("dequant from uint8 to float32 in layer %d\n", l.count);
         #pragma omp parallel for
-        for (int s = 0; s < l.out_c; ++s) {
-            for (int t = 0; t < l.out_w*l.out_h; ++t){
-                int out_index = s*l.out_w*l.out_h + t;
-                l.output[out_index] = (l.output_uint8_final[out_index] -  l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
-            }
+        for (int s = 0; s < l.outputs*l.batch; ++s) {
+            l.output[s] = (l.output_uint8_final[s] -  l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
         }
     }
 }
@@ -214,6 +217,12 @@ void forward_maxpool_layer(const maxpool_layer l, network net)
     }
 }
 
+void forward_maxpool_layer_qat(const maxpool_layer l, network net)
+{
+    forward_maxpool_layer(l, net);
+    fake_quant_layer_output(l, net);
+}
+
 void backward_maxpool_layer(const maxpool_layer l, network net)
 {
     int i;
@@ -15,6 +15,7 @@ maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int s
 void resize_maxpool_layer(maxpool_layer *l, int w, int h);
 void forward_maxpool_layer(const maxpool_layer l, network net);
 void forward_maxpool_layer_quant(const maxpool_layer l, network net);
+void forward_maxpool_layer_qat(const maxpool_layer l, network net);
 void backward_maxpool_layer(const maxpool_layer l, network net);
 
 #ifdef GPU
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory_plan.h"
+#include "network.h"
+#include "utils.h"
+
+#define MEMORY_PLAN_ALIGN 64
+
+typedef enum{
+    PLAN_FLOAT, PLAN_UINT8, PLAN_INT32
+} PLAN_KIND;
+
+typedef struct{
+    int layer;
+    PLAN_KIND kind;
+    size_t size;
+    size_t offset;
+    int start;
+    int end;
+} planned_tensor;
+
+static void **plan_pointer(layer *l, PLAN_KIND kind)
+{
+    if(kind == PLAN_FLOAT) return (void **)&l->output;
+    if(kind == PLAN_UINT8) return (void **)&l->output_uint8_final;
+    return (void **)&l->output_int32;
+}
+
+static size_t plan_element_size(PLAN_KIND kind)
+{
+    if(kind == PLAN_FLOAT) return sizeof(float);
+    if(kind == PLAN_UINT8) return sizeof(uint8_t);
+    return sizeof(int32_t);
+}
+
+static int plannable_layer(layer l)
+{
+    return l.type == CONVOLUTIONAL || l.type == MAXPOOL || l.type == ROUTE ||
+           l.type == UPSAMPLE || l.type == SHORTCUT;
+}
+
+// a buffer another layer also points at (dropout, cost...) keeps its own allocation
+static int shared_buffer(network *net, int index, void *p)
+{
+    int i, k;
+    for(i = 0; i < net->n; ++i){
+        if(i == index) continue;
+        for(k = PLAN_FLOAT; k <= PLAN_INT32; ++k){
+            if(*plan_pointer(&net->layers[i], k) == p) return 1;
+        }
+    }
+    return 0;
+}
+
+static int planned_tensor_comparator(const void *pa, const void *pb)
+{
+    size_t a = ((planned_tensor *)pa)->size;
+    size_t b = ((planned_tensor *)pb)->size;
+    if(a > b) return -1;
+    if(a < b) return 1;
+    return 0;
+}
+
+static void use_tensor(int *end, int layer, int kind, int step)
+{
+    if(layer >= 0 && end[layer*3 + kind] < step) end[layer*3 + kind] = step;
+}
+
+/*
+ * Last forward step that reads each layer's float, uint8 and int32 outputs. Layer j
+ * reads layer j-1 through net.input, the last quantized layer through net.input_uint8
+ * (forward_network only moves it past quantized layers), route inputs and the
+ * shortcut source. Detection layers and the network output stay alive to the end.
+ */
+static int *compute_tensor_lifetimes(network *net)
+{
+    int *end = calloc(net->n*3, sizeof(int));
+    int i, j, k;
+    int last_quant = -1;
+    for(j = 0; j < net->n; ++j){
+        for(k = PLAN_FLOAT; k <= PLAN_INT32; ++k) end[j*3 + k] = j;
+    }
+    for(j = 0; j < net->n; ++j){
+        layer l = net->layers[j];
+        if(j > 0){
+            use_tensor(end, j - 1, PLAN_FLOAT, j);
+            use_tensor(end, j - 1, PLAN_UINT8, j);
+        }
+        use_tensor(end, last_quant, PLAN_UINT8, j);
+        if(l.type == ROUTE){
+            for(i = 0; i < l.n; ++i){
+                use_tensor(end, l.input_layers[i], PLAN_FLOAT, j);
+                use_tensor(end, l.input_layers[i], PLAN_UINT8, j);
+            }
+        }
+        if(l.type == SHORTCUT){
+            use_tensor(end, l.index, PLAN_FLOAT, j);
+            use_tensor(end, l.index, PLAN_UINT8, j);
+        }
+        if(l.type == YOLO || l.type == REGION || l.type == DETECTION || j == net->n - 1){
+            for(k = PLAN_FLOAT; k <= PLAN_INT32; ++k) end[j*3 + k] = net->n;
+        }
+        if(l.layer_quant_flag) last_quant = j;
+    }
+    return end;
+}
+
+/*
+ * Place every tensor at the lowest offset that does not collide with an already
+ * placed tensor whose lifetime overlaps, largest tensors first.
+ */
+static size_t assign_offsets(planned_tensor *tensors, int n)
+{
+    int i, j;
+    size_t peak = 0;
+    qsort(tensors, n, sizeof(planned_tensor), planned_tensor_comparator);
+    for(i = 0; i < n; ++i){
+        planned_tensor *t = &tensors[i];
+        size_t offset = 0;
+        int moved = 1;
+        while(moved){
+            moved = 0;
+            for(j = 0; j < i; ++j){
+                planned_tensor *p = &tensors[j];
+                if(p->end < t->start || t->end < p->start) continue;
+                if(offset < p->offset + p->size && p->offset < offset + t->size){
+                    offset = p->offset + p->size;
+                    moved = 1;
+                }
+            }
+        }
+        t->offset = offset;
+        if(offset + t->size > peak) peak = offset + t->size;
+    }
+    return peak;
+}
+
+/*
+ * Inference only: replace the per-layer output, output_uint8_final and output_int32
+ * buffers with slices of one pool, reusing memory between tensors whose lifetimes
+ * do not overlap. Backward buffers and training state are left alone.
+ */
+void plan_network_memory(network *net)
+{
+    int i, k, n = 0;
+    size_t total = 0;
+    if(net->memory_pool) unplan_network_memory(net, 1);
+    int *end = compute_tensor_lifetimes(net);
+    planned_tensor *tensors = calloc(net->n*3, sizeof(planned_tensor));
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        if(!plannable_layer(*l)) continue;
+        for(k = PLAN_FLOAT; k <= PLAN_INT32; ++k){
+            void *p = *plan_pointer(l, k);
+            if(!p || shared_buffer(net, i, p)) continue;
+            if(k == PLAN_INT32 && l->type != CONVOLUTIONAL) continue;
+            planned_tensor *t = &tensors[n++];
+            t->layer = i;
+            t->kind = k;
+            t->size = (l->outputs*l->batch*plan_element_size(k) + MEMORY_PLAN_ALIGN - 1)/MEMORY_PLAN_ALIGN*MEMORY_PLAN_ALIGN;
+            t->start = i;
+            t->end = end[i*3 + k];
+            total += t->size;
+        }
+    }
+    size_t peak = assign_offsets(tensors, n);
+    net->memory_pool = calloc(peak ? peak : 1, sizeof(uint8_t));
+    net->memory_pool_size = peak;
+    for(i = 0; i < n; ++i){
+        void **p = plan_pointer(&net->layers[tensors[i].layer], tensors[i].kind);
+        free(*p);
+        *p = net->memory_pool + tensors[i].offset;
+    }
+    net->output = get_network_output_layer(net).output;
+    fprintf(stderr, "Memory plan: %d buffers, %.2f MB -> %.2f MB pooled\n", n, total/1024./1024., peak/1024./1024.);
+    free(tensors);
+    free(end);
+}
+
+/*
+ * Hand the pooled buffers back. With restore every planned buffer gets its own
+ * allocation again (before resizing), otherwise the pointers are just cleared so
+ * free_layer skips them.
+ */
+void unplan_network_memory(network *net, int restore)
+{
+    int i, k;
+    if(!net->memory_pool) return;
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        for(k = PLAN_FLOAT; k <= PLAN_INT32; ++k){
+            void **p = plan_pointer(l, k);
+            uint8_t *q = *p;
+            if(!q || q < net->memory_pool || q >= net->memory_pool + net->memory_pool_size) continue;
+            *p = restore ? calloc(l->outputs*l->batch, plan_element_size(k)) : 0;
+        }
+    }
+    free(net->memory_pool);
+    net->memory_pool = 0;
+    net->memory_pool_size = 0;
+}
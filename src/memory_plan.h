@@ -0,0 +1,8 @@
+#ifndef MEMORY_PLAN_H
+#define MEMORY_PLAN_H
+#include "darknet.h"
+
+void plan_network_memory(network *net);
+void unplan_network_memory(network *net, int restore);
+
+#endif
@@ -25,6 +25,9 @@
 #include "route_layer.h"
 #include "upsample_layer.h"
 #include "shortcut_layer.h"
+#include "depth_first.h"
+#include "memory_plan.h"
+#include "layer_graph.h"
 #include "parser.h"
 #include "data.h"
 
@@ -235,14 +238,26 @@ void forward_network(network *netp)
     }
 #endif
     network net = *netp;
-    for(int i = 0; i < net.n; ++i){
+    int start = 0;
+    if(net.depth_first && !net.train) start = forward_network_depth_first(&net);
+    // planned buffers assume layers run in order, so branches only run concurrently without a plan
+    if(net.graph_threads > 1 && !net.train && !net.memory_pool){
+        forward_network_graph(netp, start);
+        calc_network_cost(netp);
+        return;
+    }
+    for(int i = start; i < net.n; ++i){
         net.index = i;
         layer l = net.layers[i];
         if(l.delta){
             fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
         // double time=what_time_is_it_now();
-        l.forward(l, net);
+        if(net.train && l.forward_qat){
+            l.forward_qat(l, net);
+        }else{
+            l.forward(l, net);
+        }
         // printf("layer %d cal time: %lf seconds\n", l.count, what_time_is_it_now()-time);
         const char *next_layer_type = (l.type == YOLO ? "FINAL" : type_array[net.layers[i+1].type]);
         if(l.layer_quant_flag && !net.train){
@@ -358,6 +373,7 @@ void backward_network(network *netp)
             net.delta = prev.delta;
         }
         net.index = i;
+        if(l.forward_qat) backward_fake_quant_layer_output(l, net);
         l.backward(l, net);
     }
 }
@@ -373,6 +389,33 @@ float train_network_datum(network *net)
     return error;
 }
 
+// one training step on random input, every quantized single input route must copy its input's float output
+int test_qat_routes(network *net)
+{
+    int i, j;
+    int failed = 0;
+    *net->seen = net->quant_start_step + net->batch;
+    net->train = 1;
+    for(i = 0; i < net->inputs*net->batch; ++i) net->input[i] = rand_uniform(0, 1);
+    forward_network(net);
+    backward_network(net);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type != ROUTE || l.n != 1 || !l.layer_quant_flag) continue;
+        float *in = net->layers[l.input_layers[0]].output;
+        int nonzero = 0;
+        for(j = 0; j < l.outputs*l.batch; ++j){
+            if(l.output[j] != in[j]) break;
+            if(l.output[j]) nonzero = 1;
+        }
+        int ok = (j == l.outputs*l.batch) && nonzero;
+        printf("route %d <- %d: %s\n", i, l.input_layers[0], ok ? "ok" : "FAILED");
+        if(!ok) ++failed;
+    }
+    net->train = 0;
+    return failed;
+}
+
 float train_network_sgd(network *net, data d, int n)
 {
     int batch = net->batch;
@@ -439,6 +482,7 @@ int resize_network(network *net, int w, int h)
 #endif
     int i;
     //if(w == net->w && h == net->h) return 0;
+    unplan_network_memory(net, 1);
     net->w = w;
     net->h = h;
     size_t workspace_size = 0;
@@ -459,6 +503,13 @@ int resize_network(network *net, int w, int h)
         }else if(l.type == ROUTE){
             resize_route_layer(&l, net);
         }else if(l.type == SHORTCUT){
+            // the shortcut works in place on the previous layer's output and delta
+            l.output = net->layers[i-1].output;
+            l.delta = net->layers[i-1].delta;
+#ifdef GPU
+            l.output_gpu = net->layers[i-1].output_gpu;
+            l.delta_gpu = net->layers[i-1].delta_gpu;
+#endif
             resize_shortcut_layer(&l, w, h);
         }else if(l.type == UPSAMPLE){
             resize_upsample_layer(&l, w, h);
@@ -486,6 +537,7 @@ int resize_network(network *net, int w, int h)
     net->output = out.output;
     free(net->input);
     free(net->truth);
+    free(net->input_uint8);
     net->input = calloc(net->inputs*net->batch, sizeof(float));
     net->input_uint8 = calloc(net->inputs*net->batch, sizeof(uint8_t));
     net->truth = calloc(net->truths*net->batch, sizeof(float));
@@ -506,10 +558,180 @@ int resize_network(network *net, int w, int h)
     free(net->workspace);
     net->workspace = calloc(1, workspace_size);
 #endif
+    if(net->memory_plan) plan_network_memory(net);
     //printf(" Done!\n");
     return 0;
 }
 
+// buffers and sizes that change with the input resolution, one per (w,h) seen
+typedef struct resolution_plan{
+    int w, h;
+    layer *layers;
+    int inputs, outputs, truths;
+    float *input;
+    float *truth;
+    float *output;
+    float *workspace;
+    uint8_t *input_uint8;
+    uint8_t *memory_pool;
+    size_t memory_pool_size;
+    struct resolution_plan *next;
+} resolution_plan;
+
+static resolution_plan *find_resolution_plan(network *net, int w, int h)
+{
+    resolution_plan *p;
+    for(p = net->resolution_plans; p; p = p->next){
+        if(p->w == w && p->h == h) return p;
+    }
+    return 0;
+}
+
+static void save_resolution_plan(network *net)
+{
+    resolution_plan *p = find_resolution_plan(net, net->w, net->h);
+    if(!p){
+        p = calloc(1, sizeof(resolution_plan));
+        p->w = net->w;
+        p->h = net->h;
+        p->layers = calloc(net->n, sizeof(layer));
+        p->next = net->resolution_plans;
+        net->resolution_plans = p;
+    }
+    memcpy(p->layers, net->layers, net->n*sizeof(layer));
+    p->inputs = net->inputs;
+    p->outputs = net->outputs;
+    p->truths = net->truths;
+    p->input = net->input;
+    p->truth = net->truth;
+    p->output = net->output;
+    p->workspace = net->workspace;
+    p->input_uint8 = net->input_uint8;
+    p->memory_pool = net->memory_pool;
+    p->memory_pool_size = net->memory_pool_size;
+}
+
+static void load_resolution_plan(network *net, resolution_plan *p)
+{
+    int i, j;
+    memcpy(net->layers, p->layers, net->n*sizeof(layer));
+    // route input_sizes is shared by every plan, resize_route_layer rewrites it in place
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type != ROUTE) continue;
+        for(j = 0; j < l.n; ++j) l.input_sizes[j] = net->layers[l.input_layers[j]].outputs;
+    }
+    net->w = p->w;
+    net->h = p->h;
+    net->inputs = p->inputs;
+    net->outputs = p->outputs;
+    net->truths = p->truths;
+    net->input = p->input;
+    net->truth = p->truth;
+    net->output = p->output;
+    net->workspace = p->workspace;
+    net->input_uint8 = p->input_uint8;
+    net->memory_pool = p->memory_pool;
+    net->memory_pool_size = p->memory_pool_size;
+}
+
+// every buffer the resize_*_layer functions realloc
+#define RESOLUTION_BUFFERS(l, X) \
+    X(l->output) X(l->output_bn_backup) X(l->delta) X(l->x) X(l->x_norm) X(l->indexes) \
+    X(l->binary_input) X(l->input_bit) X(l->input_bit_mask) X(l->input_bit_valid) \
+    X(l->input_uint8) X(l->input_int16) X(l->input_sum_int) X(l->output_int32) X(l->output_uint8_final)
+
+// the saved plan owns the current buffers now, so resize_network reallocs from scratch
+static void detach_resolution_buffers(network *net)
+{
+    int i;
+#define DETACH(p) p = 0;
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        RESOLUTION_BUFFERS(l, DETACH)
+        if(l->type == AVGPOOL) break;
+    }
+#undef DETACH
+    net->input = 0;
+    net->truth = 0;
+    net->workspace = 0;
+    net->input_uint8 = 0;
+    net->memory_pool = 0;
+    net->memory_pool_size = 0;
+}
+
+static void free_resolution_plan(resolution_plan *p, int n)
+{
+    int i;
+    uint8_t *pool = p->memory_pool;
+    size_t pool_size = p->memory_pool_size;
+#define FREE_UNPOOLED(q) if(q && ((uint8_t *)q < pool || (uint8_t *)q >= pool + pool_size)) free(q);
+    for(i = 0; i < n; ++i){
+        layer *l = &p->layers[i];
+        // freed with the layer before it
+        if(l->type == SHORTCUT) l->output = l->delta = 0;
+        RESOLUTION_BUFFERS(l, FREE_UNPOOLED)
+        if(l->type == AVGPOOL) break;
+    }
+#undef FREE_UNPOOLED
+    free(pool);
+    free(p->input);
+    free(p->truth);
+    free(p->workspace);
+    free(p->input_uint8);
+}
+
+static void free_resolution_plans(network *net)
+{
+    resolution_plan *p = net->resolution_plans;
+    while(p){
+        resolution_plan *next = p->next;
+        // the plan for the live resolution shares its buffers with net->layers
+        if(p->w != net->w || p->h != net->h) free_resolution_plan(p, net->n);
+        free(p->layers);
+        free(p);
+        p = next;
+    }
+    net->resolution_plans = 0;
+}
+
+// unlike set_batch_network this also reallocates every buffer for b images
+void resize_network_batch(network *net, int b)
+{
+    if(b == net->batch) return;
+    // cached resolution plans were sized for the old batch
+    free_resolution_plans(net);
+    set_batch_network(net, b);
+    resize_network(net, net->w, net->h);
+}
+
+/*
+ * Switch an inference network to a w x h input without dropping the buffers of the
+ * resolution it is leaving: each (w,h) keeps its own layer sizes, quantized buffers,
+ * memory plan and tuned kernels, so going back to a resolution seen before is just a
+ * pointer swap. Weights and quantization parameters are shared by all of them.
+ */
+int set_network_resolution(network *net, int w, int h)
+{
+    if(w == net->w && h == net->h) return 0;
+#ifdef GPU
+    if(gpu_index >= 0) return resize_network(net, w, h);
+#endif
+    save_resolution_plan(net);
+    resolution_plan *p = find_resolution_plan(net, w, h);
+    if(p){
+        load_resolution_plan(net, p);
+        return 0;
+    }
+    detach_resolution_buffers(net);
+    resize_network(net, w, h);
+#ifdef QUANTIZATION
+    if(net->tune_cache) tune_network(net, net->tune_cache, net->autotune);
+#endif
+    fprintf(stderr, "Planned resolution %d x %d\n", w, h);
+    return 0;
+}
+
 layer get_network_detection_layer(network *net)
 {
     int i;
@@ -639,6 +861,29 @@ detection *get_network_boxes(network *net, int w, int h, float thresh, float hie
     return dets;
 }
 
+/*
+ * get_network_boxes for image b of a batched forward. Detection layers only look
+ * at their first image, and must see a batch of 1: a batch of 2 would otherwise
+ * be averaged as the flipped pair of validate_detector_flip.
+ */
+detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num)
+{
+    int j;
+    int batch = net->batch;
+    for(j = 0; j < net->n; ++j){
+        if(net->layers[j].type != YOLO) continue;
+        net->layers[j].output += b*net->layers[j].outputs;
+        net->layers[j].batch = 1;
+    }
+    detection *dets = get_network_boxes(net, w, h, thresh, hier, map, relative, num);
+    for(j = 0; j < net->n; ++j){
+        if(net->layers[j].type != YOLO) continue;
+        net->layers[j].output -= b*net->layers[j].outputs;
+        net->layers[j].batch = batch;
+    }
+    return dets;
+}
+
 void free_detections(detection *dets, int n)
 {
     int i;
@@ -789,15 +1034,31 @@ float network_accuracy_multi(network *net, data d, int n)
 void free_network(network *net)
 {
     int i;
+    free_layer_graph(net->graph);
+    free_resolution_plans(net);
+    unplan_network_memory(net, 0);
     for(i = 0; i < net->n; ++i){
         free_layer(net->layers[i]);
     }
     free(net->layers);
     if(net->input) free(net->input);
     if(net->truth) free(net->truth);
+    if(net->input_uint8) free(net->input_uint8);
+    if(net->input_calibration) free(net->input_calibration);
+    if(net->steps) free(net->steps);
+    if(net->scales) free(net->scales);
+    if(net->tune_cache) free(net->tune_cache);
+    free(net->seen);
+    free(net->t);
+    free(net->cost);
 #ifdef GPU
     if(net->input_gpu) cuda_free(net->input_gpu);
     if(net->truth_gpu) cuda_free(net->truth_gpu);
+    if(gpu_index >= 0){
+        if(net->workspace) cuda_free(net->workspace);
+    }else if(net->workspace) free(net->workspace);
+#else
+    if(net->workspace) free(net->workspace);
 #endif
     free(net);
 }
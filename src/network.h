@@ -23,6 +23,8 @@ float network_accuracy_multi(network *net, data d, int n);
 int get_predicted_class_network(network *net);
 void print_network(network *net);
 int resize_network(network *net, int w, int h);
+int set_network_resolution(network *net, int w, int h);
+void resize_network_batch(network *net, int b);
 void calc_network_cost(network *net);
 
 #endif
@@ -19,6 +19,7 @@
 #include "list.h"
 #include "local_layer.h"
 #include "maxpool_layer.h"
+#include "memory_plan.h"
 #include "normalization_layer.h"
 #include "option_list.h"
 #include "parser.h"
@@ -194,11 +195,28 @@ convolutional_layer parse_convolutional(list *options, size_params params, int c
     int quant_stop_flag = option_find_int_quiet(options, "quant_stop", 0);
 
     convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, 
-                                                         binary, quant_stop_flag, xnor, params.close_quantization, layer_quant_flag, count);
+                                                         binary, quant_stop_flag, params.net->adam, params.close_quantization, layer_quant_flag, count);
+    if((binary || xnor) && !layer_quant_flag) make_convolutional_bit_layer(&layer, xnor);
     layer.flipped = option_find_int_quiet(options, "flipped", 0);
     layer.dot = option_find_float_quiet(options, "dot", 0);
     layer.fisrt_time_train_fag = option_find_int_quiet(options, "first_time", 0);
     layer.count = count;
+#ifdef QUANTIZATION
+    layer.int4_flag = option_find_int_quiet(options, "int4", 0);
+    if(layer.int4_flag){
+        layer.weights_int4 = calloc(n*((layer.nweights/n + 1)/2), sizeof(uint8_t));
+        if(layer_quant_flag && !params.close_quantization) layer.forward = forward_convolutional_layer_quant_int4;
+    }
+    layer.winograd = option_find_int_quiet(options, "winograd", 0);
+    if(winograd_supported(layer) && !params.close_quantization && (layer.winograd || params.net->tune_cache)){
+        // the tuner may pick winograd too, so the transformed weights exist whenever a cache is set
+        layer.weights_winograd = calloc(16*layer.n*layer.c, sizeof(int16_t));
+        if(winograd_workspace_size(layer) > layer.workspace_size) layer.workspace_size = winograd_workspace_size(layer);
+        if(layer.winograd) layer.forward = forward_convolutional_layer_quant_winograd;
+    }else{
+        layer.winograd = 0;
+    }
+#endif
 
     return layer;
 }
@@ -468,9 +486,12 @@ layer parse_shortcut(list *options, size_params params, network *net, int count
     int batch = params.batch;
     layer from = net->layers[index];
 
-    layer s = make_shortcut_layer(batch, index, params.w, params.h, params.c, from.out_w, from.out_h, from.out_c);
+    int layer_quant_flag = option_find_int_quiet(options, "quantized", 0);
+    int quant_stop_flag = option_find_int_quiet(options, "quant_stop", 0);
+    layer s = make_shortcut_layer(batch, index, params.w, params.h, params.c, from.out_w, from.out_h, from.out_c, layer_quant_flag, quant_stop_flag, params.close_quantization);
 
     s.count = count;
+    s.fisrt_time_train_fag = option_find_int_quiet(options, "first_time", 0);
     char *activation_s = option_find_str(options, "activation", "linear");
     ACTIVATION activation = get_activation(activation_s);
     s.activation = activation;
@@ -606,6 +627,14 @@ void parse_net_options(list *options, network *net)
             a = strchr(a, ',') + 1;
         }
     }
+    char *tune_cache = option_find(options, "tune_cache");
+    if(tune_cache) net->tune_cache = copy_string(tune_cache);
+    net->autotune = option_find_int_quiet(options, "autotune", 0);
+    net->depth_first = option_find_int_quiet(options, "depth_first", 0);
+    net->depth_first_rows = option_find_int_quiet(options, "depth_first_rows", 0);
+    net->memory_plan = option_find_int_quiet(options, "memory_plan", 0);
+    net->drop_float_weights = option_find_int_quiet(options, "drop_float_weights", 0);
+    net->graph_threads = option_find_int_quiet(options, "graph_threads", 0);
     net->adam = option_find_int_quiet(options, "adam", 0);
     if(net->adam){
         net->B1 = option_find_float(options, "B1", .9);
@@ -753,9 +782,13 @@ network *parse_network_cfg(char *filename, int close_quantization)
             l = parse_upsample(options, params, net, count);
         }else if(lt == SHORTCUT){
             l = parse_shortcut(options, params, net, count);
+            free(l.output);
+            free(l.delta);
             l.output = net->layers[count-1].output;
             l.delta = net->layers[count-1].delta;
 #ifdef GPU
+            if(l.output_gpu) cuda_free(l.output_gpu);
+            if(l.delta_gpu) cuda_free(l.delta_gpu);
             l.output_gpu = net->layers[count-1].output_gpu;
             l.delta_gpu = net->layers[count-1].delta_gpu;
 #endif
@@ -811,6 +844,7 @@ network *parse_network_cfg(char *filename, int close_quantization)
         net->workspace = calloc(1, workspace_size);
 #endif
     }
+    if(net->memory_plan) plan_network_memory(net);
     return net;
 }
 
@@ -849,6 +883,35 @@ list *read_cfg(char *filename)
     return options;
 }
 
+void save_cfg_filters(char *filename, char *outfile, int *filters)
+{
+    list *sections = read_cfg(filename);
+    FILE *fp = fopen(outfile, "w");
+    if(!fp) file_error(outfile);
+    node *n = sections->front;
+    int count = -1;
+    while(n){
+        section *s = (section *)n->val;
+        fprintf(fp, "%s\n", s->type);
+        node *o = s->options->front;
+        while(o){
+            kvp *p = (kvp *)o->val;
+            if(count >= 0 && filters[count] > 0 && 0 == strcmp(p->key, "filters")){
+                fprintf(fp, "%s=%d\n", p->key, filters[count]);
+            }else{
+                fprintf(fp, "%s=%s\n", p->key, p->val);
+            }
+            o = o->next;
+        }
+        fprintf(fp, "\n");
+        free_section(s);
+        n = n->next;
+        ++count;
+    }
+    free_list(sections);
+    fclose(fp);
+}
+
 void save_convolutional_weights_binary(layer l, FILE *fp)
 {
 #ifdef GPU
@@ -905,8 +968,20 @@ void save_convolutional_weights(layer l, FILE *fp)
     fwrite(l.activ_data_uint8_zero_point, sizeof(uint8_t), 1, fp);
     fwrite(l.weight_data_uint8_scales, sizeof(float), l.n, fp);
     fwrite(l.weight_data_uint8_zero_point, sizeof(uint8_t), l.n, fp);
-    fwrite(l.weights_uint8, sizeof(uint8_t), l.c*l.n*l.size*l.size, fp);
+    if(l.int4_flag){
+        fwrite(l.weights_int4, sizeof(uint8_t), l.n*((l.nweights/l.n + 1)/2), fp);
+    }else{
+        fwrite(l.weights_uint8, sizeof(uint8_t), l.c*l.n*l.size*l.size, fp);
+    }
 #endif
+    if(!l.weights && l.weights_bit){
+        // an inference-only bit layer keeps just the signs and filter scales it computes with
+        float *weights = calloc(num, sizeof(float));
+        unbinarize_weights_bit(l.weights_bit, l.weights_bit_scales, l.n, num/l.n, weights);
+        fwrite(weights, sizeof(float), num, fp);
+        free(weights);
+        return;
+    }
     fwrite(l.weights, sizeof(float), num, fp);
 }
 
@@ -928,6 +1003,12 @@ void save_upsample_weights(layer l, FILE *fp)
     fwrite(l.activ_data_uint8_zero_point, sizeof(uint8_t), 1, fp);
 }
 
+void save_shortcut_weights(layer l, FILE *fp)
+{
+    fwrite(l.activ_data_uint8_scales, sizeof(float), 1, fp);
+    fwrite(l.activ_data_uint8_zero_point, sizeof(uint8_t), 1, fp);
+}
+
 void save_batchnorm_weights(layer l, FILE *fp)
 {
 #ifdef GPU
@@ -957,16 +1038,22 @@ void save_connected_weights(layer l, FILE *fp)
 }
 
 void save_weights_upto(network *net, char *filename, int cutoff)
+{
+    printf("Saving weights to %s\n", filename);
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+    write_weights_upto(net, fp, cutoff);
+    fclose(fp);
+}
+
+// the weights file body, to any stream
+void write_weights_upto(network *net, FILE *fp, int cutoff)
 {
 #ifdef GPU
     if(net->gpu_index >= 0){
         cuda_set_device(net->gpu_index);
     }
 #endif
-    printf("Saving weights to %s\n", filename);
-    FILE *fp = fopen(filename, "wb");
-    if(!fp) file_error(filename);
-
     int major = 0;
     int minor = 2;
     int revision = 0;
@@ -990,6 +1077,8 @@ void save_weights_upto(network *net, char *filename, int cutoff)
             save_route_weights(l, fp);
         } if(l.type == UPSAMPLE && l.layer_quant_flag){
             save_upsample_weights(l, fp);
+        } if(l.type == SHORTCUT && l.layer_quant_flag){
+            save_shortcut_weights(l, fp);
 #endif
         } if(l.type == BATCHNORM){
             save_batchnorm_weights(l, fp);
@@ -1035,7 +1124,6 @@ void save_weights_upto(network *net, char *filename, int cutoff)
             fwrite(l.weights, sizeof(float), size, fp);
         }
     }
-    fclose(fp);
 }
 void save_weights(network *net, char *filename)
 {
@@ -1142,7 +1230,12 @@ void load_convolutional_weights(layer l, FILE *fp, network *net, int index)
     fread(l.activ_data_uint8_zero_point, sizeof(uint8_t), 1, fp);
     fread(l.weight_data_uint8_scales, sizeof(float), l.n, fp);
     fread(l.weight_data_uint8_zero_point, sizeof(uint8_t), l.n, fp);
-    fread(l.weights_uint8, sizeof(uint8_t), l.c*l.n*l.size*l.size, fp);
+    if(l.int4_flag){
+        fread(l.weights_int4, sizeof(uint8_t), l.n*((l.nweights/l.n + 1)/2), fp);
+        unpack_uint4_cpu(l.weights_int4, l.n, l.nweights/l.n, l.weights_uint8);
+    }else{
+        fread(l.weights_uint8, sizeof(uint8_t), l.c*l.n*l.size*l.size, fp);
+    }
     // printf("layer%d --- load input sacle = %f, z = %d\n", l.count, l.input_data_uint8_scales[0], l.input_data_uint8_zero_point[0]);
     // printf("layer%d --- load weigt sacle = %f, z = %d\n", l.count, l.weight_data_uint8_scales[0], l.weight_data_uint8_zero_point[0]);
     // printf("layer%d --- load activ sacle = %f, z = %d\n", l.count, l.activ_data_uint8_scales[0], l.activ_data_uint8_zero_point[0]);
@@ -1198,6 +1291,23 @@ void load_upsample_weights(layer l, FILE *fp, network *net, int index)
     }
 }
 
+// first_time=1 starts the activation range from the previous layer, there is nothing to read yet
+void load_shortcut_weights(layer l, FILE *fp, network *net, int index)
+{
+    if(!l.fisrt_time_train_fag){
+        fread(l.activ_data_uint8_scales, sizeof(float), 1, fp);
+        fread(l.activ_data_uint8_zero_point, sizeof(uint8_t), 1, fp);
+    }
+
+    if(l.activ_data_uint8_scales[0] && net->train){
+        l.min_activ_value[0] = (QUANT_NEGATIVE_LIMIT - l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
+        l.max_activ_value[0] = (QUANT_POSITIVE_LIMIT - l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
+    }else if(index > 1 && net->train){
+        l.min_activ_value[0] = net->layers[index-1].min_activ_value[0];
+        l.max_activ_value[0] = net->layers[index-1].max_activ_value[0];
+    }
+}
+
 void load_weights_upto(network *net, char *filename, int start, int cutoff)
 {
 #ifdef GPU
@@ -1231,6 +1341,15 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
         if (l.dontload) continue;
         if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
             load_convolutional_weights(l, fp, net, i);
+#ifdef QUANTIZATION
+            if(l.weights_winograd) transform_convolutional_weights_winograd(&net->layers[i]);
+#endif
+#ifdef QUANTIZATION
+            // quantization packs again after folding batch norm, the float weights are still needed then
+            if(l.weights_bit) pack_convolutional_bit_weights(&net->layers[i], 0);
+#else
+            if(l.weights_bit) pack_convolutional_bit_weights(&net->layers[i], net->drop_float_weights);
+#endif
         }
         if(l.type == CONNECTED){
             load_connected_weights(l, fp, transpose);
@@ -1245,6 +1364,9 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
         if(l.type == UPSAMPLE && l.layer_quant_flag){
             load_upsample_weights(l, fp, net, i);
         }
+        if(l.type == SHORTCUT && l.layer_quant_flag){
+            load_shortcut_weights(l, fp, net, i);
+        }
 #endif
         if(l.type == BATCHNORM){
             load_batchnorm_weights(l, fp);
@@ -1302,5 +1424,9 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
 void load_weights(network *net, char *filename)
 {
     load_weights_upto(net, filename, 0, net->n);
+#ifdef QUANTIZATION
+    // kernels are timed on the real weights, after any winograd fallback
+    if(net->tune_cache) tune_network(net, net->tune_cache, net->autotune);
+#endif
 }
 
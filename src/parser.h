@@ -4,5 +4,7 @@
 #include "network.h"
 
 void save_network(network net, char *filename);
+void save_cfg_filters(char *filename, char *outfile, int *filters);
+void write_weights_upto(network *net, FILE *fp, int cutoff);
 
 #endif
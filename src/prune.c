@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "prune.h"
+#include "parser.h"
+#include "network.h"
+#include "activations.h"
+#include "blas.h"
+#include "utils.h"
+
+typedef struct{
+    float score;
+    int index;
+} filter_score;
+
+static int filter_score_comparator(const void *pa, const void *pb)
+{
+    float diff = ((filter_score *)pa)->score - ((filter_score *)pb)->score;
+    if(diff < 0) return -1;
+    else if(diff > 0) return 1;
+    return 0;
+}
+
+PRUNE_METRIC get_prune_metric(char *s)
+{
+    if (strcmp(s, "bn")==0) return PRUNE_BN_SCALE;
+    if (strcmp(s, "l1")==0) return PRUNE_L1;
+    printf("Couldn't find prune metric %s, going with bn\n", s);
+    return PRUNE_BN_SCALE;
+}
+
+/*
+ * For every layer, record which conv filter produced each of its output channels.
+ * maxpool and upsample pass channels through, route concatenates its inputs,
+ * anything else is a fresh set of channels that no conv owns (layer = -1).
+ */
+static channel_source **trace_channel_sources(network *net)
+{
+    channel_source **sources = calloc(net->n, sizeof(channel_source *));
+    int i, j, k;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        sources[i] = calloc(l.out_c ? l.out_c : 1, sizeof(channel_source));
+        if(l.type == CONVOLUTIONAL){
+            for(k = 0; k < l.out_c; ++k){
+                sources[i][k].layer = i;
+                sources[i][k].channel = k;
+            }
+        }else if((l.type == MAXPOOL || l.type == UPSAMPLE) && i > 0){
+            memcpy(sources[i], sources[i-1], l.out_c*sizeof(channel_source));
+        }else if(l.type == ROUTE){
+            int offset = 0;
+            for(j = 0; j < l.n; ++j){
+                int index = l.input_layers[j];
+                int c = net->layers[index].out_c;
+                memcpy(sources[i] + offset, sources[index], c*sizeof(channel_source));
+                offset += c;
+            }
+        }else{
+            for(k = 0; k < l.out_c; ++k) sources[i][k].layer = -1;
+        }
+    }
+    return sources;
+}
+
+static void protect_sources(char **prunable, channel_source *src, int n)
+{
+    int k;
+    for(k = 0; k < n; ++k){
+        if(src[k].layer >= 0) prunable[src[k].layer][src[k].channel] = 0;
+    }
+}
+
+static float filter_importance(layer l, int k, PRUNE_METRIC metric)
+{
+    int i;
+    int size = l.c/l.groups*l.size*l.size;
+    float sum = 0;
+    if(metric == PRUNE_BN_SCALE && l.batch_normalize) return fabs(l.scales[k]);
+    if(l.layer_quant_flag){
+        // L1 around the zero point, scaled back so filters with different per-channel scales compare fairly
+        for(i = 0; i < size; ++i){
+            sum += abs((int)l.weights_uint8[k*size + i] - (int)l.weight_data_uint8_zero_point[k]);
+        }
+        return sum*l.weight_data_uint8_scales[k];
+    }
+    for(i = 0; i < size; ++i) sum += fabs(l.weights[k*size + i]);
+    return sum;
+}
+
+// a removed filter is treated as emitting its folded bias through the activation
+static float pruned_channel_output(layer l, int k)
+{
+    float bias = l.biases[k];
+    if(l.batch_normalize){
+        bias -= l.scales[k]*l.rolling_mean[k]/(sqrt(l.rolling_variance[k]) + .000001f);
+    }
+    return activate(bias, l.activation);
+}
+
+/*
+ * Fold the constant contribution of a removed input channel into the consumer.
+ * Quantized layers store BN-folded weights_uint8, so the shift goes straight into
+ * the bias; float layers with BN move rolling_mean instead. Exact for 1x1 kernels,
+ * approximate at the padded border for larger ones.
+ */
+static void absorb_pruned_input(layer l, int c, float a)
+{
+    int o, s;
+    int ksize = l.size*l.size;
+    for(o = 0; o < l.n; ++o){
+        float sum = 0;
+        for(s = 0; s < ksize; ++s){
+            int index = (o*l.c + c)*ksize + s;
+            if(l.layer_quant_flag){
+                sum += (l.weights_uint8[index] - l.weight_data_uint8_zero_point[o])*l.weight_data_uint8_scales[o];
+            }else{
+                sum += l.weights[index];
+            }
+        }
+        if(l.layer_quant_flag || !l.batch_normalize) l.biases[o] += a*sum;
+        else l.rolling_mean[o] -= a*sum;
+    }
+}
+
+/*
+ * Per-channel weight scales and zero points stay valid after slicing, so they are
+ * copied rather than re-derived. M, biases_int32 and weights_sum_int are rebuilt
+ * from these by quantization_weights_and_activations at load time.
+ */
+static void copy_pruned_convolutional(layer l, layer p, char *keep_out, channel_source *in, char **keep)
+{
+    int *out_index = calloc(p.n, sizeof(int));
+    int *in_index = calloc(p.c, sizeof(int));
+    int o, c, n = 0;
+    for(o = 0; o < l.n; ++o){
+        if(keep_out[o]) out_index[n++] = o;
+    }
+    assert(n == p.n);
+    n = 0;
+    for(c = 0; c < l.c; ++c){
+        if(in && in[c].layer >= 0 && !keep[in[c].layer][in[c].channel]) continue;
+        in_index[n++] = c;
+    }
+    assert(n == p.c);
+
+    int ksize = l.size*l.size;
+    int lc = l.c/l.groups;
+    int pc = p.c/p.groups;
+    for(o = 0; o < p.n; ++o){
+        int k = out_index[o];
+        p.biases[o] = l.biases[k];
+        if(l.batch_normalize){
+            p.scales[o] = l.scales[k];
+            p.rolling_mean[o] = l.rolling_mean[k];
+            p.rolling_variance[o] = l.rolling_variance[k];
+        }
+        p.weight_data_uint8_scales[o] = l.weight_data_uint8_scales[k];
+        p.weight_data_uint8_zero_point[o] = l.weight_data_uint8_zero_point[k];
+        for(c = 0; c < pc; ++c){
+            memcpy(p.weights + (o*pc + c)*ksize, l.weights + (k*lc + in_index[c])*ksize, ksize*sizeof(float));
+            memcpy(p.weights_uint8 + (o*pc + c)*ksize, l.weights_uint8 + (k*lc + in_index[c])*ksize, ksize*sizeof(uint8_t));
+        }
+    }
+    if(p.int4_flag) pack_uint4_cpu(p.weights_uint8, p.n, pc*ksize, p.weights_int4);
+    p.input_data_uint8_scales[0] = l.input_data_uint8_scales[0];
+    p.input_data_uint8_zero_point[0] = l.input_data_uint8_zero_point[0];
+    p.activ_data_uint8_scales[0] = l.activ_data_uint8_scales[0];
+    p.activ_data_uint8_zero_point[0] = l.activ_data_uint8_zero_point[0];
+    free(out_index);
+    free(in_index);
+}
+
+static double convolutional_bflops(layer l)
+{
+    return (2.0 * l.n * l.size*l.size*l.c/l.groups * l.out_h*l.out_w)/1000000000.;
+}
+
+void prune_channels(char *cfgfile, char *weightfile, float ratio, char *metric_s, char *outcfg, char *outweights)
+{
+    PRUNE_METRIC metric = get_prune_metric(metric_s);
+    gpu_index = -1;
+    network *net = load_network(cfgfile, weightfile, 0);
+    channel_source **sources = trace_channel_sources(net);
+    char **prunable = calloc(net->n, sizeof(char *));
+    char **keep = calloc(net->n, sizeof(char *));
+    int *filters = calloc(net->n, sizeof(int));
+    int i, k;
+
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == CONNECTED || l.type == BATCHNORM || l.type == LOCAL || l.type == DECONVOLUTIONAL ||
+           l.type == RNN || l.type == GRU || l.type == LSTM || l.type == CRNN){
+            error("prune: only convolutional layers may carry weights");
+        }
+        if(l.type != CONVOLUTIONAL) continue;
+        prunable[i] = calloc(l.n, sizeof(char));
+        keep[i] = calloc(l.n, sizeof(char));
+        memset(prunable[i], l.groups == 1, l.n);
+        memset(keep[i], 1, l.n);
+    }
+
+    // channels that reach anything other than a conv, maxpool, upsample or route keep their shape
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        int passthrough = (l.type == CONVOLUTIONAL && l.groups == 1) || l.type == MAXPOOL || l.type == UPSAMPLE || l.type == ROUTE;
+        if(!passthrough && i > 0) protect_sources(prunable, sources[i-1], net->layers[i-1].out_c);
+        if(l.type == SHORTCUT) protect_sources(prunable, sources[l.index], net->layers[l.index].out_c);
+    }
+    protect_sources(prunable, sources[net->n-1], net->layers[net->n-1].out_c);
+
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type != CONVOLUTIONAL) continue;
+        filter_score *scores = calloc(l.n, sizeof(filter_score));
+        int candidates = 0;
+        for(k = 0; k < l.n; ++k){
+            if(!prunable[i][k]) continue;
+            scores[candidates].score = filter_importance(l, k, metric);
+            scores[candidates].index = k;
+            ++candidates;
+        }
+        int removed = (int)(ratio*l.n);
+        if(removed > candidates) removed = candidates;
+        if(removed >= l.n) removed = l.n - 1;
+        qsort(scores, candidates, sizeof(filter_score), filter_score_comparator);
+        for(k = 0; k < removed; ++k) keep[i][scores[k].index] = 0;
+        filters[i] = l.n - removed;
+        free(scores);
+    }
+
+    for(i = 1; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type != CONVOLUTIONAL || l.groups != 1) continue;
+        for(k = 0; k < l.c; ++k){
+            channel_source src = sources[i-1][k];
+            if(src.layer < 0 || keep[src.layer][src.channel]) continue;
+            absorb_pruned_input(l, k, pruned_channel_output(net->layers[src.layer], src.channel));
+        }
+    }
+
+    save_cfg_filters(cfgfile, outcfg, filters);
+    network *pruned = parse_network_cfg(outcfg, 0);
+    assert(pruned->n == net->n);
+    *pruned->seen = *net->seen;
+
+    double before = 0, after = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        layer p = pruned->layers[i];
+        if(l.type == CONVOLUTIONAL){
+            copy_pruned_convolutional(l, p, keep[i], i ? sources[i-1] : 0, keep);
+            before += convolutional_bflops(l);
+            after += convolutional_bflops(p);
+            printf("layer %3d: filters %4d -> %4d, input channels %4d -> %4d\n", i, l.n, p.n, l.c, p.c);
+        }else if(l.type == MAXPOOL || l.type == ROUTE || l.type == UPSAMPLE){
+            p.activ_data_uint8_scales[0] = l.activ_data_uint8_scales[0];
+            p.activ_data_uint8_zero_point[0] = l.activ_data_uint8_zero_point[0];
+        }
+    }
+    printf("conv cost: %5.3f BFLOPs -> %5.3f BFLOPs (%.1f%%)\n", before, after, before ? 100.*after/before : 0);
+    printf("Pruned cfg written to %s, check the F1 drop with `detector f1`\n", outcfg);
+    save_weights(pruned, outweights);
+
+    for(i = 0; i < net->n; ++i){
+        free(sources[i]);
+        if(prunable[i]) free(prunable[i]);
+        if(keep[i]) free(keep[i]);
+    }
+    free(sources);
+    free(prunable);
+    free(keep);
+    free(filters);
+    free_network(pruned);
+    free_network(net);
+}
@@ -0,0 +1,16 @@
+#ifndef PRUNE_H
+#define PRUNE_H
+#include "darknet.h"
+
+typedef enum{
+    PRUNE_BN_SCALE, PRUNE_L1
+} PRUNE_METRIC;
+
+typedef struct{
+    int layer;
+    int channel;
+} channel_source;
+
+PRUNE_METRIC get_prune_metric(char *s);
+
+#endif
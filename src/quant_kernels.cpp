@@ -0,0 +1,293 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "quant_kernels.h"
+
+// output channels x output columns accumulated per block, 16KB of int32 that stays in L1
+#define QUANT_OB 8
+#define QUANT_JB 512
+
+namespace {
+
+// template arguments of RUNTIME read the value from the layer instead
+const int RUNTIME = -1;
+
+inline int fixed(int templated, int value)
+{
+    return templated == RUNTIME ? value : templated;
+}
+
+/*
+ * im2col_cpu_uint8 without the per-pixel bounds checks: for every (ky, kx) the
+ * output columns reading inside the image are found once, padding is a memset
+ * of the input zero point and stride 1 rows are a memcpy.
+ */
+template<int K, int S, int P>
+void im2col(const uint8_t *im, int channels, int height, int width, int ksize, int kstride, int kpad,
+            int out_h, int out_w, uint8_t zero_point, uint8_t *col)
+{
+    const int size = fixed(K, ksize);
+    const int stride = fixed(S, kstride);
+    const int pad = fixed(P, kpad);
+    for(int c = 0; c < channels; ++c){
+        for(int ky = 0; ky < size; ++ky){
+            for(int kx = 0; kx < size; ++kx){
+                uint8_t *dst = col + ((c*size + ky)*size + kx)*out_h*out_w;
+                const int offset = kx - pad;
+                int x0 = offset < 0 ? (-offset + stride - 1)/stride : 0;
+                int x1 = width - 1 - offset < 0 ? 0 : (width - 1 - offset)/stride + 1;
+                if(x1 > out_w) x1 = out_w;
+                if(x0 > x1) x0 = x1;
+                for(int y = 0; y < out_h; ++y, dst += out_w){
+                    const int iy = y*stride + ky - pad;
+                    if(iy < 0 || iy >= height){
+                        memset(dst, zero_point, out_w);
+                        continue;
+                    }
+                    const uint8_t *row = im + (c*height + iy)*width;
+                    memset(dst, zero_point, x0);
+                    if(stride == 1){
+                        memcpy(dst + x0, row + x0 + offset, x1 - x0);
+                    }else{
+                        for(int x = x0; x < x1; ++x) dst[x] = row[x*stride + offset];
+                    }
+                    memset(dst + x1, zero_point, out_w - x1);
+                }
+            }
+        }
+    }
+}
+
+// requant_convolutional_output for one value, the activation switch resolved at compile time
+template<ACTIVATION A>
+inline uint8_t requant(int32_t sum, int32_t bias, double multiplier, double shift, int zero_point)
+{
+    int64_t scaled = (sum + bias)*multiplier;
+    int32_t q = scaled*shift;
+    double v = q + zero_point;
+    if(A == LEAKY) v = q < 0 ? round(q*0.1) + zero_point : v;
+    if(A == RELU6) v = q <= 0 ? zero_point : v;
+    return (uint8_t)(int32_t)v;
+}
+
+/*
+ * sum(w*x) - wzp*sum(x) over the im2col matrix b for output channels [first, first + m),
+ * requantized straight out of the accumulators so output_int32 is never written.
+ * Exact in int32 like the colsum kernel; keeping w unsigned lets the products use
+ * 16-bit multiplies.
+ */
+template<ACTIVATION A>
+void gemm_requant(const layer &l, int first, int m, int n, int k, const uint8_t *b, int32_t *col_sum, uint8_t *out)
+{
+    const int zero_point = l.activ_data_uint8_zero_point[0];
+    for(int j = 0; j < n; ++j) col_sum[j] = 0;
+    for(int kk = 0; kk < k; ++kk){
+        for(int j = 0; j < n; ++j) col_sum[j] += b[kk*n + j];
+    }
+    #pragma omp parallel for
+    for(int i0 = 0; i0 < m; i0 += QUANT_OB){
+        int32_t acc[QUANT_OB*QUANT_JB] __attribute__((aligned(64)));
+        const int ib = m - i0 < QUANT_OB ? m - i0 : QUANT_OB;
+        for(int j0 = 0; j0 < n; j0 += QUANT_JB){
+            const int jb = n - j0 < QUANT_JB ? n - j0 : QUANT_JB;
+            memset(acc, 0, sizeof(acc));
+            for(int kk = 0; kk < k; ++kk){
+                const uint8_t *row = b + kk*n + j0;
+                for(int i = 0; i < ib; ++i){
+                    const int32_t w = l.weights_uint8[(first + i0 + i)*k + kk];
+                    int32_t *a = acc + i*QUANT_JB;
+                    for(int j = 0; j < jb; ++j) a[j] += w*row[j];
+                }
+            }
+            for(int i = 0; i < ib; ++i){
+                const int o = first + i0 + i;
+                const int32_t weight_zero_point = l.weight_data_uint8_zero_point[o];
+                const int32_t bias = l.biases_int32[o];
+                const double multiplier = l.M_value[o];
+                const double shift = l.M0_right_shift_value[o];
+                const int32_t *a = acc + i*QUANT_JB;
+                const int32_t *sum = col_sum + j0;
+                uint8_t *dst = out + (i0 + i)*n + j0;
+                for(int j = 0; j < jb; ++j){
+                    dst[j] = requant<A>(a[j] - weight_zero_point*sum[j], bias, multiplier, shift, zero_point);
+                }
+            }
+        }
+    }
+}
+
+void dequantize_output(const layer &l)
+{
+    if(!l.quant_stop_flag) return;
+    const int zero_point = l.activ_data_uint8_zero_point[0];
+    const float scale = l.activ_data_uint8_scales[0];
+    #pragma omp parallel for
+    for(int s = 0; s < l.outputs*l.batch; ++s){
+        l.output[s] = (l.output_uint8_final[s] - zero_point)*scale;
+    }
+}
+
+template<int K, int S, int P, ACTIVATION A>
+void forward_convolutional(layer l, network net)
+{
+    const int size = fixed(K, l.size);
+    const int stride = fixed(S, l.stride);
+    const int pad = fixed(P, l.pad);
+    const int m = l.n/l.groups;
+    const int k = size*size*l.c/l.groups;
+    const int n = l.out_h*l.out_w;
+    const int direct = size == 1 && stride == 1 && pad == 0;
+    // the float workspace holds a uint8 im2col buffer with room to spare
+    uint8_t *workspace = (uint8_t *)net.workspace;
+    int32_t *col_sum = (int32_t *)l.input_sum_int;
+    for(int b = 0; b < l.batch; ++b){
+        for(int g = 0; g < l.groups; ++g){
+            const uint8_t *im = net.input_uint8 + (b*l.groups + g)*l.c/l.groups*l.h*l.w;
+            const uint8_t *col = im;
+            if(!direct){
+                im2col<K, S, P>(im, l.c/l.groups, l.h, l.w, size, stride, pad, l.out_h, l.out_w,
+                                l.input_data_uint8_zero_point[0], workspace);
+                col = workspace;
+            }
+            gemm_requant<A>(l, g*m, m, n, k, col, col_sum, l.output_uint8_final + (b*l.groups + g)*n*m);
+        }
+    }
+    dequantize_output(l);
+}
+
+// the window of the output pixel at (y, x) clipped to the image, what forward_maxpool_layer_quant does everywhere
+inline uint8_t max_window_checked(const uint8_t *in, int h, int w, int y0, int x0, int size)
+{
+    uint8_t max = 0;
+    for(int n = 0; n < size; ++n){
+        const int y = y0 + n;
+        if(y < 0 || y >= h) continue;
+        for(int m = 0; m < size; ++m){
+            const int x = x0 + m;
+            if(x < 0 || x >= w) continue;
+            max = in[y*w + x] > max ? in[y*w + x] : max;
+        }
+    }
+    return max;
+}
+
+// first and one past the last output index whose window lies fully inside [0, length)
+inline void interior(int length, int out_length, int size, int stride, int offset, int *first, int *last)
+{
+    *first = offset > 0 ? (offset + stride - 1)/stride : 0;
+    *last = length + offset - size < 0 ? 0 : (length + offset - size)/stride + 1;
+    if(*last > out_length) *last = out_length;
+    if(*first > *last) *first = *last;
+}
+
+template<int K, int S, int P>
+void forward_maxpool(layer l, network net)
+{
+    const int size = fixed(K, l.size);
+    const int stride = fixed(S, l.stride);
+    const int offset = fixed(P, l.pad)/2;
+    int y0, y1, x0, x1;
+    interior(l.h, l.out_h, size, stride, offset, &y0, &y1);
+    interior(l.w, l.out_w, size, stride, offset, &x0, &x1);
+    #pragma omp parallel for
+    for(int p = 0; p < l.batch*l.c; ++p){
+        const uint8_t *in = net.input_uint8 + p*l.h*l.w;
+        uint8_t *out = l.output_uint8_final + p*l.out_h*l.out_w;
+        for(int y = 0; y < l.out_h; ++y){
+            uint8_t *dst = out + y*l.out_w;
+            const int iy = y*stride - offset;
+            if(y < y0 || y >= y1){
+                for(int x = 0; x < l.out_w; ++x) dst[x] = max_window_checked(in, l.h, l.w, iy, x*stride - offset, size);
+                continue;
+            }
+            for(int x = 0; x < x0; ++x) dst[x] = max_window_checked(in, l.h, l.w, iy, x*stride - offset, size);
+            for(int x = x0; x < x1; ++x){
+                const uint8_t *src = in + iy*l.w + x*stride - offset;
+                uint8_t max = 0;
+                for(int n = 0; n < size; ++n){
+                    for(int m = 0; m < size; ++m) max = src[n*l.w + m] > max ? src[n*l.w + m] : max;
+                }
+                dst[x] = max;
+            }
+            for(int x = x1; x < l.out_w; ++x) dst[x] = max_window_checked(in, l.h, l.w, iy, x*stride - offset, size);
+        }
+    }
+    dequantize_output(l);
+}
+
+template<int S>
+void forward_upsample(layer l, network net)
+{
+    const int stride = fixed(S, l.stride);
+    // same restriction as upsample_quant_cpu, a scale would leave the integer domain
+    assert(l.scale == 1);
+    #pragma omp parallel for
+    for(int p = 0; p < l.batch*l.c; ++p){
+        const uint8_t *in = net.input_uint8 + p*l.h*l.w;
+        uint8_t *out = l.output_uint8_final + p*l.out_h*l.out_w;
+        for(int y = 0; y < l.h; ++y){
+            const uint8_t *src = in + y*l.w;
+            uint8_t *dst = out + y*stride*l.out_w;
+            for(int x = 0; x < l.w; ++x){
+                for(int s = 0; s < stride; ++s) dst[x*stride + s] = src[x];
+            }
+            for(int s = 1; s < stride; ++s) memcpy(dst + s*l.out_w, dst, l.out_w);
+        }
+    }
+    dequantize_output(l);
+}
+
+template<int K, int S, int P>
+quant_forward convolutional_kernel(ACTIVATION a)
+{
+    switch(a){
+        case LINEAR: return forward_convolutional<K, S, P, LINEAR>;
+        case RELU: return forward_convolutional<K, S, P, RELU>;
+        case RELU6: return forward_convolutional<K, S, P, RELU6>;
+        case LEAKY: return forward_convolutional<K, S, P, LEAKY>;
+        default: return 0;
+    }
+}
+
+}
+
+extern "C" {
+
+quant_forward select_convolutional_quant_kernel(layer l)
+{
+    if(l.size == 1 && l.stride == 1 && l.pad == 0) return convolutional_kernel<1, 1, 0>(l.activation);
+    if(l.size == 3 && l.stride == 1 && l.pad == 1) return convolutional_kernel<3, 1, 1>(l.activation);
+    if(l.size == 3 && l.stride == 2 && l.pad == 1) return convolutional_kernel<3, 2, 1>(l.activation);
+    return convolutional_kernel<RUNTIME, RUNTIME, RUNTIME>(l.activation);
+}
+
+quant_forward select_maxpool_quant_kernel(layer l)
+{
+    // the cfg default padding is size - 1, spp blocks pool 5, 9 and 13 at stride 1
+    if(l.size == 2 && l.stride == 2 && l.pad == 1) return forward_maxpool<2, 2, 1>;
+    if(l.size == 2 && l.stride == 1 && l.pad == 1) return forward_maxpool<2, 1, 1>;
+    if(l.size == 3 && l.stride == 2 && l.pad == 2) return forward_maxpool<3, 2, 2>;
+    if(l.size == 5 && l.stride == 1 && l.pad == 4) return forward_maxpool<5, 1, 4>;
+    if(l.size == 9 && l.stride == 1 && l.pad == 8) return forward_maxpool<9, 1, 8>;
+    if(l.size == 13 && l.stride == 1 && l.pad == 12) return forward_maxpool<13, 1, 12>;
+    return forward_maxpool<RUNTIME, RUNTIME, RUNTIME>;
+}
+
+quant_forward select_upsample_quant_kernel(layer l)
+{
+    if(l.reverse) return 0;
+    if(l.stride == 2) return forward_upsample<2>;
+    return forward_upsample<RUNTIME>;
+}
+
+void forward_convolutional_layer_quant_template(layer l, network net)
+{
+    quant_forward forward = select_convolutional_quant_kernel(l);
+    assert(forward);
+    forward(l, net);
+}
+
+}
@@ -0,0 +1,26 @@
+#ifndef QUANT_KERNELS_H
+#define QUANT_KERNELS_H
+#include "darknet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*quant_forward)(struct layer, struct network);
+
+/*
+ * uint8 forward kernels instantiated from the templates in quant_kernels.cpp for
+ * the shapes cfgs use, size/stride/pad/activation folded in at compile time.
+ * Shapes without an instantiation get the generic kernel, layers the templates
+ * do not cover at all keep the C forward they already have.
+ */
+quant_forward select_convolutional_quant_kernel(layer l);
+quant_forward select_maxpool_quant_kernel(layer l);
+quant_forward select_upsample_quant_kernel(layer l);
+void forward_convolutional_layer_quant_template(layer l, network net);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
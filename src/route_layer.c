@@ -43,6 +43,8 @@ route_layer make_route_layer(int batch, int n, int *input_layers, int *input_siz
     else{
         l.forward = forward_route_layer;
     }
+    // a single input is already quantized with its own range, it only needs the float copy
+    if(l.layer_quant_flag) l.forward_qat = (l.n > 1) ? forward_route_layer_qat : forward_route_layer;
 #endif
     l.backward = backward_route_layer;
     #ifdef GPU
@@ -79,6 +81,9 @@ void resize_route_layer(route_layer *l, network *net)
     l->inputs = l->outputs;
     l->delta =  realloc(l->delta, l->outputs*l->batch*sizeof(float));
     l->output = realloc(l->output, l->outputs*l->batch*sizeof(float));
+#ifdef QUANTIZATION
+    l->output_uint8_final = realloc(l->output_uint8_final, l->outputs*l->batch*sizeof(uint8_t));
+#endif
 
 #ifdef GPU
     cuda_free(l->output_gpu);
@@ -104,6 +109,12 @@ void forward_route_layer(const route_layer l, network net)
     }
 }
 
+void forward_route_layer_qat(const route_layer l, network net)
+{
+    forward_route_layer(l, net);
+    fake_quant_layer_output(l, net);
+}
+
 void forward_route_layer_quant(const route_layer l, network net)
 {
     int i, j;
@@ -118,11 +129,9 @@ void forward_route_layer_quant(const route_layer l, network net)
         if(l.quant_stop_flag){
             // printf("dequant from uint8 to float32 in layer %d\n", l.count);
             #pragma omp parallel for
-            for (int s = 0; s < net.layers[index].out_c; ++s) {
-                for (int t = 0; t < net.layers[index].out_w*net.layers[index].out_h; ++t){
-                    int out_index = s*net.layers[index].out_w*net.layers[index].out_h + t + offset ;
-                    l.output[out_index] = (l.output_uint8_final[out_index] -  net.layers[index].activ_data_uint8_zero_point[0]) * net.layers[index].activ_data_uint8_scales[0];
-                }
+            for (int s = 0; s < input_size*l.batch; ++s) {
+                int out_index = (s/input_size)*l.outputs + offset + s%input_size;
+                l.output[out_index] = (l.output_uint8_final[out_index] -  net.layers[index].activ_data_uint8_zero_point[0]) * net.layers[index].activ_data_uint8_scales[0];
             }
         }
         offset += input_size; 
@@ -0,0 +1,652 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serve.h"
+#include "tile.h"
+#include "network.h"
+#include "image.h"
+#include "utils.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SERVE_LATENCY_WINDOW 1024
+
+typedef struct{
+    int fd;
+    int memfd;
+    uint8_t *ring;
+    int refs;
+    pthread_mutex_t write_lock;
+} serve_connection;
+
+// a prepared network shared by the batches that started on it
+typedef struct{
+    network *net;
+    char *weightfile;
+    int refs;
+} serve_model;
+
+typedef struct serve_job{
+    serve_connection *conn;
+    serve_request req;
+    double start;
+    double deadline;
+    struct serve_job *next;
+} serve_job;
+
+typedef struct{
+    serve_model *model;
+    char *cfgfile;
+    pthread_mutex_t reload_lock;
+    float thresh, hier, nms;
+    int slots, max_w, max_h;
+    size_t slot_size;
+    int max_batch;
+    int max_wait_us;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    serve_job *head, *tail;
+    int queue_depth, max_queue_depth, connections;
+    uint64_t requests;
+    double total_latency, max_latency;
+    float latencies[SERVE_LATENCY_WINDOW];
+    serve_batch_stats *batch_stats;
+} serve_state;
+
+static serve_state serve = {0};
+
+static int send_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while(size){
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if(n <= 0) return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static int recv_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while(size){
+        ssize_t n = recv(fd, p, size, 0);
+        if(n <= 0) return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void release_connection(serve_connection *conn)
+{
+    pthread_mutex_lock(&serve.lock);
+    int refs = --conn->refs;
+    pthread_mutex_unlock(&serve.lock);
+    if(refs) return;
+    munmap(conn->ring, serve.slots*serve.slot_size);
+    close(conn->memfd);
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
+
+static long resident_memory()
+{
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if(fp){
+        if(fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(fp);
+    }
+    return pages*sysconf(_SC_PAGESIZE);
+}
+
+static serve_model *acquire_model()
+{
+    pthread_mutex_lock(&serve.lock);
+    serve_model *model = serve.model;
+    ++model->refs;
+    pthread_mutex_unlock(&serve.lock);
+    return model;
+}
+
+static void release_model(serve_model *model)
+{
+    pthread_mutex_lock(&serve.lock);
+    int refs = --model->refs;
+    pthread_mutex_unlock(&serve.lock);
+    if(refs) return;
+    free_network(model->net);
+    printf("serve: freed %s, resident %.1f MB\n", model->weightfile, resident_memory()/1000000.);
+    fflush(stdout);
+    free(model->weightfile);
+    free(model);
+}
+
+static serve_model *load_serve_model(char *cfgfile, char *weightfile, int batch)
+{
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, 1);
+#ifdef QUANTIZATION
+#ifndef GPU
+    // frames then quantize without a min/max pass
+    quantization_weights_and_activations_fixed(net);
+#endif
+#endif
+    resize_network_batch(net, batch);
+    serve_model *model = calloc(1, sizeof(serve_model));
+    model->net = net;
+    model->weightfile = copy_string(weightfile);
+    model->refs = 1;
+    return model;
+}
+
+static int float_comparator(const void *pa, const void *pb)
+{
+    float diff = *(float *)pa - *(float *)pb;
+    if(diff < 0) return -1;
+    else if(diff > 0) return 1;
+    return 0;
+}
+
+static serve_stats get_serve_stats(serve_batch_stats *batch_stats)
+{
+    float window[SERVE_LATENCY_WINDOW];
+    serve_stats s = {0};
+    pthread_mutex_lock(&serve.lock);
+    memcpy(batch_stats, serve.batch_stats, serve.max_batch*sizeof(serve_batch_stats));
+    int n = serve.requests < SERVE_LATENCY_WINDOW ? serve.requests : SERVE_LATENCY_WINDOW;
+    memcpy(window, serve.latencies, n*sizeof(float));
+    s.requests = serve.requests;
+    s.queue_depth = serve.queue_depth;
+    s.max_queue_depth = serve.max_queue_depth;
+    s.connections = serve.connections;
+    s.max_batch = serve.max_batch;
+    s.max_wait_us = serve.max_wait_us;
+    s.mean_ms = serve.requests ? 1000*serve.total_latency/serve.requests : 0;
+    s.max_ms = 1000*serve.max_latency;
+    pthread_mutex_unlock(&serve.lock);
+    if(n){
+        qsort(window, n, sizeof(float), float_comparator);
+        s.p50_ms = 1000*window[n/2];
+        s.p99_ms = 1000*window[(n*99)/100];
+    }
+    return s;
+}
+
+static void record_latency(double latency, int batch)
+{
+    int bucket = latency > 1e-6 ? (int)log2(latency*1000000) : 0;
+    bucket = constrain_int(bucket, 0, SERVE_HISTOGRAM_BUCKETS - 1);
+    serve.latencies[serve.requests%SERVE_LATENCY_WINDOW] = latency;
+    ++serve.requests;
+    serve.total_latency += latency;
+    if(latency > serve.max_latency) serve.max_latency = latency;
+    ++serve.batch_stats[batch - 1].requests;
+    ++serve.batch_stats[batch - 1].buckets[bucket];
+}
+
+static void send_reply(serve_connection *conn, serve_reply reply, void *payload, size_t size)
+{
+    pthread_mutex_lock(&conn->write_lock);
+    if(send_all(conn->fd, &reply, sizeof(reply)) && size) send_all(conn->fd, payload, size);
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void send_stats(serve_connection *conn, uint32_t id)
+{
+    serve_batch_stats *batch_stats = calloc(serve.max_batch, sizeof(serve_batch_stats));
+    serve_stats s = get_serve_stats(batch_stats);
+    serve_reply reply = {id, 0, 0, 0};
+    pthread_mutex_lock(&conn->write_lock);
+    if(send_all(conn->fd, &reply, sizeof(reply)) && send_all(conn->fd, &s, sizeof(s))){
+        send_all(conn->fd, batch_stats, serve.max_batch*sizeof(serve_batch_stats));
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+    free(batch_stats);
+}
+
+static int valid_request(serve_request req)
+{
+    return req.slot < serve.slots && req.w > 0 && req.h > 0 && req.w <= serve.max_w && req.h <= serve.max_h;
+}
+
+// letterbox the interleaved RGB frame into image b of the batch
+static void load_frame(network *net, serve_request req, uint8_t *frame, int b)
+{
+    int w = req.w, h = req.h;
+    int i, k;
+    image im = make_image(w, h, 3);
+    for(k = 0; k < 3; ++k){
+        for(i = 0; i < w*h; ++i) im.data[k*w*h + i] = frame[i*3 + k]/255.;
+    }
+    image sized = letterbox_image(im, net->w, net->h);
+    image_tile whole = {0, 0, net->w, net->h};
+    load_image_tile(net, sized, whole, b);
+    free_image(sized);
+    free_image(im);
+}
+
+// report every class above threshold for image b, like draw_detections
+static serve_detection *get_frame_detections(network *net, serve_request req, int b, int *count)
+{
+    layer l = net->layers[net->n-1];
+    int i, j;
+    int nboxes = 0;
+    detection *dets = get_network_boxes_batch(net, b, req.w, req.h, serve.thresh, serve.hier, 0, 1, &nboxes);
+    if(serve.nms) do_nms_sort(dets, nboxes, l.classes, serve.nms);
+    int n = 0;
+    for(i = 0; i < nboxes; ++i){
+        for(j = 0; j < l.classes; ++j) n += dets[i].prob[j] > serve.thresh;
+    }
+    serve_detection *out = calloc(n ? n : 1, sizeof(serve_detection));
+    n = 0;
+    for(i = 0; i < nboxes; ++i){
+        for(j = 0; j < l.classes; ++j){
+            if(dets[i].prob[j] <= serve.thresh) continue;
+            box b = dets[i].bbox;
+            serve_detection d = {b.x, b.y, b.w, b.h, dets[i].prob[j], j};
+            out[n++] = d;
+        }
+    }
+    free_detections(dets, nboxes);
+    *count = n;
+    return out;
+}
+
+static double earliest_deadline(int n)
+{
+    serve_job *job = serve.head;
+    double deadline = job->deadline;
+    int i;
+    for(i = 0; i < n && job; ++i, job = job->next){
+        if(job->deadline < deadline) deadline = job->deadline;
+    }
+    return deadline;
+}
+
+/*
+ * Wait until max_batch requests are queued or the earliest deadline among the
+ * ones that would make the batch passes, then take up to max_batch of them.
+ * Caller holds serve.lock.
+ */
+static int collect_batch(serve_job **jobs)
+{
+    while(!serve.head) pthread_cond_wait(&serve.ready, &serve.lock);
+    while(serve.queue_depth < serve.max_batch){
+        double deadline = earliest_deadline(serve.max_batch);
+        struct timespec ts;
+        ts.tv_sec = (time_t)deadline;
+        ts.tv_nsec = (long)((deadline - ts.tv_sec)*1000000000);
+        if(pthread_cond_timedwait(&serve.ready, &serve.lock, &ts) == ETIMEDOUT) break;
+    }
+    int n = 0;
+    while(serve.head && n < serve.max_batch){
+        jobs[n++] = serve.head;
+        serve.head = serve.head->next;
+    }
+    if(!serve.head) serve.tail = 0;
+    serve.queue_depth -= n;
+    return n;
+}
+
+// run the waiting requests as one forward over images 0..n-1 and scatter the detections
+static void run_next_batch(serve_job **jobs)
+{
+    int i;
+    pthread_mutex_lock(&serve.lock);
+    int n = collect_batch(jobs);
+    pthread_mutex_unlock(&serve.lock);
+    // a reload that lands mid-batch only affects the next one
+    serve_model *model = acquire_model();
+    network *net = model->net;
+
+    // buffers stay sized for max_batch, only the batch the layers loop over changes
+    set_batch_network(net, n);
+    #pragma omp parallel for
+    for(i = 0; i < n; ++i){
+        load_frame(net, jobs[i]->req, jobs[i]->conn->ring + jobs[i]->req.slot*serve.slot_size, i);
+    }
+    network_predict(net, net->input);
+
+    pthread_mutex_lock(&serve.lock);
+    ++serve.batch_stats[n - 1].batches;
+    pthread_mutex_unlock(&serve.lock);
+    for(i = 0; i < n; ++i){
+        serve_request req = jobs[i]->req;
+        int count = 0;
+        serve_detection *dets = get_frame_detections(net, req, i, &count);
+        double latency = what_time_is_it_now() - jobs[i]->start;
+        serve_reply reply = {req.id, 0, count, latency*1000000};
+        send_reply(jobs[i]->conn, reply, dets, count*sizeof(serve_detection));
+        free(dets);
+        pthread_mutex_lock(&serve.lock);
+        record_latency(latency, n);
+        pthread_mutex_unlock(&serve.lock);
+    }
+    release_model(model);
+    for(i = 0; i < n; ++i){
+        release_connection(jobs[i]->conn);
+        free(jobs[i]);
+    }
+}
+
+typedef struct{
+    serve_connection *conn;
+    uint32_t id;
+    char *weightfile;
+} serve_reload_args;
+
+/*
+ * Load and prepare the new weights next to the running model, then swap the
+ * pointer. Batches already running keep their reference to the old model, which
+ * is freed by whoever drops the last one.
+ */
+static void *serve_reload_thread(void *ptr)
+{
+    serve_reload_args args = *(serve_reload_args *)ptr;
+    free(ptr);
+    serve_reply reply = {args.id, 0, 0, 0};
+    pthread_mutex_lock(&serve.reload_lock);
+    FILE *fp = fopen(args.weightfile, "rb");
+    if(!fp){
+        fprintf(stderr, "serve: cannot open %s, keeping the current model\n", args.weightfile);
+        reply.status = -1;
+    }else{
+        fclose(fp);
+        long before = resident_memory();
+        double start = what_time_is_it_now();
+        serve_model *model = load_serve_model(serve.cfgfile, args.weightfile, serve.max_batch);
+        double loaded = what_time_is_it_now();
+        long peak = resident_memory();
+
+        pthread_mutex_lock(&serve.lock);
+        serve_model *old = serve.model;
+        serve.model = model;
+        pthread_mutex_unlock(&serve.lock);
+        double swapped = what_time_is_it_now();
+
+        printf("serve: loaded %s in %.3f s, swapped in %.1f us, resident %.1f MB -> %.1f MB while both are live\n",
+               args.weightfile, loaded - start, (swapped - loaded)*1000000, before/1000000., peak/1000000.);
+        fflush(stdout);
+        reply.latency_us = (swapped - start)*1000000;
+        release_model(old);
+    }
+    pthread_mutex_unlock(&serve.reload_lock);
+    send_reply(args.conn, reply, 0, 0);
+    release_connection(args.conn);
+    free(args.weightfile);
+    return 0;
+}
+
+// the path follows the request, an empty one reloads the file the current model came from
+// returns 0 once the request stream can no longer be followed and the connection should close
+static int start_reload(serve_connection *conn, serve_request req)
+{
+    if(req.w > PATH_MAX){
+        // the path bytes are left unread, so nothing after them can be parsed either
+        serve_reply reply = {req.id, -1, 0, 0};
+        send_reply(conn, reply, 0, 0);
+        return 0;
+    }
+    char *weightfile = calloc(req.w + 1, sizeof(char));
+    if(req.w && !recv_all(conn->fd, weightfile, req.w)){
+        free(weightfile);
+        return 0;
+    }
+    if(!req.w){
+        free(weightfile);
+        pthread_mutex_lock(&serve.lock);
+        weightfile = copy_string(serve.model->weightfile);
+        pthread_mutex_unlock(&serve.lock);
+    }
+    serve_reload_args *args = calloc(1, sizeof(serve_reload_args));
+    args->conn = conn;
+    args->id = req.id;
+    args->weightfile = weightfile;
+    pthread_mutex_lock(&serve.lock);
+    ++conn->refs;
+    pthread_mutex_unlock(&serve.lock);
+    pthread_t thread;
+    if(pthread_create(&thread, 0, serve_reload_thread, args)){
+        serve_reply reply = {req.id, -1, 0, 0};
+        send_reply(conn, reply, 0, 0);
+        release_connection(conn);
+        free(args->weightfile);
+        free(args);
+        return 1;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+static void *serve_connection_thread(void *ptr)
+{
+    serve_connection *conn = ptr;
+    serve_request req;
+    while(recv_all(conn->fd, &req, sizeof(req))){
+        if(req.type == SERVE_STATS){
+            send_stats(conn, req.id);
+            continue;
+        }
+        if(req.type == SERVE_RELOAD){
+            if(!start_reload(conn, req)) break;
+            continue;
+        }
+        if(!valid_request(req)){
+            serve_reply reply = {req.id, -1, 0, 0};
+            send_reply(conn, reply, 0, 0);
+            continue;
+        }
+        serve_job *job = calloc(1, sizeof(serve_job));
+        job->conn = conn;
+        job->req = req;
+        job->start = what_time_is_it_now();
+        job->deadline = job->start + (req.max_wait_us ? req.max_wait_us : serve.max_wait_us)*.000001;
+        pthread_mutex_lock(&serve.lock);
+        ++conn->refs;
+        if(serve.tail) serve.tail->next = job;
+        else serve.head = job;
+        serve.tail = job;
+        if(++serve.queue_depth > serve.max_queue_depth) serve.max_queue_depth = serve.queue_depth;
+        pthread_cond_signal(&serve.ready);
+        pthread_mutex_unlock(&serve.lock);
+    }
+    pthread_mutex_lock(&serve.lock);
+    --serve.connections;
+    pthread_mutex_unlock(&serve.lock);
+    release_connection(conn);
+    return 0;
+}
+
+// every client gets its own frame ring, handed over with the hello message
+static serve_connection *open_connection(int fd)
+{
+    size_t size = serve.slots*serve.slot_size;
+    int memfd = memfd_create("darknet-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(memfd < 0) return 0;
+    uint8_t *ring = MAP_FAILED;
+    // sealed at its size so a client can not shrink it under our mapping
+    if(ftruncate(memfd, size) == 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0){
+        ring = mmap(0, size, PROT_READ, MAP_SHARED, memfd, 0);
+    }
+    if(ring == MAP_FAILED){
+        close(memfd);
+        return 0;
+    }
+
+    serve_model *model = acquire_model();
+    serve_hello hello = {SERVE_MAGIC, SERVE_VERSION, serve.slots, serve.slot_size, serve.max_w, serve.max_h,
+                         model->net->w, model->net->h, model->net->layers[model->net->n-1].classes};
+    release_model(model);
+    struct iovec iov = {&hello, sizeof(hello)};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    if(sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello)){
+        munmap(ring, size);
+        close(memfd);
+        return 0;
+    }
+
+    serve_connection *conn = calloc(1, sizeof(serve_connection));
+    conn->fd = fd;
+    conn->memfd = memfd;
+    conn->ring = ring;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->write_lock, 0);
+    return conn;
+}
+
+static void *serve_accept_thread(void *ptr)
+{
+    int server = *(int *)ptr;
+    while(1){
+        int fd = accept(server, 0, 0);
+        if(fd < 0) continue;
+        serve_connection *conn = open_connection(fd);
+        if(!conn){
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&serve.lock);
+        ++serve.connections;
+        pthread_mutex_unlock(&serve.lock);
+        pthread_t thread;
+        if(pthread_create(&thread, 0, serve_connection_thread, conn)){
+            release_connection(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+/*
+ * Keep one prepared network resident and answer detection requests on a Unix
+ * domain socket until killed. Frames travel through a per-client memfd ring so
+ * only the request and the detections cross the socket. One worker runs the
+ * network on batches of up to max_batch frames, holding a request back at most
+ * max_wait_us (or the request's own max_wait_us) for others to join it;
+ * connections only queue requests, answer stats requests directly and hand
+ * reloads to a loader thread.
+ */
+void serve_detector(char *cfgfile, char *weightfile, char *path, float thresh, float hier, int slots, int max_w, int max_h, int max_batch, int max_wait_us)
+{
+    if(max_batch < 1) max_batch = 1;
+    serve.model = load_serve_model(cfgfile, weightfile, max_batch);
+    serve.cfgfile = cfgfile;
+    serve.thresh = thresh;
+    serve.hier = hier;
+    serve.nms = .45;
+    serve.slots = slots;
+    serve.max_w = max_w;
+    serve.max_h = max_h;
+    serve.slot_size = (size_t)max_w*max_h*3;
+    serve.max_batch = max_batch;
+    serve.max_wait_us = max_wait_us;
+    serve.batch_stats = calloc(max_batch, sizeof(serve_batch_stats));
+    pthread_mutex_init(&serve.lock, 0);
+    pthread_mutex_init(&serve.reload_lock, 0);
+    pthread_cond_init(&serve.ready, 0);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0) error("serve: socket");
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    // only clear a socket left by an earlier server, never a regular file at that path
+    struct stat st;
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    if(bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0) error(path);
+    if(listen(server, 16) < 0) error(path);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t thread;
+    if(pthread_create(&thread, 0, serve_accept_thread, &server)) error("Thread creation failed");
+    printf("Serving %s on %s, %d slots of %dx%d, batches of up to %d within %d us\n", cfgfile, path, slots, max_w, max_h, max_batch, max_wait_us);
+    serve_job **jobs = calloc(max_batch, sizeof(serve_job *));
+    while(1) run_next_batch(jobs);
+}
+
+// client side of SERVE_RELOAD, returns the reply status
+int serve_reload(char *path, char *weightfile)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+
+    serve_hello hello;
+    struct iovec iov = {&hello, sizeof(hello)};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int ok = recvmsg(fd, &msg, MSG_WAITALL) == sizeof(hello) && hello.magic == SERVE_MAGIC;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_type == SCM_RIGHTS){
+        int memfd;
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+        close(memfd);
+    }
+
+    serve_reply reply = {0, -1, 0, 0};
+    serve_request req = {SERVE_RELOAD, 0, 0, weightfile ? strlen(weightfile) : 0, 0, 0};
+    if(ok && send_all(fd, &req, sizeof(req)) && send_all(fd, weightfile, req.w)){
+        if(recv_all(fd, &reply, sizeof(reply)) && reply.status == 0){
+            printf("%s reloaded in %.3f s\n", path, reply.latency_us/1000000.);
+        }
+    }
+    if(reply.status) fprintf(stderr, "%s: reload failed\n", path);
+    close(fd);
+    return reply.status;
+}
+
+#else
+
+int serve_reload(char *path, char *weightfile)
+{
+    fprintf(stderr, "detector reload needs Unix domain sockets, it only runs on Linux\n");
+    return -1;
+}
+
+void serve_detector(char *cfgfile, char *weightfile, char *path, float thresh, float hier, int slots, int max_w, int max_h, int max_batch, int max_wait_us)
+{
+    fprintf(stderr, "detector serve needs Unix domain sockets and memfd, it only runs on Linux\n");
+}
+
+#endif
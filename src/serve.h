@@ -0,0 +1,73 @@
+#ifndef SERVE_H
+#define SERVE_H
+#include <stdint.h>
+#include "darknet.h"
+
+/*
+ * Wire format of `detector serve`. On connect the server sends a serve_hello
+ * with a memfd attached (SCM_RIGHTS) holding `slots` frames of `slot_size`
+ * bytes. A client writes a w x h RGB (interleaved uint8) frame into a slot and
+ * sends a serve_request naming it; the slot may be reused once the reply for
+ * that request arrives. Replies are a serve_reply followed by `count`
+ * serve_detection records. SERVE_STATS is answered with a serve_stats and then
+ * max_batch serve_batch_stats, one latency histogram per batch size.
+ * SERVE_RELOAD is followed by w bytes of weights path (none reloads the current
+ * file) and answered once the new model is live, latency_us being the reload time.
+ */
+#define SERVE_MAGIC 0x56534b44
+#define SERVE_VERSION 2
+#define SERVE_HISTOGRAM_BUCKETS 24
+
+typedef enum{
+    SERVE_DETECT, SERVE_STATS, SERVE_RELOAD
+} SERVE_REQUEST;
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t max_w, max_h;
+    uint32_t net_w, net_h;
+    uint32_t classes;
+} serve_hello;
+
+typedef struct{
+    uint32_t type;
+    uint32_t id;
+    uint32_t slot;
+    uint32_t w, h;
+    uint32_t max_wait_us;
+} serve_request;
+
+typedef struct{
+    uint32_t id;
+    int32_t status;
+    uint32_t count;
+    uint32_t latency_us;
+} serve_reply;
+
+typedef struct{
+    float x, y, w, h;
+    float prob;
+    int32_t class;
+} serve_detection;
+
+typedef struct{
+    uint64_t requests;
+    uint32_t queue_depth;
+    uint32_t max_queue_depth;
+    uint32_t connections;
+    uint32_t max_batch;
+    uint32_t max_wait_us;
+    float mean_ms, p50_ms, p99_ms, max_ms;
+} serve_stats;
+
+// bucket i counts requests whose latency fell in [2^i, 2^(i+1)) microseconds
+typedef struct{
+    uint32_t batches;
+    uint32_t requests;
+    uint32_t buckets[SERVE_HISTOGRAM_BUCKETS];
+} serve_batch_stats;
+
+#endif
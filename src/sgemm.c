@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "gemm.h"
+#include "utils.h"
+#include "blas.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SGEMM_X86
+#endif
+
+/*
+ * Packed, register-blocked float gemm in the usual three-level layout: a KC deep
+ * slice of op(A) is packed into MR row panels and a KC x NC slice of op(B) into NR
+ * column panels, with ALPHA and the transposes folded into the packing so one
+ * micro-kernel serves all four variants. Panels are zero padded to full MR/NR,
+ * ragged edges go through a scratch tile.
+ */
+#define SGEMM_MR 6
+#define SGEMM_NR 16
+#define SGEMM_MC 96
+#define SGEMM_NB 256
+#define SGEMM_KC 256
+#define SGEMM_NC 4096
+
+// below this many multiply-adds packing does not pay for itself
+#define SGEMM_MIN_FLOPS (32*32*32)
+
+typedef void (*sgemm_kernel)(int K, float *a, float *b, float *c, int ldc);
+
+// portable kernel, one row of the tile at a time so the accumulator fits in vector registers
+static void sgemm_kernel_c(int K, float *a, float *b, float *c, int ldc)
+{
+    int i, j, k;
+    for(i = 0; i < SGEMM_MR; ++i){
+        float acc[SGEMM_NR] = {0};
+        for(k = 0; k < K; ++k){
+            float ai = a[k*SGEMM_MR + i];
+            for(j = 0; j < SGEMM_NR; ++j){
+                acc[j] += ai*b[k*SGEMM_NR + j];
+            }
+        }
+        for(j = 0; j < SGEMM_NR; ++j){
+            c[i*ldc + j] += acc[j];
+        }
+    }
+}
+
+#ifdef SGEMM_X86
+// 6x16 tile held in 12 ymm accumulators, one broadcast and two fmas per row per k
+#define SGEMM_ROW(i) \
+    ai = _mm256_broadcast_ss(a + i); \
+    c##i##0 = _mm256_fmadd_ps(ai, b0, c##i##0); \
+    c##i##1 = _mm256_fmadd_ps(ai, b1, c##i##1);
+
+#define SGEMM_STORE(i) \
+    _mm256_storeu_ps(c + i*ldc, _mm256_add_ps(_mm256_loadu_ps(c + i*ldc), c##i##0)); \
+    _mm256_storeu_ps(c + i*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + i*ldc + 8), c##i##1));
+
+__attribute__((target("avx2,fma")))
+static void sgemm_kernel_avx2(int K, float *a, float *b, float *c, int ldc)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    __m256 ai, b0, b1;
+    int k;
+    for(k = 0; k < K; ++k){
+        b0 = _mm256_loadu_ps(b);
+        b1 = _mm256_loadu_ps(b + 8);
+        SGEMM_ROW(0)
+        SGEMM_ROW(1)
+        SGEMM_ROW(2)
+        SGEMM_ROW(3)
+        SGEMM_ROW(4)
+        SGEMM_ROW(5)
+        a += SGEMM_MR;
+        b += SGEMM_NR;
+    }
+    SGEMM_STORE(0)
+    SGEMM_STORE(1)
+    SGEMM_STORE(2)
+    SGEMM_STORE(3)
+    SGEMM_STORE(4)
+    SGEMM_STORE(5)
+}
+#endif
+
+static sgemm_kernel select_sgemm_kernel()
+{
+    static sgemm_kernel kernel = 0;
+    if(kernel) return kernel;
+    sgemm_kernel k = sgemm_kernel_c;
+#ifdef SGEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) k = sgemm_kernel_avx2;
+#endif
+    kernel = k;
+    return kernel;
+}
+
+// op(A)[ic.., pc..] -> MR row panels, k-major
+static void sgemm_pack_a(int TA, int mc, int kc, float ALPHA, float *A, int lda, float *pa)
+{
+    int p;
+    int panels = (mc + SGEMM_MR - 1)/SGEMM_MR;
+    #pragma omp parallel for
+    for(p = 0; p < panels; ++p){
+        int i, k;
+        int i0 = p*SGEMM_MR;
+        int m = min(SGEMM_MR, mc - i0);
+        float *dst = pa + p*SGEMM_MR*kc;
+        for(k = 0; k < kc; ++k){
+            for(i = 0; i < m; ++i){
+                dst[i] = ALPHA*(TA ? A[k*lda + i0 + i] : A[(i0 + i)*lda + k]);
+            }
+            for(; i < SGEMM_MR; ++i) dst[i] = 0;
+            dst += SGEMM_MR;
+        }
+    }
+}
+
+// op(B)[pc.., jc..] -> NR column panels, k-major
+static void sgemm_pack_b(int TB, int kc, int nc, float *B, int ldb, float *pb)
+{
+    int p;
+    int panels = (nc + SGEMM_NR - 1)/SGEMM_NR;
+    #pragma omp parallel for
+    for(p = 0; p < panels; ++p){
+        int j, k;
+        int j0 = p*SGEMM_NR;
+        int n = min(SGEMM_NR, nc - j0);
+        float *dst = pb + p*SGEMM_NR*kc;
+        for(k = 0; k < kc; ++k){
+            if(!TB && n == SGEMM_NR){
+                memcpy(dst, B + k*ldb + j0, SGEMM_NR*sizeof(float));
+            }else{
+                for(j = 0; j < n; ++j){
+                    dst[j] = TB ? B[(j0 + j)*ldb + k] : B[k*ldb + j0 + j];
+                }
+                for(; j < SGEMM_NR; ++j) dst[j] = 0;
+            }
+            dst += SGEMM_NR;
+        }
+    }
+}
+
+// C[MC x NB block] += packed A rows * packed B columns
+static void sgemm_block(sgemm_kernel kernel, int kc, int m, int n,
+        float *pa, float *pb, float *C, int ldc)
+{
+    int ir, jr, i, j;
+    float tile[SGEMM_MR*SGEMM_NR];
+    for(jr = 0; jr < n; jr += SGEMM_NR){
+        int nr = min(SGEMM_NR, n - jr);
+        for(ir = 0; ir < m; ir += SGEMM_MR){
+            int mr = min(SGEMM_MR, m - ir);
+            float *a = pa + ir*kc;
+            float *b = pb + jr*kc;
+            float *c = C + ir*ldc + jr;
+            if(mr == SGEMM_MR && nr == SGEMM_NR){
+                kernel(kc, a, b, c, ldc);
+                continue;
+            }
+            memset(tile, 0, sizeof(tile));
+            kernel(kc, a, b, tile, SGEMM_NR);
+            for(i = 0; i < mr; ++i){
+                for(j = 0; j < nr; ++j){
+                    c[i*ldc + j] += tile[i*SGEMM_NR + j];
+                }
+            }
+        }
+    }
+}
+
+void gemm_cpu_blocked(int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float *C, int ldc)
+{
+    int pc, jc;
+    sgemm_kernel kernel = select_sgemm_kernel();
+    int mpad = (M + SGEMM_MR - 1)/SGEMM_MR*SGEMM_MR;
+    int npad = (min(N, SGEMM_NC) + SGEMM_NR - 1)/SGEMM_NR*SGEMM_NR;
+    int kcmax = min(K, SGEMM_KC);
+    float *pa = calloc(mpad*kcmax, sizeof(float));
+    float *pb = calloc(npad*kcmax, sizeof(float));
+    int mblocks = (M + SGEMM_MC - 1)/SGEMM_MC;
+
+    for(pc = 0; pc < K; pc += SGEMM_KC){
+        int kc = min(SGEMM_KC, K - pc);
+        sgemm_pack_a(TA, M, kc, ALPHA, TA ? A + pc*lda : A + pc, lda, pa);
+        for(jc = 0; jc < N; jc += SGEMM_NC){
+            int nc = min(SGEMM_NC, N - jc);
+            int nblocks = (nc + SGEMM_NB - 1)/SGEMM_NB;
+            int t;
+            sgemm_pack_b(TB, kc, nc, TB ? B + jc*ldb + pc : B + pc*ldb + jc, ldb, pb);
+            // every (MC x NB) block of C is independent, threads split them evenly
+            #pragma omp parallel for schedule(static)
+            for(t = 0; t < mblocks*nblocks; ++t){
+                int ic = (t / nblocks)*SGEMM_MC;
+                int jb = (t % nblocks)*SGEMM_NB;
+                sgemm_block(kernel, kc, min(SGEMM_MC, M - ic), min(SGEMM_NB, nc - jb),
+                        pa + ic*kc, pb + jb*kc, C + ic*ldc + jc + jb, ldc);
+            }
+        }
+    }
+    free(pa);
+    free(pb);
+}
+
+int use_blocked_gemm(int M, int N, int K)
+{
+    return (double)M*N*K >= SGEMM_MIN_FLOPS;
+}
+
+static float max_gemm_error(float *a, float *b, int n)
+{
+    int i;
+    float err = 0;
+    for(i = 0; i < n; ++i){
+        float e = fabs(a[i] - b[i])/(fabs(b[i]) + 1);
+        if(e > err) err = e;
+    }
+    return err;
+}
+
+// float sums in another order, the relative error of a correct kernel stays well below this
+#define GEMM_TEST_TOLERANCE 1e-5
+
+// blocked gemm against the scalar loops, then timed on conv-sized shapes; returns the number of failed cases
+int test_cpu_gemm()
+{
+    int sizes[][3] = {{1,1,1}, {7,13,5}, {17,10,10}, {6,16,256}, {33,47,257}, {100,1000,75}, {97,4099,31}};
+    int shapes[][3] = {{16,173056,27}, {64,10816,288}, {256,676,1152}, {1024,169,4608}};
+    int TA, TB, s;
+    int failed = 0;
+    srand(0);
+    printf("sgemm kernel: %s\n", select_sgemm_kernel() == sgemm_kernel_c ? "c" : "avx2+fma");
+    for(s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s){
+        int m = sizes[s][0], n = sizes[s][1], k = sizes[s][2];
+        for(TA = 0; TA < 2; ++TA){
+            for(TB = 0; TB < 2; ++TB){
+                float *a = random_matrix(m, k);
+                float *b = random_matrix(k, n);
+                float *c = random_matrix(m, n);
+                float *c_ref = calloc(m*n, sizeof(float));
+                memcpy(c_ref, c, m*n*sizeof(float));
+                int lda = TA ? m : k;
+                int ldb = TB ? k : n;
+                gemm_cpu_blocked(TA, TB, m, n, k, .5, a, lda, b, ldb, c, n);
+                gemm_cpu_reference(TA, TB, m, n, k, .5, a, lda, b, ldb, c_ref, n);
+                float err = max_gemm_error(c, c_ref, m*n);
+                printf("%5d x %5d x %5d, TA=%d, TB=%d: max rel error %g%s\n", m, n, k, TA, TB, err, err > GEMM_TEST_TOLERANCE ? " FAILED" : "");
+                if(err > GEMM_TEST_TOLERANCE) ++failed;
+                free(a);
+                free(b);
+                free(c);
+                free(c_ref);
+            }
+        }
+    }
+    for(s = 0; s < sizeof(shapes)/sizeof(shapes[0]); ++s){
+        int m = shapes[s][0], n = shapes[s][1], k = shapes[s][2];
+        float *a = random_matrix(m, k);
+        float *b = random_matrix(k, n);
+        float *c = calloc(m*n, sizeof(float));
+        double t = what_time_is_it_now();
+        gemm_cpu_reference(0, 0, m, n, k, 1, a, k, b, n, c, n);
+        double reference = what_time_is_it_now() - t;
+        t = what_time_is_it_now();
+        gemm_cpu_blocked(0, 0, m, n, k, 1, a, k, b, n, c, n);
+        double blocked = what_time_is_it_now() - t;
+        printf("%5d x %6d x %5d: reference %.1f ms, blocked %.1f ms, %.1f GFLOPS\n", m, n, k,
+                reference*1000, blocked*1000, 2.*m*n*k/blocked/1e9);
+        free(a);
+        free(b);
+        free(c);
+    }
+    if(failed) printf("%d cases above the %g tolerance\n", failed, GEMM_TEST_TOLERANCE);
+    return failed;
+}
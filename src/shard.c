@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard.h"
+#include "data.h"
+#include "image.h"
+#include "augment.h"
+#include "utils.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHARD_MAGIC 0x44524853
+#define SHARD_VERSION 1
+#define SHARD_ALIGN 4096
+
+/*
+ * Shard layout: header, one fixed record per image, pixels at a page boundary
+ * as max_w*max_h*3 bytes per image (interleaved rgb, only w*h*3 used), then the
+ * boxes of every image back to back. Offsets are from the start of the file.
+ */
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t max_w;
+    uint32_t max_h;
+    uint32_t reserved;
+    uint64_t nboxes;
+    uint64_t records;
+    uint64_t pixels;
+    uint64_t boxes;
+    uint64_t record_size;
+} shard_header;
+
+typedef struct{
+    uint16_t w, h;
+    uint32_t nboxes;
+    uint64_t first_box;
+} shard_record;
+
+typedef struct{
+    int32_t id;
+    float x, y, w, h;
+} shard_box;
+
+typedef struct{
+    unsigned char *base;
+    size_t size;
+    shard_header *h;
+    int start;
+} shard_file;
+
+struct shard_set{
+    int n;
+    int count;
+    shard_file *files;
+};
+
+static uint64_t align_up(uint64_t x, uint64_t a)
+{
+    return (x + a - 1)/a*a;
+}
+
+static void pack_shard(char *filename, char **paths, int n, int size)
+{
+    int i;
+    shard_record *records = calloc(n, sizeof(shard_record));
+    box_label **labels = calloc(n, sizeof(box_label *));
+    uint64_t nboxes = 0;
+    for(i = 0; i < n; ++i){
+        char labelpath[4096];
+        int count = 0;
+        detection_label_path(paths[i], labelpath);
+        labels[i] = read_boxes(labelpath, &count);
+        records[i].nboxes = count;
+        records[i].first_box = nboxes;
+        nboxes += count;
+    }
+
+    shard_header h = {0};
+    h.magic = SHARD_MAGIC;
+    h.version = SHARD_VERSION;
+    h.count = n;
+    h.max_w = size;
+    h.max_h = size;
+    h.nboxes = nboxes;
+    h.records = sizeof(shard_header);
+    h.pixels = align_up(h.records + n*sizeof(shard_record), SHARD_ALIGN);
+    h.record_size = (uint64_t)size*size*3;
+    h.boxes = align_up(h.pixels + n*h.record_size, sizeof(uint64_t));
+    size_t bytes = h.boxes + nboxes*sizeof(shard_box);
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, bytes)) file_error(filename);
+    unsigned char *base = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED) file_error(filename);
+    close(fd);
+
+    shard_box *boxes = (shard_box *)(base + h.boxes);
+    for(i = 0; i < n; ++i){
+        int j;
+        for(j = 0; j < records[i].nboxes; ++j){
+            box_label b = labels[i][j];
+            shard_box s = {b.id, b.x, b.y, b.w, b.h};
+            boxes[records[i].first_box + j] = s;
+        }
+        free(labels[i]);
+    }
+
+    // decoding dominates, images are independent and land in their own records
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < n; ++i){
+        int x, y, c;
+        image im = load_image_color(paths[i], 0, 0);
+        if(im.w > size || im.h > size){
+            float scale = (float)size/(im.w > im.h ? im.w : im.h);
+            int w = constrain_int(roundf(im.w*scale), 1, size);
+            int hh = constrain_int(roundf(im.h*scale), 1, size);
+            image resized = resize_image(im, w, hh);
+            free_image(im);
+            im = resized;
+        }
+        unsigned char *pixels = base + h.pixels + i*h.record_size;
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                for(c = 0; c < 3; ++c){
+                    float val = im.data[c*im.h*im.w + y*im.w + x];
+                    pixels[(y*im.w + x)*3 + c] = constrain_int(roundf(val*255), 0, 255);
+                }
+            }
+        }
+        records[i].w = im.w;
+        records[i].h = im.h;
+        free_image(im);
+    }
+
+    memcpy(base, &h, sizeof(h));
+    memcpy(base + h.records, records, n*sizeof(shard_record));
+    if(munmap(base, bytes)) file_error(filename);
+    free(records);
+    free(labels);
+}
+
+/*
+ * Decodes the train list once into shards of up to per_shard images, the longest
+ * side capped at size, and writes <prefix>.shards listing them for the shards=
+ * key of the data cfg.
+ */
+void pack_detector(char *datacfg, char *outprefix, int size, int per_shard)
+{
+    list *options = read_data_cfg(datacfg);
+    char *train_images = option_find_str(options, "train", "data/train.list");
+    char *prefix = outprefix ? outprefix : "train";
+    list *plist = get_paths(train_images);
+    char **paths = (char **)list_to_array(plist);
+    int n = plist->size;
+    int start;
+    char buff[4096];
+
+    if(size < 1 || size > 65535) error("pack: size must be in 1..65535");
+    if(per_shard < 1) per_shard = n;
+    sprintf(buff, "%s.shards", prefix);
+    FILE *fp = fopen(buff, "w");
+    if(!fp) file_error(buff);
+
+    double time = what_time_is_it_now();
+    for(start = 0; start < n; start += per_shard){
+        int count = (n - start < per_shard) ? n - start : per_shard;
+        sprintf(buff, "%s.%d.shard", prefix, start/per_shard);
+        pack_shard(buff, paths + start, count, size);
+        fprintf(fp, "%s\n", buff);
+        fprintf(stderr, "%s: %d images, %d/%d\n", buff, count, start + count, n);
+    }
+    fclose(fp);
+    fprintf(stderr, "Packed %d images in %lf seconds, add shards=%s.shards to %s\n", n, what_time_is_it_now() - time, prefix, datacfg);
+
+    free_ptrs((void **)paths, n);
+    free_list(plist);
+    free_list(options);
+}
+
+shard_set *open_shards(char *filename)
+{
+    int i;
+    list *plist = get_paths(filename);
+    char **paths = (char **)list_to_array(plist);
+    shard_set *s = calloc(1, sizeof(shard_set));
+    s->n = plist->size;
+    s->files = calloc(s->n, sizeof(shard_file));
+    for(i = 0; i < s->n; ++i){
+        shard_file *f = s->files + i;
+        struct stat st;
+        int fd = open(paths[i], O_RDONLY);
+        if(fd < 0 || fstat(fd, &st)) file_error(paths[i]);
+        f->size = st.st_size;
+        if(f->size < sizeof(shard_header)) error("shard: truncated file");
+        f->base = mmap(0, f->size, PROT_READ, MAP_SHARED, fd, 0);
+        if(f->base == MAP_FAILED) file_error(paths[i]);
+        close(fd);
+        // batches sample records at random, readahead would only evict them
+        madvise(f->base, f->size, MADV_RANDOM);
+        f->h = (shard_header *)f->base;
+        if(f->h->magic != SHARD_MAGIC || f->h->version != SHARD_VERSION) error("shard: bad magic or version");
+        if(f->h->boxes + f->h->nboxes*sizeof(shard_box) > f->size) error("shard: truncated file");
+        f->start = s->count;
+        s->count += f->h->count;
+    }
+    fprintf(stderr, "%d images in %d shards\n", s->count, s->n);
+    free_ptrs((void **)paths, plist->size);
+    free_list(plist);
+    return s;
+}
+
+int shard_set_size(shard_set *s)
+{
+    return s->count;
+}
+
+void close_shards(shard_set *s)
+{
+    int i;
+    if(!s) return;
+    for(i = 0; i < s->n; ++i) munmap(s->files[i].base, s->files[i].size);
+    free(s->files);
+    free(s);
+}
+
+static shard_file *find_shard(shard_set *s, int index)
+{
+    int lo = 0, hi = s->n - 1;
+    while(lo < hi){
+        int mid = (lo + hi + 1)/2;
+        if(s->files[mid].start <= index) lo = mid;
+        else hi = mid - 1;
+    }
+    return s->files + lo;
+}
+
+// load_image_detection for record index of the set, sampling the 8-bit pixels in place
+void load_shard_detection(shard_set *s, int index, int w, int h, int boxes, float jitter, float hue, float saturation, float exposure, float *X, float *truth)
+{
+    int i;
+    shard_file *f = find_shard(s, index);
+    index -= f->start;
+    shard_record *r = (shard_record *)(f->base + f->h->records) + index;
+    unsigned char *pixels = f->base + f->h->pixels + index*f->h->record_size;
+    shard_box *b = (shard_box *)(f->base + f->h->boxes) + r->first_box;
+
+    image sized = float_to_image(w, h, 3, X);
+    fill_image(sized, .5);
+
+    float nw, nh, dx, dy;
+    random_detection_placement(r->w, r->h, w, h, jitter, &nw, &nh, &dx, &dy);
+
+    float dhue = rand_uniform(-hue, hue);
+    float dsat = rand_scale(saturation);
+    float dexp = rand_scale(exposure);
+    int flip = rand()%2;
+
+    place_image_uint8(pixels, r->w, r->h, nw, nh, dx, dy, flip, sized);
+    distort_image_rgb(sized, dhue, dsat, dexp);
+
+    box_label *labels = calloc(r->nboxes, sizeof(box_label));
+    for(i = 0; i < r->nboxes; ++i){
+        labels[i].id = b[i].id;
+        labels[i].x = b[i].x;
+        labels[i].y = b[i].y;
+        labels[i].w = b[i].w;
+        labels[i].h = b[i].h;
+        labels[i].left   = b[i].x - b[i].w/2;
+        labels[i].right  = b[i].x + b[i].w/2;
+        labels[i].top    = b[i].y - b[i].h/2;
+        labels[i].bottom = b[i].y + b[i].h/2;
+    }
+    fill_truth_detection_boxes(labels, r->nboxes, boxes, truth, flip, -dx/w, -dy/h, nw/w, nh/h);
+    free(labels);
+}
+
+#else
+
+void pack_detector(char *datacfg, char *outprefix, int size, int per_shard)
+{
+    fprintf(stderr, "detector pack needs mmap, it only runs on Linux\n");
+}
+
+shard_set *open_shards(char *filename)
+{
+    error("shards need mmap, they only load on Linux");
+    return 0;
+}
+
+int shard_set_size(shard_set *s)
+{
+    return 0;
+}
+
+void close_shards(shard_set *s)
+{
+}
+
+void load_shard_detection(shard_set *s, int index, int w, int h, int boxes, float jitter, float hue, float saturation, float exposure, float *X, float *truth)
+{
+    error("shards need mmap, they only load on Linux");
+}
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef SHARD_H
+#define SHARD_H
+#include "darknet.h"
+
+void load_shard_detection(shard_set *s, int index, int w, int h, int boxes, float jitter, float hue, float saturation, float exposure, float *X, float *truth);
+
+#endif
@@ -5,8 +5,12 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 
-layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int h2, int c2)
+// inputs are scaled up by 2^SHORTCUT_LEFT_SHIFT before rescaling so the multipliers keep their precision
+#define SHORTCUT_LEFT_SHIFT 20
+
+layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int h2, int c2, int layer_quant_flag, int quant_stop_flag, int close_quantization)
 {
     printf("res  %3d                %4d x%4d x%4d   ->  %4d x%4d x%4d\n",index, w2,h2,c2, w,h,c);
     layer l = {0};
@@ -28,6 +32,27 @@ layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int
 
     l.forward = forward_shortcut_layer;
     l.backward = backward_shortcut_layer;
+    l.close_quantization = close_quantization;
+#ifdef QUANTIZATION
+    l.activ_data_uint8_scales = calloc(1, sizeof(float));
+    l.activ_data_uint8_zero_point = calloc(1, sizeof(uint8_t));
+    l.min_activ_value = calloc(1, sizeof(float));
+    l.max_activ_value = calloc(1, sizeof(float));
+    l.output_uint8_final = calloc(l.batch*l.outputs, sizeof(uint8_t));
+    // [0] is the previous layer, [1] the layer named by from, M*[2] the output rescale
+    l.input_data_uint8_scales = calloc(2, sizeof(float));
+    l.input_data_uint8_zero_point = calloc(2, sizeof(uint8_t));
+    l.M = calloc(3, sizeof(float));
+    l.M0 = calloc(3, sizeof(int32_t));
+    l.M0_right_shift = calloc(3, sizeof(int));
+
+    l.layer_quant_flag = layer_quant_flag;
+    l.quant_stop_flag = quant_stop_flag;
+    if(l.layer_quant_flag && !l.close_quantization){
+        l.forward = forward_shortcut_layer_quant;
+    }
+    if(l.layer_quant_flag) l.forward_qat = forward_shortcut_layer_qat;
+#endif
     #ifdef GPU
     l.forward_gpu = forward_shortcut_layer_gpu;
     l.backward_gpu = backward_shortcut_layer_gpu;
@@ -46,16 +71,9 @@ void resize_shortcut_layer(layer *l, int w, int h)
     l->h = l->out_h = h;
     l->outputs = w*h*l->out_c;
     l->inputs = l->outputs;
-    l->delta =  realloc(l->delta, l->outputs*l->batch*sizeof(float));
-    l->output = realloc(l->output, l->outputs*l->batch*sizeof(float));
+    // output and delta are the previous layer's (see parse_network_cfg), resize_network re-points them
+    if(l->output_uint8_final) l->output_uint8_final = realloc(l->output_uint8_final, l->outputs*l->batch*sizeof(uint8_t));
 
-#ifdef GPU
-    cuda_free(l->output_gpu);
-    cuda_free(l->delta_gpu);
-    l->output_gpu  = cuda_make_array(l->output, l->outputs*l->batch);
-    l->delta_gpu   = cuda_make_array(l->delta,  l->outputs*l->batch);
-#endif
-    
 }
 
 
@@ -66,6 +84,121 @@ void forward_shortcut_layer(const layer l, network net)
     activate_array(l.output, l.outputs*l.batch, l.activation);
 }
 
+void forward_shortcut_layer_qat(const layer l, network net)
+{
+    forward_shortcut_layer(l, net);
+    fake_quant_layer_output(l, net);
+}
+
+#ifdef QUANTIZATION
+/*
+ * Rescale multipliers for adding two uint8 tensors with their own scales. Both
+ * inputs go to a common scale of twice the larger one, which keeps M[0] and M[1]
+ * at most 1/2, then M[2] maps the sum to the output scale.
+ */
+void quantize_shortcut_layer(network *net, int index)
+{
+    int k;
+    layer *l = &net->layers[index];
+    layer in = net->layers[index - 1];
+    layer from = net->layers[l->index];
+    assert(l->alpha > 0 && l->beta > 0);
+    assert(l->activ_data_uint8_scales[0] != 0);
+    l->input_data_uint8_scales[0] = in.activ_data_uint8_scales[0];
+    l->input_data_uint8_zero_point[0] = in.activ_data_uint8_zero_point[0];
+    l->input_data_uint8_scales[1] = from.activ_data_uint8_scales[0];
+    l->input_data_uint8_zero_point[1] = from.activ_data_uint8_zero_point[0];
+    float scale_in = l->alpha*l->input_data_uint8_scales[0];
+    float scale_from = l->beta*l->input_data_uint8_scales[1];
+    float twice_max = 2*(scale_in > scale_from ? scale_in : scale_from);
+    l->M[0] = scale_in/twice_max;
+    l->M[1] = scale_from/twice_max;
+    l->M[2] = twice_max/((1 << SHORTCUT_LEFT_SHIFT)*l->activ_data_uint8_scales[0]);
+    for(k = 0; k < 3; ++k){
+        quant_multi_smaller_than_one_to_scale_and_shift(l->M[k], &l->M0[k], &l->M0_right_shift[k]);
+    }
+    printf("layer:  %2d, type:  [%5s], input quant scale:   %f, from quant scale:     %f, activ quant scale: %f\n", l->count, "RES", l->input_data_uint8_scales[0], l->input_data_uint8_scales[1], l->activ_data_uint8_scales[0]);
+    printf("----------------------------\n");
+}
+
+// round(x*M0*2^-(31 + shift)) in integer arithmetic
+static inline int32_t shortcut_rescale(int32_t x, int32_t multiplier, int shift)
+{
+    int total = 31 + shift;
+    int64_t product = (int64_t)x*multiplier;
+    return (int32_t)((product + ((int64_t)1 << (total - 1))) >> total);
+}
+
+static inline int32_t shortcut_scaled_input(layer l, int k, uint8_t q)
+{
+    int32_t x = ((int32_t)q - l.input_data_uint8_zero_point[k]) << SHORTCUT_LEFT_SHIFT;
+    return shortcut_rescale(x, l.M0[k], l.M0_right_shift[k]);
+}
+
+static inline uint8_t shortcut_requant(layer l, int32_t sum)
+{
+    int32_t q = shortcut_rescale(sum, l.M0[2], l.M0_right_shift[2]);
+    switch(l.activation){
+        case LEAKY:
+            q = q < 0 ? round(q*0.1) : q;
+            break;
+        case RELU:
+        case RELU6:
+            q = q < 0 ? 0 : q;
+            break;
+        default:
+            break;
+    }
+    return clamp(q + l.activ_data_uint8_zero_point[0], QUANT_NEGATIVE_LIMIT, QUANT_POSITIVE_LIMIT);
+}
+
+/*
+ * uint8 counterpart of forward_shortcut_layer with the same broadcast as shortcut_cpu.
+ * alpha is folded into the input multiplier, so unlike the float path it also
+ * scales the channels the from layer does not cover.
+ */
+void forward_shortcut_layer_quant(const layer l, network net)
+{
+    int i, j, k, b, s;
+    uint8_t *in = net.input_uint8;
+    uint8_t *add = net.layers[l.index].output_uint8_final;
+    if(l.w == l.out_w && l.h == l.out_h && l.c == l.out_c){
+        #pragma omp parallel for
+        for(s = 0; s < l.outputs*l.batch; ++s){
+            l.output_uint8_final[s] = shortcut_requant(l, shortcut_scaled_input(l, 0, in[s]) + shortcut_scaled_input(l, 1, add[s]));
+        }
+    }else{
+        int stride = l.w/l.out_w;
+        int sample = l.out_w/l.w;
+        if(stride < 1) stride = 1;
+        if(sample < 1) sample = 1;
+        int minw = (l.w < l.out_w) ? l.w : l.out_w;
+        int minh = (l.h < l.out_h) ? l.h : l.out_h;
+        int minc = (l.c < l.out_c) ? l.c : l.out_c;
+        for(s = 0; s < l.outputs*l.batch; ++s){
+            l.output_uint8_final[s] = shortcut_requant(l, shortcut_scaled_input(l, 0, in[s]));
+        }
+        for(b = 0; b < l.batch; ++b){
+            for(k = 0; k < minc; ++k){
+                for(j = 0; j < minh; ++j){
+                    for(i = 0; i < minw; ++i){
+                        int out_index = i*sample + l.out_w*(j*sample + l.out_h*(k + l.out_c*b));
+                        int add_index = i*stride + l.w*(j*stride + l.h*(k + l.c*b));
+                        l.output_uint8_final[out_index] = shortcut_requant(l, shortcut_scaled_input(l, 0, in[out_index]) + shortcut_scaled_input(l, 1, add[add_index]));
+                    }
+                }
+            }
+        }
+    }
+    if(l.quant_stop_flag){
+        #pragma omp parallel for
+        for(s = 0; s < l.outputs*l.batch; ++s){
+            l.output[s] = (l.output_uint8_final[s] - l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
+        }
+    }
+}
+#endif
+
 void backward_shortcut_layer(const layer l, network net)
 {
     gradient_array(l.output, l.outputs*l.batch, l.activation, l.delta);
@@ -79,6 +212,18 @@ void forward_shortcut_layer_gpu(const layer l, network net)
     copy_gpu(l.outputs*l.batch, net.input_gpu, 1, l.output_gpu, 1);
     shortcut_gpu(l.batch, l.w, l.h, l.c, net.layers[l.index].output_gpu, l.out_w, l.out_h, l.out_c, l.alpha, l.beta, l.output_gpu);
     activate_array_gpu(l.output_gpu, l.outputs*l.batch, l.activation);
+#ifdef QUANTIZATION
+    int step = *net.seen;
+    int quant_step = 10000;
+    if(net.train && l.layer_quant_flag && step > quant_step){
+        cuda_pull_array(l.output_gpu, l.output, l.out_c*l.out_w*l.out_h);
+        uint8_t input_fake_quant = 0;
+        fake_quant_with_min_max_channel(1, l.output, &input_fake_quant, l.out_c*l.out_w*l.out_h, l.min_activ_value, l.max_activ_value, 
+                                        l.activ_data_uint8_scales, l.activ_data_uint8_zero_point, ACTIV_QUANT, 0.999);
+        assert(l.activ_data_uint8_scales[0] > 0);
+        cuda_push_array(l.output_gpu, l.output, l.out_c*l.out_w*l.out_h);
+    }
+#endif
 }
 
 void backward_shortcut_layer_gpu(const layer l, network net)
@@ -4,8 +4,11 @@
 #include "layer.h"
 #include "network.h"
 
-layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int h2, int c2);
+layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int h2, int c2, int layer_quant_flag, int quant_stop_flag, int close_quantization);
 void forward_shortcut_layer(const layer l, network net);
+void forward_shortcut_layer_qat(const layer l, network net);
+void forward_shortcut_layer_quant(const layer l, network net);
+void quantize_shortcut_layer(network *net, int index);
 void backward_shortcut_layer(const layer l, network net);
 void resize_shortcut_layer(layer *l, int w, int h);
 
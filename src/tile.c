@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tile.h"
+#include "network.h"
+#include "image.h"
+#include "blas.h"
+#include "utils.h"
+
+// boxes this close (in pixels) to a seam that another tile covers are partial views
+#define TILE_SEAM_MARGIN 2
+
+static int tile_count(int size, int tile, float overlap)
+{
+    if(size <= tile) return 1;
+    int stride = max(1, (int)(tile*(1 - overlap)));
+    return (size - tile + stride - 1)/stride + 1;
+}
+
+// evenly spaced tile origins covering the image, centered when it is smaller than a tile
+image_tile *make_image_tiles(int w, int h, int tile_w, int tile_h, float overlap, int *n)
+{
+    int nx = tile_count(w, tile_w, overlap);
+    int ny = tile_count(h, tile_h, overlap);
+    image_tile *tiles = calloc(nx*ny, sizeof(image_tile));
+    int i, j;
+    for(j = 0; j < ny; ++j){
+        for(i = 0; i < nx; ++i){
+            image_tile *t = &tiles[j*nx + i];
+            t->x = nx == 1 ? (w - tile_w)/2 : i*(w - tile_w)/(nx - 1);
+            t->y = ny == 1 ? (h - tile_h)/2 : j*(h - tile_h)/(ny - 1);
+            t->w = tile_w;
+            t->h = tile_h;
+        }
+    }
+    *n = nx*ny;
+    return tiles;
+}
+
+// crop straight into batch slot b, as uint8 for a quantized first layer or float otherwise
+void load_image_tile(network *net, image im, image_tile t, int b)
+{
+    layer l = net->layers[0];
+    int quantized = l.layer_quant_flag && !l.close_quantization;
+    float scale = quantized ? l.input_data_uint8_scales[0] : 1;
+    int zero_point = quantized ? l.input_data_uint8_zero_point[0] : 0;
+    int i, j, k;
+    for(k = 0; k < net->c; ++k){
+        for(j = 0; j < t.h; ++j){
+            int y = constrain_int(t.y + j, 0, im.h - 1);
+            for(i = 0; i < t.w; ++i){
+                int x = constrain_int(t.x + i, 0, im.w - 1);
+                float val = im.data[(k*im.h + y)*im.w + x];
+                int index = b*net->inputs + (k*t.h + j)*t.w + i;
+                if(quantized) net->input_uint8[index] = clamp(round(val/scale) + zero_point, QUANT_NEGATIVE_LIMIT, QUANT_POSITIVE_LIMIT);
+                else net->input[index] = val;
+            }
+        }
+    }
+}
+
+static int touches_seam(box b, image_tile t, int w, int h)
+{
+    float left = (b.x - b.w/2)*t.w;
+    float right = (b.x + b.w/2)*t.w;
+    float top = (b.y - b.h/2)*t.h;
+    float bottom = (b.y + b.h/2)*t.h;
+    if(t.x > 0 && left < TILE_SEAM_MARGIN) return 1;
+    if(t.y > 0 && top < TILE_SEAM_MARGIN) return 1;
+    if(t.x + t.w < w && right > t.w - TILE_SEAM_MARGIN) return 1;
+    if(t.y + t.h < h && bottom > t.h - TILE_SEAM_MARGIN) return 1;
+    return 0;
+}
+
+/*
+ * Detect on an image larger than the network input by cutting it into overlapping
+ * net-sized tiles plus one letterboxed view of the whole frame for objects bigger
+ * than a tile, all run as a single batched forward. Tile boxes cut off by a seam
+ * that a neighbouring tile covers are dropped, the rest are mapped back to image
+ * coordinates and merged with NMS. Quantization must already be prepared; the
+ * network is left at the tile batch size so repeated calls do not reallocate.
+ */
+detection *network_detect_tiled(network *net, image im, float overlap, float thresh, float hier, float nms, int *num)
+{
+    int ntiles, i, j;
+    image_tile *tiles = make_image_tiles(im.w, im.h, net->w, net->h, overlap, &ntiles);
+    int full = (im.w > net->w || im.h > net->h);
+    resize_network_batch(net, ntiles + full);
+
+    #pragma omp parallel for
+    for(i = 0; i < ntiles; ++i){
+        load_image_tile(net, im, tiles[i], i);
+    }
+    if(full){
+        image sized = letterbox_image(im, net->w, net->h);
+        image_tile whole = {0, 0, net->w, net->h};
+        load_image_tile(net, sized, whole, ntiles);
+        free_image(sized);
+    }
+    network_predict(net, net->input);
+
+    int total = 0;
+    detection **tile_dets = calloc(ntiles + full, sizeof(detection *));
+    int *tile_num = calloc(ntiles + full, sizeof(int));
+    for(i = 0; i < ntiles; ++i){
+        image_tile t = tiles[i];
+        detection *dets = get_network_boxes_batch(net, i, t.w, t.h, thresh, hier, 0, 1, &tile_num[i]);
+        int kept = 0;
+        for(j = 0; j < tile_num[i]; ++j){
+            box b = dets[j].bbox;
+            if(touches_seam(b, t, im.w, im.h)){
+                free(dets[j].prob);
+                if(dets[j].mask) free(dets[j].mask);
+                continue;
+            }
+            dets[j].bbox.x = (b.x*t.w + t.x)/im.w;
+            dets[j].bbox.y = (b.y*t.h + t.y)/im.h;
+            dets[j].bbox.w = b.w*t.w/im.w;
+            dets[j].bbox.h = b.h*t.h/im.h;
+            dets[kept++] = dets[j];
+        }
+        tile_num[i] = kept;
+        tile_dets[i] = dets;
+        total += kept;
+    }
+    if(full){
+        tile_dets[ntiles] = get_network_boxes_batch(net, ntiles, im.w, im.h, thresh, hier, 0, 1, &tile_num[ntiles]);
+        total += tile_num[ntiles];
+    }
+
+    detection *dets = calloc(total, sizeof(detection));
+    int offset = 0;
+    for(i = 0; i < ntiles + full; ++i){
+        memcpy(dets + offset, tile_dets[i], tile_num[i]*sizeof(detection));
+        offset += tile_num[i];
+        free(tile_dets[i]);
+    }
+    layer l = net->layers[net->n - 1];
+    if(nms) do_nms_sort(dets, total, l.classes, nms);
+    free(tile_dets);
+    free(tile_num);
+    free(tiles);
+    *num = total;
+    return dets;
+}
+
+static int same_detection(detection a, detection b)
+{
+    return fabs(a.bbox.x - b.bbox.x) < 1e-5 && fabs(a.bbox.y - b.bbox.y) < 1e-5 &&
+           fabs(a.bbox.w - b.bbox.w) < 1e-5 && fabs(a.bbox.h - b.bbox.h) < 1e-5 &&
+           fabs(a.objectness - b.objectness) < 1e-5;
+}
+
+static int find_detection(detection d, detection *dets, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        if(same_detection(d, dets[i])) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Check network_detect_tiled against batch 1 forwards on an image larger than the
+ * network. With nms off every tiled box has to be a box its tile gives when run on
+ * its own, mapped to image coordinates, or one of the untiled letterboxed frame's,
+ * and every untiled box has to be there. Returns the number of boxes that differ.
+ */
+int test_detect_tiled(network *net, image im, float overlap, float thresh, float hier)
+{
+    int ntiles, i, j;
+    int nref = 0, nuntiled = 0, ntiled = 0, bad = 0;
+    image_tile *tiles = make_image_tiles(im.w, im.h, net->w, net->h, overlap, &ntiles);
+    image_tile whole = {0, 0, net->w, net->h};
+    detection *ref = 0;
+    resize_network_batch(net, 1);
+    for(i = 0; i < ntiles; ++i){
+        image_tile t = tiles[i];
+        int num = 0;
+        load_image_tile(net, im, t, 0);
+        network_predict(net, net->input);
+        detection *dets = get_network_boxes(net, t.w, t.h, thresh, hier, 0, 1, &num);
+        ref = realloc(ref, (nref + num)*sizeof(detection));
+        for(j = 0; j < num; ++j){
+            box b = dets[j].bbox;
+            dets[j].bbox.x = (b.x*t.w + t.x)/im.w;
+            dets[j].bbox.y = (b.y*t.h + t.y)/im.h;
+            dets[j].bbox.w = b.w*t.w/im.w;
+            dets[j].bbox.h = b.h*t.h/im.h;
+            ref[nref++] = dets[j];
+        }
+        free(dets);
+    }
+    image sized = letterbox_image(im, net->w, net->h);
+    load_image_tile(net, sized, whole, 0);
+    network_predict(net, net->input);
+    detection *untiled = get_network_boxes(net, im.w, im.h, thresh, hier, 0, 1, &nuntiled);
+    detection *tiled = network_detect_tiled(net, im, overlap, thresh, hier, 0, &ntiled);
+
+    for(i = 0; i < ntiled; ++i){
+        if(!find_detection(tiled[i], ref, nref) && !find_detection(tiled[i], untiled, nuntiled)) ++bad;
+    }
+    for(i = 0; i < nuntiled; ++i){
+        if(!find_detection(untiled[i], tiled, ntiled)) ++bad;
+    }
+    printf("%dx%d image, %d tiles: %d tiled boxes, %d untiled boxes, %d differ\n", im.w, im.h, ntiles, ntiled, nuntiled, bad);
+    free_detections(ref, nref);
+    free_detections(untiled, nuntiled);
+    free_detections(tiled, ntiled);
+    free_image(sized);
+    free(tiles);
+    return bad;
+}
@@ -0,0 +1,13 @@
+#ifndef TILE_H
+#define TILE_H
+#include "darknet.h"
+
+typedef struct{
+    int x, y;
+    int w, h;
+} image_tile;
+
+image_tile *make_image_tiles(int w, int h, int tile_w, int tile_h, float overlap, int *n);
+void load_image_tile(network *net, image im, image_tile t, int b);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tune.h"
+#include "convolutional_layer.h"
+#include "quant_kernels.h"
+#include "utils.h"
+
+#define TUNE_REPEATS 3
+
+static int has_winograd_weights(layer l)
+{
+    return l.weights_winograd != 0;
+}
+
+static int has_template_kernel(layer l)
+{
+    return select_convolutional_quant_kernel(l) != 0;
+}
+
+static conv_kernel conv_kernels[] = {
+    {"im2col_gemm", forward_convolutional_layer_quant_inputi_outputi, 0, 0, 0},
+    {"colsum_gemm_64", forward_convolutional_layer_quant_colsum, 64, 0, 0},
+    {"colsum_gemm_256", forward_convolutional_layer_quant_colsum, 256, 0, 0},
+    {"colsum_gemm_1024", forward_convolutional_layer_quant_colsum, 1024, 0, 0},
+    {"colsum_gemm", forward_convolutional_layer_quant_colsum, 0, 0, 0},
+    {"colsum_gemm_64_cols", forward_convolutional_layer_quant_colsum, 64, 1, 0},
+    {"colsum_gemm_256_cols", forward_convolutional_layer_quant_colsum, 256, 1, 0},
+    {"direct", forward_convolutional_layer_quant_direct, 0, 0, 0},
+    {"direct_rows", forward_convolutional_layer_quant_direct, 0, 1, 0},
+    {"template", forward_convolutional_layer_quant_template, 0, 0, has_template_kernel},
+    {"winograd_f2", forward_convolutional_layer_quant_winograd, 0, 0, has_winograd_weights},
+#ifdef OPENBLAS
+    {"mkl_int16", forward_convolutional_layer_quant_inputi_outputi_mkl, 0, 0, 0},
+#endif
+};
+
+static int conv_kernels_num()
+{
+    return sizeof(conv_kernels)/sizeof(conv_kernels[0]);
+}
+
+void get_cpu_signature(char *buffer, int size)
+{
+    char *model = 0;
+    int cores = 0;
+    char *line;
+    int i;
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    if(fp){
+        while((line = fgetl(fp)) != 0){
+            if(!model && 0 == strncmp(line, "model name", 10) && strchr(line, ':')){
+                model = copy_string(strchr(line, ':') + 1);
+                strip(model);
+            }
+            if(0 == strncmp(line, "processor", 9)) ++cores;
+            free(line);
+        }
+        fclose(fp);
+    }
+    snprintf(buffer, size, "%s/%d", model ? model : "generic", cores);
+    for(i = 0; buffer[i]; ++i){
+        if(buffer[i] == ' ') buffer[i] = '_';
+    }
+    if(model) free(model);
+}
+
+int is_tunable_layer(layer l)
+{
+    return l.type == CONVOLUTIONAL && l.layer_quant_flag && !l.close_quantization &&
+           !l.int4_flag && !l.binary && !l.xnor;
+}
+
+// every kernel is timed and checked against these, so layers that differ in any of them never share a winner
+static void get_layer_key(layer l, char *cpu, char *buffer, int size)
+{
+    snprintf(buffer, size, "%s %d %d %d %d %d %d %d %d %d %s %d %d %d", cpu, l.c, l.n, l.h, l.w, l.size, l.stride, l.groups, l.batch,
+            l.pad, get_activation_string(l.activation), l.binary, l.xnor, l.int4_flag);
+}
+
+static conv_kernel *find_conv_kernel(char *name)
+{
+    int i;
+    for(i = 0; i < conv_kernels_num(); ++i){
+        if(0 == strcmp(conv_kernels[i].name, name)) return &conv_kernels[i];
+    }
+    return 0;
+}
+
+static char **read_tune_cache(char *filename, int *n)
+{
+    int size = 16;
+    char **lines = calloc(size, sizeof(char *));
+    char *line;
+    *n = 0;
+    FILE *fp = fopen(filename, "r");
+    if(!fp) return lines;
+    while((line = fgetl(fp)) != 0){
+        if(line[0] == '\0' || line[0] == '#'){
+            free(line);
+            continue;
+        }
+        if(*n == size){
+            size *= 2;
+            lines = realloc(lines, size*sizeof(char *));
+        }
+        lines[(*n)++] = line;
+    }
+    fclose(fp);
+    return lines;
+}
+
+static int find_tune_entry(char **lines, int n, char *key)
+{
+    int i;
+    int len = strlen(key);
+    for(i = 0; i < n; ++i){
+        if(0 == strncmp(lines[i], key, len) && lines[i][len] == ' ') return i;
+    }
+    return -1;
+}
+
+static double time_conv_kernel(layer l, network net, conv_kernel *kernel)
+{
+    int i;
+    double best = 0;
+    l.forward = kernel->forward;
+    l.tune_tile = kernel->tile;
+    l.tune_split = kernel->split;
+    l.forward(l, net);
+    for(i = 0; i < TUNE_REPEATS; ++i){
+        double start = what_time_is_it_now();
+        l.forward(l, net);
+        double t = what_time_is_it_now() - start;
+        if(i == 0 || t < best) best = t;
+    }
+    return best;
+}
+
+static conv_kernel *autotune_layer(layer l, network *net)
+{
+    int i;
+    conv_kernel *best = 0;
+    double best_time = 0;
+    network tmp = *net;
+    tmp.train = 0;
+    tmp.input_uint8 = calloc(l.inputs*l.batch, sizeof(uint8_t));
+    for(i = 0; i < l.inputs*l.batch; ++i) tmp.input_uint8[i] = rand()%256;
+    for(i = 0; i < conv_kernels_num(); ++i){
+        conv_kernel *kernel = &conv_kernels[i];
+        if(kernel->supports && !kernel->supports(l)) continue;
+        double t = time_conv_kernel(l, tmp, kernel);
+        if(!best || t < best_time){
+            best = kernel;
+            best_time = t;
+        }
+    }
+    free(tmp.input_uint8);
+    printf("%5d conv %4d x%4d x%4d -> %4d  %-16s %8.3f ms\n", l.count, l.w, l.h, l.c, l.n, best->name, best_time*1000);
+    return best;
+}
+
+/*
+ * Pick a forward kernel for every quantized conv layer from the cache in filename.
+ * measure = 0 only applies cached entries, 1 also times layers the cache misses,
+ * 2 re-times every layer. New results are written back to the cache.
+ */
+void tune_network(network *net, char *filename, int measure)
+{
+    char cpu[256];
+    char key[512];
+    int i, n, changed = 0;
+    get_cpu_signature(cpu, sizeof(cpu));
+    char **lines = read_tune_cache(filename, &n);
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        if(!is_tunable_layer(*l)) continue;
+        get_layer_key(*l, cpu, key, sizeof(key));
+        int index = find_tune_entry(lines, n, key);
+        conv_kernel *kernel = 0;
+        if(index >= 0 && measure < 2){
+            kernel = find_conv_kernel(lines[index] + strlen(key) + 1);
+            if(kernel && kernel->supports && !kernel->supports(*l)) kernel = 0;
+        }
+        if(!kernel && measure){
+            kernel = autotune_layer(*l, net);
+            char *entry = calloc(strlen(key) + strlen(kernel->name) + 2, sizeof(char));
+            sprintf(entry, "%s %s", key, kernel->name);
+            if(index >= 0){
+                free(lines[index]);
+                lines[index] = entry;
+            }else{
+                lines = realloc(lines, (n + 1)*sizeof(char *));
+                lines[n++] = entry;
+            }
+            changed = 1;
+        }
+        if(kernel){
+            l->forward = kernel->forward;
+            l->tune_tile = kernel->tile;
+            l->tune_split = kernel->split;
+        }
+    }
+    if(changed){
+        FILE *fp = fopen(filename, "w");
+        if(!fp) file_error(filename);
+        fprintf(fp, "# cpu c n h w size stride groups batch pad activation binary xnor int4 kernel\n");
+        for(i = 0; i < n; ++i) fprintf(fp, "%s\n", lines[i]);
+        fclose(fp);
+        printf("Tuning cache written to %s\n", filename);
+    }
+    for(i = 0; i < n; ++i) free(lines[i]);
+    free(lines);
+}
@@ -0,0 +1,16 @@
+#ifndef TUNE_H
+#define TUNE_H
+#include "darknet.h"
+
+typedef struct{
+    char *name;
+    void (*forward)(struct layer, struct network);
+    int tile;
+    int split;
+    int (*supports)(layer l);
+} conv_kernel;
+
+void get_cpu_signature(char *buffer, int size);
+int is_tunable_layer(layer l);
+
+#endif
@@ -1,6 +1,7 @@
 #include "upsample_layer.h"
 #include "cuda.h"
 #include "blas.h"
+#include "quant_kernels.h"
 
 #include <stdio.h>
 
@@ -39,12 +40,14 @@ layer make_upsample_layer(int batch, int w, int h, int c, int stride, int layer_
     l.layer_quant_flag = layer_quant_flag;
     l.quant_stop_flag = quant_stop_flag;
     if(l.layer_quant_flag && !l.close_quantization){
-        l.forward = forward_upsample_layer_quant;
+        l.forward = select_upsample_quant_kernel(l);
+        if(!l.forward) l.forward = forward_upsample_layer_quant;
         // l.forward = forward_upsample_layer;
     }
     else{
         l.forward = forward_upsample_layer;
     }
+    if(l.layer_quant_flag && !l.reverse) l.forward_qat = forward_upsample_layer_qat;
 #endif
     l.backward = backward_upsample_layer;
     #ifdef GPU
@@ -73,6 +76,9 @@ void resize_upsample_layer(layer *l, int w, int h)
     l->inputs = l->h*l->w*l->c;
     l->delta =  realloc(l->delta, l->outputs*l->batch*sizeof(float));
     l->output = realloc(l->output, l->outputs*l->batch*sizeof(float));
+#ifdef QUANTIZATION
+    l->output_uint8_final = realloc(l->output_uint8_final, l->outputs*l->batch*sizeof(uint8_t));
+#endif
 
 #ifdef GPU
     cuda_free(l->output_gpu);
@@ -93,6 +99,12 @@ void forward_upsample_layer(const layer l, network net)
     }
 }
 
+void forward_upsample_layer_qat(const layer l, network net)
+{
+    forward_upsample_layer(l, net);
+    fake_quant_layer_output(l, net);
+}
+
 void forward_upsample_layer_quant(const layer l, network net)
 {
     fill_cpu_uint8(l.outputs*l.batch, 0, l.output_uint8_final, 1);
@@ -103,11 +115,8 @@ void forward_upsample_layer_quant(const layer l, network net)
     }
     if(l.quant_stop_flag){
         // printf("dequant from uint8 to float32 in layer %d\n", l.count);
-        for (int s = 0; s < l.out_c; ++s) {
-            for (int t = 0; t < l.out_w*l.out_h; ++t){
-                int out_index = s*l.out_w*l.out_h + t;
-                l.output[out_index] = (l.output_uint8_final[out_index] -  l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
-            }
+        for (int s = 0; s < l.outputs*l.batch; ++s) {
+            l.output[s] = (l.output_uint8_final[s] -  l.activ_data_uint8_zero_point[0]) * l.activ_data_uint8_scales[0];
         }
     }
 }
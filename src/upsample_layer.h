@@ -5,6 +5,7 @@
 
 layer make_upsample_layer(int batch, int w, int h, int c, int stride, int layer_quant_flag, int quant_stop_flag, int close_quantization);
 void forward_upsample_layer(const layer l, network net);
+void forward_upsample_layer_qat(const layer l, network net);
 void forward_upsample_layer_quant(const layer l, network net);
 void backward_upsample_layer(const layer l, network net);
 void resize_upsample_layer(layer *l, int w, int h);
@@ -58,6 +58,29 @@ int *read_intlist(char *gpu_list, int *ngpus, int d)
     return gpus;
 }
 
+float *read_floatlist(char *s, int *n, float d)
+{
+    float *list = 0;
+    if(s){
+        int len = strlen(s);
+        *n = 1;
+        int i;
+        for(i = 0; i < len; ++i){
+            if (s[i] == ',') ++*n;
+        }
+        list = calloc(*n, sizeof(float));
+        for(i = 0; i < *n; ++i){
+            list[i] = atof(s);
+            s = strchr(s, ',')+1;
+        }
+    } else {
+        list = calloc(1, sizeof(float));
+        *list = d;
+        *n = 1;
+    }
+    return list;
+}
+
 int *read_map(char *filename)
 {
     int n = 0;